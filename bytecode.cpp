@@ -0,0 +1,658 @@
+#include <cmath>
+#include <iostream>
+#include "bytecode.hpp"
+
+// Thresholds for the promotion of a function to the JIT
+static const unsigned HotCalls = 1000;
+static const unsigned HotBackedges = 100000;
+// Size (in registers) of the stack of the interpreter
+static const size_t StackSize = 1 << 20;
+// Smaller at compile time, where the recursion of the interpreted calls
+// runs on the stack of the compiler
+static const size_t FoldStackSize = 1 << 14;
+// Larger local arrays are left to the JIT
+static const int MaxInterpretedArray = 1024;
+// Native functions are called with at most this many arguments
+static const int MaxNativeArgs = 6;
+
+/************************* Bytecode functions ***************************/
+BytecodeFunction::BytecodeFunction(FunctionAST *AST):
+  AST(AST), Compiled(false), Interpretable(false), NArgs(AST->getProto()->getArgs().size()),
+  NRegs(0), Calls(0), Backedges(0), Native(nullptr) {};
+
+/************************** Bytecode builder ****************************/
+BytecodeBuilder::BytecodeBuilder(Interpreter &I, BytecodeFunction &Fn):
+  Top(0), I(I), Fn(Fn) {};
+
+// Allocates N consecutive registers and returns the first one
+int BytecodeBuilder::alloc(int N) {
+  int Reg = Top;
+  Top += N;
+  Fn.NRegs = std::max(Fn.NRegs, Top);
+  return Reg;
+}
+
+int BytecodeBuilder::mark() const {
+  return Top;
+}
+
+// Frees the registers allocated after Mark
+void BytecodeBuilder::release(int Mark) {
+  Top = Mark;
+}
+
+int BytecodeBuilder::emit(int Op, int A, int B, int C) {
+  Fn.Code.push_back(Instr{nullptr, Op, A, B, C});
+  return Fn.Code.size() - 1;
+}
+
+int BytecodeBuilder::constant(double Val) {
+  int Reg = alloc();
+  Fn.Consts.push_back(Val);
+  emit(OP_CONST, Reg, Fn.Consts.size() - 1);
+  return Reg;
+}
+
+// Address of the next instruction
+int BytecodeBuilder::here() const {
+  return Fn.Code.size();
+}
+
+// Sets the target of the jump At
+void BytecodeBuilder::patch(int At, int Target) {
+  Fn.Code[At].B = Target;
+}
+
+// Index of the function Name in the callee table, -1 if it cannot be called
+int BytecodeBuilder::callee(const std::string &Name, int NArgs) {
+  Callee C;
+  if (!I.resolve(Name, NArgs, C))
+    return -1;
+  Fn.Callees.push_back(C);
+  return Fn.Callees.size() - 1;
+}
+
+// Index of the global variable Name in the global table, -1 if it is not
+// a global variable
+int BytecodeBuilder::global(const std::string &Name, bool &IsArray) {
+  double *Addr = I.global(Name, IsArray);
+  if (!Addr)
+    return -1;
+  for (int i=0, e=Fn.Globals.size(); i<e; i++) {
+    if (Fn.Globals[i] == Addr)
+      return i;
+  }
+  Fn.Globals.push_back(Addr);
+  return Fn.Globals.size() - 1;
+}
+
+/************************ Bytecode of the AST ***************************/
+int NumberExprAST::bytecode(BytecodeBuilder& B) const {
+  return B.constant(Val);
+};
+
+int VariableExprAST::bytecode(BytecodeBuilder& B) const {
+  auto It = B.Vars.find(Name);
+  if (It != B.Vars.end()) {
+    // Whole-array expressions are left to the JIT
+    return It->second.second < 0 ? It->second.first : -1;
+  }
+  bool IsArray;
+  int G = B.global(Name, IsArray);
+  if (G < 0 || IsArray)
+    return -1;
+  int Reg = B.alloc();
+  B.emit(OP_LOADG, Reg, G);
+  return Reg;
+};
+
+int BinaryExprAST::bytecode(BytecodeBuilder& B) const {
+  int L = LHS->bytecode(B);
+  if (L < 0)
+    return -1;
+  int Reg = B.alloc();
+  if (Op == '!') {
+    B.emit(OP_NOT, Reg, L);
+    return Reg;
+  }
+  if (Op == '&' || Op == '|') {
+    // Short-circuit, as in the generated code: the left operand is the
+    // result unless it is true (for 'and') or false (for 'or')
+    B.emit(OP_MOV, Reg, L);
+    int Test = L;
+    if (Op == '|') {
+      Test = B.alloc();
+      B.emit(OP_NOT, Test, L);
+    }
+    int ToEnd = B.emit(OP_JMPF, Test);
+    int R = RHS->bytecode(B);
+    if (R < 0)
+      return -1;
+    B.emit(OP_MOV, Reg, R);
+    B.patch(ToEnd, B.here());
+    return Reg;
+  }
+  int R = RHS->bytecode(B);
+  if (R < 0)
+    return -1;
+  int Opcode;
+  switch (Op) {
+  case '+': Opcode = OP_ADD; break;
+  case '-': Opcode = OP_SUB; break;
+  case '*': Opcode = OP_MUL; break;
+  case '/': Opcode = OP_DIV; break;
+  case '<': Opcode = OP_LT; break;
+  case '=': Opcode = OP_EQ; break;
+  default:
+    return -1;
+  }
+  B.emit(Opcode, Reg, L, R);
+  return Reg;
+};
+
+int CallExprAST::bytecode(BytecodeBuilder& B) const {
+  int C = B.callee(Callee, Args.size());
+  if (C < 0)
+    return -1;
+  // The arguments are passed in consecutive registers
+  int First = B.alloc(Args.size());
+  for (int i=0, e=Args.size(); i<e; i++) {
+    int Arg = Args[i]->bytecode(B);
+    if (Arg < 0)
+      return -1;
+    B.emit(OP_MOV, First + i, Arg);
+  }
+  int Reg = B.alloc();
+  B.emit(OP_CALL, Reg, C, First);
+  return Reg;
+};
+
+int BranchHintAST::bytecode(BytecodeBuilder& B) const {
+  return Cond->bytecode(B);
+};
+
+int IfExprAST::bytecode(BytecodeBuilder& B) const {
+  int CondR = Cond->bytecode(B);
+  if (CondR < 0)
+    return -1;
+  int Reg = B.alloc();
+  int ToFalse = B.emit(OP_JMPF, CondR);
+  int TrueR = TrueExp->bytecode(B);
+  if (TrueR < 0)
+    return -1;
+  B.emit(OP_MOV, Reg, TrueR);
+  int ToEnd = B.emit(OP_JMP, 0);
+  B.patch(ToFalse, B.here());
+  int FalseR = FalseExp->bytecode(B);
+  if (FalseR < 0)
+    return -1;
+  B.emit(OP_MOV, Reg, FalseR);
+  B.patch(ToEnd, B.here());
+  return Reg;
+};
+
+int BlockAST::bytecode(BytecodeBuilder& B) const {
+  // The variables of the block (and their registers) live until its end
+  int Reg = B.alloc();
+  int Mark = B.mark();
+  std::map<std::string, std::pair<int,int>> Outer = B.Vars;
+  int Val = -1;
+  for (auto def : Def) {
+    if (def->bytecode(B) < 0)
+      return -1;
+  }
+  for (auto stmt : Stmts) {
+    Val = stmt->bytecode(B);
+    if (Val < 0)
+      return -1;
+  }
+  B.emit(OP_MOV, Reg, Val);
+  B.Vars = Outer;
+  B.release(Mark);
+  return Reg;
+};
+
+int VarBindingAST::bytecode(BytecodeBuilder& B) const {
+  int ValR = Val ? Val->bytecode(B) : B.constant(0.0);
+  if (ValR < 0)
+    return -1;
+  int Reg = B.alloc();
+  B.emit(OP_MOV, Reg, ValR);
+  B.Vars[Name] = std::make_pair(Reg, -1);
+  return Reg;
+};
+
+int FunctionAST::bytecode(BytecodeBuilder& B) const {
+  const std::vector<std::string> &Args = Proto->getArgs();
+  for (int i=0, e=Args.size(); i<e; i++) {
+    if (Proto->getArrayArgs()[i])
+      return -1;
+    B.Vars[Args[i]] = std::make_pair(B.alloc(), -1);
+  }
+  int Val = Body->bytecode(B);
+  if (Val < 0)
+    return -1;
+  B.emit(OP_RET, Val);
+  return Val;
+};
+
+int AssignmentAST::bytecode(BytecodeBuilder& B) const {
+  auto It = B.Vars.find(Name);
+  bool IsArray = false;
+  int G = It == B.Vars.end() ? B.global(Name, IsArray) : -1;
+  // Whole-array assignments are left to the JIT
+  if ((It != B.Vars.end() && It->second.second >= 0) || IsArray)
+    return -1;
+  if (It == B.Vars.end() && G < 0)
+    return -1;
+  int Reg = Val->bytecode(B);
+  if (Reg < 0)
+    return -1;
+  if (G >= 0)
+    B.emit(OP_STOREG, Reg, G);
+  else
+    B.emit(OP_MOV, It->second.first, Reg);
+  return Reg;
+};
+
+int IfStmtAST::bytecode(BytecodeBuilder& B) const {
+  int CondR = Cond->bytecode(B);
+  if (CondR < 0)
+    return -1;
+  int ToFalse = B.emit(OP_JMPF, CondR);
+  if (TrueStmt->bytecode(B) < 0)
+    return -1;
+  if (FalseStmt) {
+    int ToEnd = B.emit(OP_JMP, 0);
+    B.patch(ToFalse, B.here());
+    if (FalseStmt->bytecode(B) < 0)
+      return -1;
+    B.patch(ToEnd, B.here());
+  } else {
+    B.patch(ToFalse, B.here());
+  }
+  return B.constant(0.0);
+};
+
+int ForInitAST::bytecode(BytecodeBuilder& B) const {
+  return Init->bytecode(B);
+};
+
+int ForStmtAST::bytecode(BytecodeBuilder& B) const {
+  std::map<std::string, std::pair<int,int>> Outer = B.Vars;
+  if (Init && Init->bytecode(B) < 0)
+    return -1;
+  int Header = B.here();
+  int CondR = Cond->bytecode(B);
+  if (CondR < 0)
+    return -1;
+  int ToExit = B.emit(OP_JMPF, CondR);
+  B.Loops.push_back({Label, {}, {}});
+  if (Body->bytecode(B) < 0)
+    return -1;
+  BytecodeLoop Loop = B.Loops.back();
+  B.Loops.pop_back();
+  for (int At : Loop.Continues)
+    B.patch(At, B.here());
+  if (Update && Update->bytecode(B) < 0)
+    return -1;
+  B.emit(OP_LOOP, 0, Header);
+  B.patch(ToExit, B.here());
+  for (int At : Loop.Breaks)
+    B.patch(At, B.here());
+  B.Vars = Outer;
+  return B.constant(0.0);
+};
+
+int BreakStmtAST::bytecode(BytecodeBuilder& B) const {
+  auto Target = B.Loops.rbegin();
+  while (!Label.empty() && Target != B.Loops.rend() && Target->Label != Label)
+    ++Target;
+  if (Target == B.Loops.rend())
+    return -1;
+  int At = B.emit(OP_JMP, 0);
+  (Continue ? Target->Continues : Target->Breaks).push_back(At);
+  return B.constant(0.0);
+};
+
+int ArrayBindingAST::bytecode(BytecodeBuilder& B) const {
+  if (onHeap() || Size > MaxInterpretedArray || Dims.size() > 1)
+    return -1;
+  if (ExprList.size() && (int)ExprList.size() != Size)
+    return -1;
+  std::vector<int> Vals;
+  for (auto exp : ExprList) {
+    Vals.push_back(exp->bytecode(B));
+    if (Vals.back() < 0)
+      return -1;
+  }
+  int Base = B.alloc(Size);
+  for (int i=0, e=Vals.size(); i<e; i++)
+    B.emit(OP_MOV, Base + i, Vals[i]);
+  B.Vars[Name] = std::make_pair(Base, Size);
+  return Base;
+};
+
+// Base register (or global index) of an array accessed element by element.
+// Returns the opcode to use, -1 if the array is not supported
+static int ArrayAccess(BytecodeBuilder& B, const std::string &Name, int &Base, bool Store) {
+  auto It = B.Vars.find(Name);
+  if (It != B.Vars.end()) {
+    if (It->second.second < 0)
+      return -1;
+    Base = It->second.first;
+    return Store ? OP_STORER : OP_LOADR;
+  }
+  bool IsArray;
+  Base = B.global(Name, IsArray);
+  if (Base < 0 || !IsArray)
+    return -1;
+  return Store ? OP_STOREGE : OP_LOADGE;
+}
+
+int ArrayExprAST::bytecode(BytecodeBuilder& B) const {
+  int Base;
+  int Op = ArrayAccess(B, Name, Base, false);
+  if (Op < 0 || Indices.size() > 1)
+    return -1;
+  int IndexR = Indices[0]->bytecode(B);
+  if (IndexR < 0)
+    return -1;
+  int Reg = B.alloc();
+  B.emit(Op, Reg, Base, IndexR);
+  return Reg;
+};
+
+int ArrayAssignmentAST::bytecode(BytecodeBuilder& B) const {
+  int Base;
+  int Op = ArrayAccess(B, Name, Base, true);
+  if (Op < 0 || Indices.size() > 1)
+    return -1;
+  int IndexR = Indices[0]->bytecode(B);
+  if (IndexR < 0)
+    return -1;
+  int Reg = Val->bytecode(B);
+  if (Reg < 0)
+    return -1;
+  B.emit(Op, Reg, Base, IndexR);
+  return Reg;
+};
+
+/***************************** Interpreter ******************************/
+Interpreter::Interpreter(driver &drv, KaleidoscopeJIT &JIT):
+  drv(drv), JIT(&JIT), Stack(StackSize), SP(0), Steps(~0UL) {};
+
+Interpreter::Interpreter(driver &drv):
+  drv(drv), JIT(nullptr), Stack(FoldStackSize), SP(0), Steps(0) {};
+
+// Ends a compile-time evaluation: the interpreted calls return one after the other
+double Interpreter::stop(const std::string &Why) {
+  if (Failure.empty())
+    Failure = Why;
+  Steps = 0;
+  return 0.0;
+}
+
+// Calls native code with the arguments Args[0], ..., Args[N-1]
+static double CallNative(void *Addr, int N, double *Args) {
+  typedef double D;
+  switch (N) {
+  case 0: return ((D(*)())Addr)();
+  case 1: return ((D(*)(D))Addr)(Args[0]);
+  case 2: return ((D(*)(D,D))Addr)(Args[0], Args[1]);
+  case 3: return ((D(*)(D,D,D))Addr)(Args[0], Args[1], Args[2]);
+  case 4: return ((D(*)(D,D,D,D))Addr)(Args[0], Args[1], Args[2], Args[3]);
+  case 5: return ((D(*)(D,D,D,D,D))Addr)(Args[0], Args[1], Args[2], Args[3], Args[4]);
+  default: return ((D(*)(D,D,D,D,D,D))Addr)(Args[0], Args[1], Args[2], Args[3], Args[4], Args[5]);
+  }
+}
+
+// Registers a function, whose bytecode is generated when it is first called
+void Interpreter::add(FunctionAST *AST) {
+  std::string Name = std::get<std::string>(AST->getProto()->getLexVal());
+  Functions[Name] = std::make_unique<BytecodeFunction>(AST);
+}
+
+// Math builtins evaluated by the compiler, the same as the intrinsics of
+// their calls (see MathIntrinsic in driver.cpp)
+static void *MathFunction(const std::string &Name, int NArgs) {
+  typedef double D;
+  static const std::map<std::string, std::pair<void*, int>> Functions = {
+    {"floor", {(void*)(D(*)(D))[](D x) { return std::floor(x); }, 1}},
+    {"ceil",  {(void*)(D(*)(D))[](D x) { return std::ceil(x); }, 1}},
+    {"sqrt",  {(void*)(D(*)(D))[](D x) { return std::sqrt(x); }, 1}},
+    {"fabs",  {(void*)(D(*)(D))[](D x) { return std::fabs(x); }, 1}},
+    {"sin",   {(void*)(D(*)(D))[](D x) { return std::sin(x); }, 1}},
+    {"cos",   {(void*)(D(*)(D))[](D x) { return std::cos(x); }, 1}},
+    {"exp",   {(void*)(D(*)(D))[](D x) { return std::exp(x); }, 1}},
+    {"log",   {(void*)(D(*)(D))[](D x) { return std::log(x); }, 1}},
+    {"pow",   {(void*)(D(*)(D,D))[](D x, D y) { return std::pow(x, y); }, 2}},
+    {"min",   {(void*)(D(*)(D,D))[](D x, D y) { return std::fmin(x, y); }, 2}},
+    {"max",   {(void*)(D(*)(D,D))[](D x, D y) { return std::fmax(x, y); }, 2}},
+    {"fma",   {(void*)(D(*)(D,D,D))[](D x, D y, D z) { return std::fma(x, y, z); }, 3}}
+  };
+  auto It = Functions.find(Name);
+  if (It == Functions.end() || It->second.second != NArgs)
+    return nullptr;
+  return It->second.first;
+}
+
+bool Interpreter::resolve(const std::string &Name, int NArgs, Callee &C) {
+  // At compile time the pure functions are added when first called
+  auto Pure = drv.PureFunctions.find(Name);
+  if (!JIT && Pure != drv.PureFunctions.end() && !Functions.count(Name))
+    add(Pure->second);
+  auto It = Functions.find(Name);
+  if (It != Functions.end()) {
+    C = Callee{It->second.get(), nullptr, NArgs};
+    return It->second->NArgs == NArgs;
+  }
+  // Extern functions with scalar parameters are called natively
+  auto Proto = drv.Prototypes.find(Name);
+  if (Proto == drv.Prototypes.end() || NArgs > MaxNativeArgs ||
+      (int)Proto->second->getArgs().size() != NArgs)
+    return false;
+  for (bool IsArray : Proto->second->getArrayArgs()) {
+    if (IsArray)
+      return false;
+  }
+  if (!JIT) {
+    bool Builtin = drv.builtins && !drv.uses(Name);
+    C = Callee{nullptr, Builtin ? MathFunction(Name, NArgs) : nullptr, NArgs};
+    return C.Native != nullptr;
+  }
+  C = Callee{nullptr, JIT->lookup(Name), NArgs};
+  return C.Native != nullptr;
+}
+
+double *Interpreter::global(const std::string &Name, bool &IsArray) {
+  // Globals do not exist yet at compile time (pure functions do not use them)
+  auto It = drv.GlobalTypes.find(Name);
+  if (!JIT || It == drv.GlobalTypes.end())
+    return nullptr;
+  IsArray = It->second->isArrayTy();
+  // Multi-dimensional arrays and arrays of records are left to the JIT
+  if (It->second->isStructTy() ||
+      (IsArray && It->second->getArrayElementType()->isAggregateType()))
+    return nullptr;
+  return static_cast<double*>(JIT->lookup(Name));
+}
+
+void Interpreter::compile(BytecodeFunction *Fn) {
+  BytecodeBuilder B(*this, *Fn);
+  Fn->Interpretable = Fn->NArgs <= MaxNativeArgs && Fn->AST->bytecode(B) >= 0;
+  Fn->Compiled = true;
+  // The indices of the local arrays are not checked: at compile time an
+  // access out of bounds would write into the compiler
+  if (!JIT) {
+    for (const Instr &I : Fn->Code) {
+      if (I.Op == OP_LOADR || I.Op == OP_STORER)
+        Fn->Interpretable = false;
+    }
+  }
+}
+
+// From now on the function is called through the JIT
+void Interpreter::promote(BytecodeFunction *Fn) {
+  Fn->Native = JIT->lookup(std::get<std::string>(Fn->AST->getProto()->getLexVal()));
+}
+
+double Interpreter::call(BytecodeFunction *Fn, double *Args) {
+  if (!Fn->Native) {
+    if (!Fn->Compiled)
+      compile(Fn);
+    // At compile time there is no native code to fall back to
+    if (!JIT) {
+      std::string Name = std::get<std::string>(Fn->AST->getProto()->getLexVal());
+      if (!Fn->Interpretable)
+        return stop(Name+" cannot be evaluated at compile time");
+      if (!Steps || !--Steps)
+        return stop("the budget of "+std::to_string(drv.constexprsteps)+" steps is exhausted");
+      return run(Fn, Args);
+    }
+    if (!Fn->Interpretable || ++Fn->Calls > HotCalls || Fn->Backedges > HotBackedges)
+      promote(Fn);
+  }
+  if (Fn->Native)
+    return CallNative(Fn->Native, Fn->NArgs, Args);
+  return run(Fn, Args);
+}
+
+// Runs the function in a new frame
+double Interpreter::run(BytecodeFunction *Fn, double *Args) {
+  if (SP + Fn->NRegs > Stack.size()) {
+    if (!JIT)
+      return stop("the calls are nested too deeply");
+    std::cerr << "Interpreter stack overflow" << std::endl;
+    exit(1);
+  }
+  double *R = &Stack[SP];
+  std::copy(Args, Args + Fn->NArgs, R);
+  SP += Fn->NRegs;
+  double Result = execute(Fn, R);
+  SP -= Fn->NRegs;
+  return Result;
+}
+
+// Runs a top-level expression, if it can be interpreted
+bool Interpreter::evaluate(FunctionAST *AST, double &Result) {
+  BytecodeFunction Fn(AST);
+  compile(&Fn);
+  if (!Fn.Interpretable)
+    return false;
+  Result = run(&Fn, nullptr);
+  return true;
+}
+
+// Direct-threaded interpreter: each instruction holds the address of the
+// code that runs it (computed goto), so dispatching is a single indirect jump
+double Interpreter::execute(BytecodeFunction *Fn, double *R) {
+  static const void *Handlers[] = {
+    &&op_const, &&op_mov, &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_lt, &&op_eq,
+    &&op_not, &&op_jmp, &&op_jmpf, &&op_loop, &&op_loadg, &&op_storeg,
+    &&op_loadr, &&op_storer, &&op_loadge, &&op_storege, &&op_call, &&op_ret
+  };
+  Instr *Code = Fn->Code.data();
+  if (!Code[0].Handler) {
+    for (auto &I : Fn->Code)
+      I.Handler = Handlers[I.Op];
+  }
+  const double *K = Fn->Consts.data();
+  double **G = Fn->Globals.data();
+  const Instr *IP = Code;
+
+#define DISPATCH() goto *IP->Handler
+#define NEXT() ++IP; DISPATCH()
+  DISPATCH();
+op_const:
+  R[IP->A] = K[IP->B]; NEXT();
+op_mov:
+  R[IP->A] = R[IP->B]; NEXT();
+op_add:
+  R[IP->A] = R[IP->B] + R[IP->C]; NEXT();
+op_sub:
+  R[IP->A] = R[IP->B] - R[IP->C]; NEXT();
+op_mul:
+  R[IP->A] = R[IP->B] * R[IP->C]; NEXT();
+op_div:
+  R[IP->A] = R[IP->B] / R[IP->C]; NEXT();
+op_lt:
+  R[IP->A] = !(R[IP->B] >= R[IP->C]); NEXT();
+op_eq:
+  R[IP->A] = !(R[IP->B] < R[IP->C] || R[IP->B] > R[IP->C]); NEXT();
+op_not:
+  R[IP->A] = R[IP->B] == 0; NEXT();
+op_jmp:
+  IP = Code + IP->B; DISPATCH();
+op_jmpf:
+  if (R[IP->A] == 0) {
+    IP = Code + IP->B; DISPATCH();
+  }
+  NEXT();
+op_loop:
+  Fn->Backedges++;
+  if (!--Steps)
+    return stop("the budget of "+std::to_string(drv.constexprsteps)+" steps is exhausted");
+  IP = Code + IP->B; DISPATCH();
+op_loadg:
+  R[IP->A] = *G[IP->B]; NEXT();
+op_storeg:
+  *G[IP->B] = R[IP->A]; NEXT();
+op_loadr:
+  R[IP->A] = R[IP->B + (unsigned)R[IP->C]]; NEXT();
+op_storer:
+  R[IP->B + (unsigned)R[IP->C]] = R[IP->A]; NEXT();
+op_loadge:
+  R[IP->A] = G[IP->B][(unsigned)R[IP->C]]; NEXT();
+op_storege:
+  G[IP->B][(unsigned)R[IP->C]] = R[IP->A]; NEXT();
+op_call: {
+    const Callee &C = Fn->Callees[IP->B];
+    double *Args = R + IP->C;
+    R[IP->A] = C.Fn ? call(C.Fn, Args) : CallNative(C.Native, C.NArgs, Args);
+    if (!Steps)
+      return 0.0;
+    NEXT();
+  }
+op_ret:
+  return R[IP->A];
+#undef NEXT
+#undef DISPATCH
+}
+
+// Evaluates the call of a pure function (or math builtin) with constant
+// arguments. Fails if the function cannot be interpreted, calls something
+// that is neither, or needs more than drv.constexprsteps steps
+bool Interpreter::fold(const std::string &Name, const std::vector<double> &Args, double &Result,
+                       std::string &Why) {
+  // Functions defined again (in the REPL) are compiled again
+  for (auto &Fn : Functions) {
+    auto Pure = drv.PureFunctions.find(Fn.first);
+    if (Pure == drv.PureFunctions.end() || Pure->second != Fn.second->AST) {
+      Functions.clear();
+      break;
+    }
+  }
+  Callee C;
+  if (!resolve(Name, Args.size(), C)) {
+    Why = Name+" cannot be evaluated at compile time";
+    return false;
+  }
+  std::vector<double> ArgsV(Args);
+  Steps = drv.constexprsteps;
+  Failure.clear();
+  SP = 0;
+  Result = C.Fn ? call(C.Fn, ArgsV.data()) : CallNative(C.Native, C.NArgs, ArgsV.data());
+  if (!Steps) {
+    Why = Failure;
+    return false;
+  }
+  return true;
+}
+
+bool driver::fold(const std::string &Name, const std::vector<double> &Args, double &Result,
+                  std::string &Why) {
+  if (!Folder)
+    Folder = std::make_shared<Interpreter>(*this);
+  return Folder->fold(Name, Args, Result, Why);
+}
@@ -0,0 +1,128 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+#include "driver.hpp"
+#include "jit.hpp"
+
+// Register-based bytecode, run by the interpreter of kcomp -run -interp.
+// Every value is a double held in a register of the frame of the call;
+// local arrays are ranges of consecutive registers. Conditions are 0 or 1
+enum Opcode {
+  OP_CONST,   // R[A] = Consts[B]
+  OP_MOV,     // R[A] = R[B]
+  OP_ADD,     // R[A] = R[B] + R[C]
+  OP_SUB,     // R[A] = R[B] - R[C]
+  OP_MUL,     // R[A] = R[B] * R[C]
+  OP_DIV,     // R[A] = R[B] / R[C]
+  OP_LT,      // R[A] = R[B] < R[C]   (true if unordered, like fcmp ult)
+  OP_EQ,      // R[A] = R[B] == R[C]  (true if unordered, like fcmp ueq)
+  OP_NOT,     // R[A] = not R[B]
+  OP_JMP,     // goto B
+  OP_JMPF,    // if not R[A] goto B
+  OP_LOOP,    // goto B (loop backedge, counted for promotion)
+  OP_LOADG,   // R[A] = *Globals[B]
+  OP_STOREG,  // *Globals[B] = R[A]
+  OP_LOADR,   // R[A] = R[B + R[C]]       (local arrays)
+  OP_STORER,  // R[B + R[C]] = R[A]
+  OP_LOADGE,  // R[A] = Globals[B][R[C]]  (global arrays)
+  OP_STOREGE, // Globals[B][R[C]] = R[A]
+  OP_CALL,    // R[A] = Callees[B](R[C], R[C+1], ...)
+  OP_RET      // return R[A]
+};
+
+struct Instr {
+  const void *Handler;  // Address of the code running the instruction (see execute)
+  int Op;
+  int A, B, C;
+};
+
+class BytecodeFunction;
+
+// Function called by an OP_CALL: a Kaleidoscope function (interpreted or
+// promoted to native code) or an extern one
+struct Callee {
+  BytecodeFunction *Fn;
+  void *Native;
+  int NArgs;
+};
+
+class BytecodeFunction {
+public:
+  BytecodeFunction(FunctionAST *AST);
+  FunctionAST *AST;
+  bool Compiled;        // The bytecode has been generated
+  bool Interpretable;   // The function only uses constructs known to the interpreter
+  int NArgs;
+  int NRegs;
+  std::vector<Instr> Code;
+  std::vector<double> Consts;
+  std::vector<double*> Globals;
+  std::vector<Callee> Callees;
+  unsigned Calls;       // Profile used to promote hot functions to the JIT
+  unsigned Backedges;
+  void *Native;         // Code compiled by the JIT, once promoted
+};
+
+class Interpreter;
+
+// Loop being generated: its break and continue jumps are patched at the end
+struct BytecodeLoop {
+  std::string Label;
+  std::vector<int> Breaks, Continues;
+};
+
+// Generates the bytecode of a function from its AST (see the bytecode
+// methods of the AST classes). Registers are allocated as a stack: the
+// parameters come first, then variables and temporaries
+class BytecodeBuilder {
+private:
+  int Top;
+public:
+  BytecodeBuilder(Interpreter &I, BytecodeFunction &Fn);
+  Interpreter &I;
+  BytecodeFunction &Fn;
+  std::map<std::string, std::pair<int,int>> Vars; // Register and size (-1 for scalars)
+  std::vector<BytecodeLoop> Loops;
+  int alloc(int N = 1);
+  int mark() const;
+  void release(int Mark);
+  int emit(int Op, int A, int B = 0, int C = 0);
+  int constant(double Val);
+  int here() const;
+  void patch(int At, int Target);
+  int callee(const std::string &Name, int NArgs);
+  int global(const std::string &Name, bool &IsArray);
+};
+
+// Interpreter of the bytecode with hot-function promotion: a function called
+// often enough, or running many loop iterations, is compiled by the JIT
+// (lazily, see KaleidoscopeJIT::addLazyFunction) and called natively from then on.
+// Without a JIT it evaluates the calls of pure functions at compile time
+// (see driver::fold): only pure functions and math builtins can be called,
+// and every call and loop iteration is a step of a limited budget
+class Interpreter {
+private:
+  driver &drv;
+  KaleidoscopeJIT *JIT;       // nullptr at compile time
+  std::map<std::string, std::unique_ptr<BytecodeFunction>> Functions;
+  std::vector<double> Stack;  // Frames of the interpreted calls
+  size_t SP;
+  unsigned long Steps;        // Steps left, 0 once the evaluation has failed
+  std::string Failure;        // Why it has failed
+  double stop(const std::string &Why);
+  void compile(BytecodeFunction *Fn);
+  void promote(BytecodeFunction *Fn);
+  double call(BytecodeFunction *Fn, double *Args);
+  double run(BytecodeFunction *Fn, double *Args);
+  double execute(BytecodeFunction *Fn, double *R);
+public:
+  Interpreter(driver &drv, KaleidoscopeJIT &JIT);
+  Interpreter(driver &drv);   // Compile-time evaluation
+  void add(FunctionAST *AST);
+  bool evaluate(FunctionAST *AST, double &Result);
+  bool fold(const std::string &Name, const std::vector<double> &Args, double &Result,
+            std::string &Why);
+  bool resolve(const std::string &Name, int NArgs, Callee &C);
+  double *global(const std::string &Name, bool &IsArray);
+};
+
+#endif // ! BYTECODE_HPP
@@ -1,17 +1,42 @@
 #include "driver.hpp"
 #include "parser.hpp"
+#include "runtime/krt.h"
 
 // Generazione di un'istanza per ciascuna della classi LLVMContext,
 // Module e IRBuilder. Nel caso di singolo modulo è sufficiente
-LLVMContext *context = new LLVMContext;
-Module *module = new Module("Kaleidoscope", *context);
-IRBuilder<> *builder = new IRBuilder(*context);
+// (each thread of the compile server has its own, see server.cpp)
+thread_local LLVMContext *context = new LLVMContext;
+thread_local Module *module = new Module("Kaleidoscope", *context);
+thread_local IRBuilder<> *builder = new IRBuilder(*context);
+
+// Streams of the diagnostics and the IR (stderr) and of the remarks
+// (stdout), redirected by the compile server to the reply of a request
+static thread_local raw_ostream *ErrStream = nullptr;
+static thread_local raw_ostream *OutStream = nullptr;
+
+raw_ostream &errStream() {
+  return ErrStream ? *ErrStream : errs();
+}
+
+raw_ostream &outStream() {
+  return OutStream ? *OutStream : outs();
+}
+
+void redirectOutput(raw_ostream *Err, raw_ostream *Out) {
+  ErrStream = Err;
+  OutStream = Out;
+}
 
 Value *LogErrorV(const std::string Str) {
-  std::cerr << Str << std::endl;
+  errStream() << Str << "\n";
   return nullptr;
 }
 
+// Type of the numbers of the language: double, or float with -fsingle
+Type *driver::numberType() const {
+  return single ? Type::getFloatTy(*context) : Type::getDoubleTy(*context);
+}
+
 /* Il codice seguente sulle prime non è semplice da comprendere.
    Esso definisce una utility (funzione C++) con due parametri:
    1) la rappresentazione di una funzione llvm IR, e
@@ -24,49 +49,1158 @@ Value *LogErrorV(const std::string Str) {
    interferire con il builder globale, la generazione viene dunque effettuata
    con un builder temporaneo TmpB
 */
-static AllocaInst *CreateEntryBlockAlloca(Function *fun, StringRef VarName) {
+static AllocaInst *CreateEntryBlockAlloca(Function *fun, StringRef VarName, Type *Ty) {
   IRBuilder<> TmpB(&fun->getEntryBlock(), fun->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(*context), nullptr, VarName);
+  return TmpB.CreateAlloca(Ty, nullptr, VarName);
 }
 
-// Implementazione del costruttore della classe driver
-driver::driver(): trace_parsing(false), trace_scanning(false) {};
+static AllocaInst *CreateEntryBlockAlloca(driver& drv, Function *fun, StringRef VarName) {
+  return CreateEntryBlockAlloca(fun, VarName, drv.numberType());
+}
+
+// Looks up the function Name in the module. In the REPL and with -threads
+// every top-level item is compiled into its own module, so the functions
+// defined by the previous items are declared again (from their prototype)
+// the first time they are used
+static Function *LookupFunction(driver& drv, const std::string &Name) {
+  Function *F = module->getFunction(Name);
+  if (!F && drv.previous(Name) && drv.Prototypes.count(Name)) {
+    F = drv.Prototypes[Name]->codegen(drv);
+  }
+  return F;
+}
+
+// Looks up the global variable Name in the module, like LookupFunction
+static GlobalVariable *LookupGlobal(driver& drv, const std::string &Name) {
+  GlobalVariable *GlobalVar = module->getGlobalVariable(Name);
+  if (!GlobalVar && drv.previous(Name) && drv.GlobalTypes.count(Name)) {
+    GlobalVar = new GlobalVariable(*module, drv.GlobalTypes[Name], false,
+                                   GlobalValue::ExternalLinkage, nullptr, Name);
+  }
+  return GlobalVar;
+}
+
+// Declares a function of the runtime library (libkrt.a), printing the
+// declaration the first time it is used. SetAttrs adds its attributes
+static Function *RuntimeFunction(driver& drv, const std::string &Name, FunctionType *FT,
+                                 function_ref<void(Function*)> SetAttrs = nullptr) {
+  Function *F = module->getFunction(Name);
+  if (!F) {
+    F = Function::Create(FT, Function::ExternalLinkage, Name, *module);
+    if (SetAttrs) {
+      SetAttrs(F);
+    }
+    drv.emit(F);
+  }
+  return F;
+}
+
+/*************************** Array utilities ****************************/
+// Gets the array Name, i.e. the address of its storage, and its type: an
+// array type for global arrays and local arrays stored in place, a pointer
+// type for local variables holding the address of an array (arrays
+// allocated in the arena or captured by a parfor body). Returns nullptr if
+// Name is not an array
+static Value *ArrayBase(driver& drv, const std::string &Name, Type *&BaseType) {
+  Value *Base = nullptr;
+  AllocaInst *Alloca = drv.NamedValues[Name];
+  GlobalVariable *GlobalVar = Alloca ? nullptr : LookupGlobal(drv, Name);
+  if (Alloca) {
+    Base = Alloca;
+    BaseType = Alloca->getAllocatedType();
+  } else if (GlobalVar) {
+    Base = GlobalVar;
+    BaseType = GlobalVar->getValueType();
+  } else {
+    return nullptr;
+  }
+  if (!BaseType->isArrayTy() && !BaseType->isPointerTy()) {
+    return nullptr;
+  }
+  // Arrays of records are accessed one field at a time (see FieldPtr)
+  if (BaseType->isArrayTy() && BaseType->getArrayElementType()->isStructTy()) {
+    return nullptr;
+  }
+  return Base;
+}
+
+static bool IsArray(driver& drv, const std::string &Name) {
+  Type *BaseType = nullptr;
+  return ArrayBase(drv, Name, BaseType) != nullptr;
+}
+
+// Type of the elements of the first dimension of an array: a number, or
+// the array type of a row for multi-dimensional arrays, whose elements are
+// stored contiguously in row-major order
+static Type *RowType(driver& drv, Value *Base, Type *BaseType) {
+  if (BaseType->isArrayTy()) {
+    return BaseType->getArrayElementType();
+  }
+  auto It = drv.RowTypes.find(dyn_cast<AllocaInst>(Base));
+  return It != drv.RowTypes.end() ? It->second : drv.numberType();
+}
+
+// Number of elements of an array type, over all of its dimensions
+static uint64_t NumElements(Type *Ty) {
+  uint64_t N = 1;
+  for (; Ty->isArrayTy(); Ty = Ty->getArrayElementType()) {
+    N *= Ty->getArrayNumElements();
+  }
+  return N;
+}
+
+// Number of elements of the array Name (an i64 value), or nullptr when
+// it is not known at compile time
+static Value *ArrayLength(driver& drv, const std::string &Name) {
+  Type *BaseType = nullptr;
+  Value *Base = ArrayBase(drv, Name, BaseType);
+  if (!Base) {
+    return nullptr;
+  }
+  if (BaseType->isArrayTy()) {
+    return ConstantInt::get(Type::getInt64Ty(*context), NumElements(BaseType));
+  }
+  // Arrays allocated in the arena: the length has been computed by their binding
+  auto It = drv.ArrayLengths.find(dyn_cast<AllocaInst>(Base));
+  return It != drv.ArrayLengths.end() ? It->second : nullptr;
+}
+
+// Generates the address of the element of an array at the (integer) index IndexInt.
+// Multi-dimensional arrays are indexed as a whole, in row-major order
+static Value *ElementPtr(driver& drv, const std::string &Name, Value *Base, Type *BaseType, Value *IndexInt) {
+  if (BaseType->isPointerTy()) {
+    Value *Ptr = builder->CreateLoad(BaseType, Base, Name+"ptr");
+    return builder->CreateInBoundsGEP(drv.numberType(), Ptr, IndexInt);
+  }
+  if (BaseType->getArrayElementType()->isArrayTy()) {
+    return builder->CreateInBoundsGEP(drv.numberType(), Base, IndexInt);
+  }
+  Constant *BaseIndex = ConstantInt::get(IndexInt->getType(), 0);
+  return builder->CreateInBoundsGEP(BaseType, Base, {BaseIndex, IndexInt});
+}
+
+// Record of the elements of the global array GlobalVar, nullptr if it is
+// not an array of records
+static const Record *RecordOf(driver& drv, GlobalVariable *GlobalVar) {
+  auto It = drv.RecordArrays.find(GlobalVar->getName().str());
+  if (It == drv.RecordArrays.end()) {
+    return nullptr;
+  }
+  auto R = drv.Records.find(It->second);
+  return R != drv.Records.end() ? &R->second : nullptr;
+}
+
+// Generates the address of the field Field of the element Name[Index] of an
+// array of records. The source is the same for both layouts: only the order
+// of the indices of the GEP changes
+static Value *FieldPtr(driver& drv, const std::string &Name, ExprAST *Index, const std::string &Field) {
+  GlobalVariable *GlobalVar = drv.NamedValues[Name] ? nullptr : LookupGlobal(drv, Name);
+  if (!GlobalVar) {
+    if (!drv.NamedValues[Name]) {
+      return LogErrorV("Variable "+Name+" not defined");
+    }
+    return LogErrorV("Variable "+Name+" is not an array of records");
+  }
+  const Record *R = RecordOf(drv, GlobalVar);
+  if (!R) {
+    return LogErrorV("Variable "+Name+" is not an array of records");
+  }
+  auto F = std::find(R->Fields.begin(), R->Fields.end(), Field);
+  if (F == R->Fields.end()) {
+    return LogErrorV("Record "+R->Name+" has no field "+Field);
+  }
+
+  Value *IndexFP = Index->codegen(drv);
+  if (!IndexFP) {
+    return nullptr;
+  }
+  Type *IndexType = IntegerType::get(*context, 32);
+  Value *IndexInt = builder->CreateFPToUI(IndexFP, IndexType);
+  Constant *Zero = ConstantInt::get(IndexType, 0);
+  Constant *FieldIndex = ConstantInt::get(IndexType, F - R->Fields.begin());
+  Type *BaseType = GlobalVar->getValueType();
+  if (BaseType->isStructTy()) {
+    return builder->CreateInBoundsGEP(BaseType, GlobalVar, {Zero, FieldIndex, IndexInt}, Name+"."+Field);
+  }
+  return builder->CreateInBoundsGEP(BaseType, GlobalVar, {Zero, IndexInt, FieldIndex}, Name+"."+Field);
+}
+
+// Generates the address of the element Name[Index1][Index2]..., with one
+// index for each dimension of the array
+static Value *ArrayElementPtr(driver& drv, const std::string &Name, const std::vector<ExprAST*> &Indices) {
+  // Gets array base pointer
+  Type *BaseType = nullptr;
+  Value *Base = ArrayBase(drv, Name, BaseType);
+
+  // Checks if the variable has been previously defined and is an array
+  if (!Base) {
+    GlobalVariable *GlobalVar = drv.NamedValues[Name] ? nullptr : LookupGlobal(drv, Name);
+    if (!drv.NamedValues[Name] && !GlobalVar) {
+      return LogErrorV("Variable "+Name+" not defined");
+    }
+    if (GlobalVar && RecordOf(drv, GlobalVar)) {
+      return LogErrorV("Array of records "+Name+" is accessed one field at a time, "+Name+"[i].field");
+    }
+    return LogErrorV("Variable "+Name+" is not an array");
+  }
+
+  Type *Row = RowType(drv, Base, BaseType);
+  size_t Rank = 1;
+  for (Type *Ty = Row; Ty->isArrayTy(); Ty = Ty->getArrayElementType()) {
+    Rank++;
+  }
+  if (Indices.size() != Rank) {
+    return LogErrorV("Array "+Name+" has "+std::to_string(Rank)+" dimensions, not "+
+                     std::to_string(Indices.size()));
+  }
+
+  // Generates code and gets the value of each index, converted from double to int
+  Type *IndexType = IntegerType::get(*context, 32);
+  std::vector<Value*> IndexInts;
+  for (ExprAST *Index : Indices) {
+    Value* IndexFP = Index->codegen(drv);
+    if (!IndexFP) {
+      return nullptr;
+    }
+    IndexInts.push_back(builder->CreateFPToUI(IndexFP, IndexType));
+  }
+
+  // Creates GEP instruction: multi-dimensional arrays get one index per
+  // dimension, so that the optimizer sees the shape of the accesses
+  if (BaseType->isPointerTy()) {
+    Value *Ptr = builder->CreateLoad(BaseType, Base, Name+"ptr");
+    return builder->CreateInBoundsGEP(Row, Ptr, IndexInts);
+  }
+  IndexInts.insert(IndexInts.begin(), ConstantInt::get(IndexType, 0));
+  return builder->CreateInBoundsGEP(BaseType, Base, IndexInts);
+}
+
+// Stops the program (llvm.trap) if two arrays of a whole-array expression,
+// whose sizes are known only at runtime, have different sizes
+static void CheckSameLength(driver& drv, Value *Length, Value *ArrayLen) {
+  Function *F = builder->GetInsertBlock()->getParent();
+  BasicBlock *MismatchBB = BasicBlock::Create(*context, "lenmismatch", F);
+  BasicBlock *SameBB = BasicBlock::Create(*context, "samelen", F);
+  Value *Same = builder->CreateICmpEQ(Length, ArrayLen, "samelentest");
+  builder->CreateCondBr(Same, SameBB, MismatchBB, MDBuilder(*context).createBranchWeights(2000, 1));
+  builder->SetInsertPoint(MismatchBB);
+  bool Declared = module->getFunction(Intrinsic::getName(Intrinsic::trap));
+  Function *Trap = Intrinsic::getDeclaration(module, Intrinsic::trap);
+  if (!Declared)
+    drv.emit(Trap);
+  builder->CreateCall(Trap);
+  builder->CreateUnreachable();
+  builder->SetInsertPoint(SameBB);
+}
+
+// Checks that the arrays used as a whole in the expression Exp (e.g. A and B
+// in A + B * s) have the same number of elements. Length is the number of
+// elements required by the context (nullptr if none) and gets updated.
+// Sizes known only at runtime are checked when the expression is evaluated
+static bool ElementwiseLength(driver& drv, ExprAST *Exp, Value *&Length) {
+  SymbolUses U;
+  Exp->collectUses(U);
+  for (auto &Name : U.Reads) {
+    if (!IsArray(drv, Name)) {
+      continue;
+    }
+    Value *ArrayLen = ArrayLength(drv, Name);
+    if (!ArrayLen) {
+      LogErrorV("Size of array "+Name+" not known");
+      return false;
+    }
+    if (Length && ArrayLen != Length) {
+      if (isa<Constant>(Length) && isa<Constant>(ArrayLen)) {
+        LogErrorV("Array "+Name+" has a different size in whole-array expression");
+        return false;
+      }
+      CheckSameLength(drv, Length, ArrayLen);
+    }
+    Length = ArrayLen;
+  }
+  return true;
+}
+
+// Attaches its metadata to the backedge of a loop: the position of the loop
+// (with debug info, so that remarks about the loop point at its source)
+// followed by the hints for the loop passes
+static void LoopMetadata(Instruction *Backedge, ArrayRef<Metadata*> Hints) {
+  SmallVector<Metadata*, 4> LoopMD = {nullptr};
+  if (DILocation *Loc = Backedge->getDebugLoc().get())
+    LoopMD.push_back(Loc);
+  LoopMD.append(Hints.begin(), Hints.end());
+  if (LoopMD.size() == 1)
+    return;
+  MDNode *LoopID = MDNode::getDistinct(*context, LoopMD);
+  LoopID->replaceOperandWith(0, LoopID);
+  Backedge->setMetadata(LLVMContext::MD_loop, LoopID);
+}
+
+// Generates a loop over the indices 0, ..., Length-1 of the arrays of a
+// whole-array expression. Body generates the code for the current element
+// (drv.ElementIndex) given the value accumulated by the previous iterations,
+// starting from Init, and returns the new one. The elements are computed one
+// at a time, with no temporary arrays, and the loop is tagged so that the
+// vectorizer processes them with SIMD instructions. Returns the accumulated value
+static Value *ElementLoop(driver& drv, Value *Length, Value *Init,
+                          function_ref<Value*(Value*)> Body) {
+  DebugLoc Start = builder->getCurrentDebugLocation();
+  Type *IndexType = Type::getInt64Ty(*context);
+  Value *Zero = ConstantInt::get(IndexType, 0);
+  Function *function = builder->GetInsertBlock()->getParent();
+  BasicBlock *PreheaderBB = builder->GetInsertBlock();
+  BasicBlock *LoopBB = BasicBlock::Create(*context, "arrayloop", function);
+  BasicBlock *ExitBB = BasicBlock::Create(*context, "arrayexit");
+  builder->CreateCondBr(builder->CreateICmpULT(Zero, Length), LoopBB, ExitBB);
+
+  builder->SetInsertPoint(LoopBB);
+  PHINode *Index = builder->CreatePHI(IndexType, 2, "idx");
+  PHINode *Acc = builder->CreatePHI(Init->getType(), 2, "acc");
+  Index->addIncoming(Zero, PreheaderBB);
+  Acc->addIncoming(Init, PreheaderBB);
+
+  // Arrays used as a whole stand for their element at Index
+  Value *OuterIndex = drv.ElementIndex;
+  drv.ElementIndex = Index;
+  Value *Next = Body(Acc);
+  drv.ElementIndex = OuterIndex;
+  if (!Next) {
+    return nullptr;
+  }
+
+  BasicBlock *LatchBB = builder->GetInsertBlock();
+  Value *NextIndex = builder->CreateAdd(Index, ConstantInt::get(IndexType, 1), "nextidx", true, true);
+  BranchInst *Br = builder->CreateCondBr(builder->CreateICmpULT(NextIndex, Length), LoopBB, ExitBB);
+  Br->setDebugLoc(Start);
+  Index->addIncoming(NextIndex, LatchBB);
+  Acc->addIncoming(Next, LatchBB);
+
+  // Loop metadata: !{!self, !{"llvm.loop.vectorize.enable", i1 true}}
+  Metadata *Enable[] = {
+    MDString::get(*context, "llvm.loop.vectorize.enable"),
+    ConstantAsMetadata::get(ConstantInt::getTrue(*context))
+  };
+  LoopMetadata(Br, {MDNode::get(*context, Enable)});
+
+  function->insert(function->end(), ExitBB);
+  builder->SetInsertPoint(ExitBB);
+  PHINode *Result = builder->CreatePHI(Init->getType(), 2, "arrayres");
+  Result->addIncoming(Init, PreheaderBB);
+  Result->addIncoming(Next, LatchBB);
+  return Result;
+}
+
+// Saves the top of the arena of the runtime library, where the local arrays
+// whose size is known only at runtime are allocated
+static Value *ArenaMark(driver& drv) {
+  FunctionType *FT = FunctionType::get(Type::getInt64Ty(*context), false);
+  Value *Mark = builder->CreateCall(RuntimeFunction(drv, "krt_arena_mark", FT), {}, "arenamark");
+  drv.ArenaMarks.push_back(Mark);
+  return Mark;
+}
 
-// Implementazione del metodo parse
-int driver::parse (const std::string &f) {
+// Frees the arrays allocated in the arena after Mark was taken
+static void ArenaRelease(driver& drv, Value *Mark) {
+  FunctionType *FT = FunctionType::get(Type::getVoidTy(*context), {Type::getInt64Ty(*context)}, false);
+  builder->CreateCall(RuntimeFunction(drv, "krt_arena_release", FT), {Mark});
+}
+
+// Implementazione del costruttore della classe driver
+driver::driver(): trace_parsing(false), trace_scanning(false), scanner(nullptr),
+  optlevel(0), builtins(true), single(false), ElementIndex(nullptr), Pure(nullptr), interactive(false), lazy(false), interp(false),
+  debug(false), DBuilder(nullptr), DebugUnit(nullptr), saveremarks(false), Remarks(nullptr),
+  streaming(false), Stream(nullptr), threads(0), Item(0), pure(false),
+  constexprsteps(1 << 20) {};
+
+// Implementazione del metodo parse. The scanner and the parser are
+// reentrant: the threads of the compile server and of -threads parse at
+// the same time, each with its own driver
+int driver::parse (const std::string &f, unsigned line, unsigned column) {
   file = f;                    // File con il programma
-  location.initialize(&file);  // Inizializzazione dell'oggetto location
+  location.initialize(&file, line, column); // Inizializzazione dell'oggetto location
   scan_begin();                // Inizio scanning (ovvero apertura del file programma)
-  yy::parser parser(*this);    // Istanziazione del parser
+  yy::parser parser(*this, scanner); // Istanziazione del parser
   parser.set_debug_level(trace_parsing); // Livello di debug del parsed
   int res = parser.parse();    // Chiamata dell'entry point del parser
   scan_end();                  // Fine scanning (ovvero chiusura del file programma)
   return res;
 }
 
+// Parses the text src instead of a file (name is used in the diagnostics)
+int driver::parse_string (const std::string &src, const std::string &name,
+                          unsigned line, unsigned column) {
+  input = src.empty() ? "\n" : src;  // An empty input would mean the file
+  int res = parse(name, line, column);
+  input.clear();
+  return res;
+}
+
+// The REPL only knows the items entered so far; with -threads, the serial
+// pass of driver::parallel has collected the declarations of all of them
+bool driver::previous(const std::string &Name) const {
+  if (interactive)
+    return true;
+  auto It = DeclaredBy.find(Name);
+  return threads > 0 && It != DeclaredBy.end() && It->second < Item;
+};
+
+const FunctionUses *driver::uses(const std::string &Name) const {
+  auto It = Uses.find(Name);
+  if (It == Uses.end())
+    return nullptr;
+  auto By = DefinedBy.find(Name);
+  if (threads > 0 && By != DefinedBy.end() && By->second > Item)
+    return nullptr;
+  return &It->second;
+};
+
+/************************** Target machine ****************************/
+bool driver::wholeModule() const {
+  return (optlevel > 0 && !streaming) || debug || !cpu.empty() || !features.empty() ||
+         !multiversion.empty() || threads > 0 || !exports.empty() || pure;
+};
+
+// Machine of the host, with the CPU and the features chosen by -march,
+// -mcpu and -mattr (a generic x86-64, or whatever the host is, by default)
+std::unique_ptr<TargetMachine> driver::targetMachine() {
+  InitializeNativeTarget();
+  std::string TargetTriple = sys::getDefaultTargetTriple();
+  std::string Error;
+  const Target *Target = TargetRegistry::lookupTarget(TargetTriple, Error);
+  if (!Target) {
+    LogErrorV(Error);
+    return nullptr;
+  }
+  return std::unique_ptr<TargetMachine>(Target->createTargetMachine(
+      TargetTriple, cpu.empty() ? "generic" : cpu, features, TargetOptions(), Reloc::PIC_));
+};
+
+static OptimizationLevel Level(int optlevel) {
+  if (optlevel == 1)
+    return OptimizationLevel::O1;
+  if (optlevel == 2)
+    return OptimizationLevel::O2;
+  return OptimizationLevel::O3;
+}
+
+// Functions are compiled for the CPU and the features of the target
+static void TargetAttributes(driver& drv, Function *F) {
+  if (!drv.cpu.empty())
+    F->addFnAttr("target-cpu", drv.cpu);
+  if (!drv.features.empty())
+    F->addFnAttr("target-features", drv.features);
+}
+
+// Levels of the x86-64 psABI a multiversioned function is compiled for,
+// besides the target (see krt_cpu_level)
+static const char *ISALevels[] = {"x86-64-v2", "x86-64-v3", "x86-64-v4"};
+
+// The functions chosen by -fmultiversion are compiled once for each ISA
+// level and the best version for the CPU running the program is chosen
+// when it gets loaded: the name of the function belongs to an ifunc, whose
+// resolver asks the runtime library for the level of the CPU.
+// The versions are cloned before optimization, so that each of them is
+// vectorized for the registers of its own level
+static void Multiversion(driver& drv) {
+  if (drv.multiversion.empty())
+    return;
+  if (!Triple(sys::getDefaultTargetTriple()).isX86()) {
+    LogErrorV("Multiversioning is only supported on x86-64");
+    return;
+  }
+  Type *PtrTy = PointerType::getUnqual(*context);
+  Type *LevelTy = Type::getInt32Ty(*context);
+  for (const std::string &Name : drv.multiversion) {
+    Function *F = module->getFunction(Name);
+    if (!F || F->isDeclaration()) {
+      LogErrorV("Function "+Name+" to be multiversioned is not defined");
+      continue;
+    }
+    F->setName(Name + ".default");
+    F->setLinkage(GlobalValue::InternalLinkage);
+    Function *Resolver = Function::Create(FunctionType::get(PtrTy, false),
+        GlobalValue::InternalLinkage, Name + ".resolver", module);
+    GlobalIFunc *IFunc = GlobalIFunc::create(F->getFunctionType(), 0,
+        GlobalValue::ExternalLinkage, Name, Resolver, module);
+    // Calls (recursive ones included) go through the ifunc
+    F->replaceAllUsesWith(IFunc);
+
+    std::vector<Function*> Versions;
+    for (const char *Level : ISALevels) {
+      ValueToValueMapTy VMap;
+      Function *V = CloneFunction(F, VMap);
+      V->setName(Name + "." + Level);
+      V->addFnAttr("target-cpu", Level);
+      V->removeFnAttr("target-features");
+      Versions.push_back(V);
+    }
+
+    // The resolver returns the version of the highest level the CPU supports
+    IRBuilder<> B(BasicBlock::Create(*context, "entry", Resolver));
+    FunctionType *FT = FunctionType::get(LevelTy, false);
+    Function *CPULevel = RuntimeFunction(drv, "krt_cpu_level", FT);
+    Value *CPU = B.CreateCall(CPULevel, {}, "level");
+    Value *Chosen = F;
+    for (int i=0, e=Versions.size(); i<e; i++) {
+      Value *Supported = B.CreateICmpSGE(CPU, ConstantInt::get(LevelTy, i + 2));
+      Chosen = B.CreateSelect(Supported, Versions[i], Chosen);
+    }
+    B.CreateRet(Chosen);
+  }
+}
+
+/************************* Export control **************************/
+// Once a file exports something, with the export keyword or -fexport=,
+// whatever else it defines can only be used by the file itself: the
+// functions get internal linkage and the fast calling convention, the
+// globals internal linkage. The optimizer is then free to propagate
+// constants into them, specialize and remove arguments, inline and
+// delete them. Multiversioned functions are called from outside (through
+// their resolver): they are always exported
+static void Internalize(driver& drv) {
+  if (drv.exports.empty())
+    return;
+  // The report is a remark of the "internalize" pass (-Rpass=internalize)
+  bool Report = !drv.rpass.empty() && Regex(drv.rpass).match("internalize");
+  auto Remark = [&](const std::string &Name, const std::string &Msg) {
+    std::string Where = drv.file;
+    auto Proto = drv.Prototypes.find(Name);
+    if (Proto != drv.Prototypes.end())
+      Where += ":" + std::to_string(Proto->second->Line) + ":" + std::to_string(Proto->second->Col);
+    outStream() << Where << ": remark: " << Msg << " [-Rpass=internalize]\n";
+  };
+  for (Function &F : *module) {
+    std::string Name = F.getName().str();
+    if (F.isDeclaration() || F.hasLocalLinkage() || drv.exports.count(Name) ||
+        drv.multiversion.count(Name))
+      continue;
+    F.setLinkage(GlobalValue::InternalLinkage);
+    // The calling convention of the callers must match that of the function
+    bool DirectCalls = all_of(F.uses(), [&](const Use &U) {
+      auto *Call = dyn_cast<CallBase>(U.getUser());
+      return Call && Call->isCallee(&U);
+    });
+    if (DirectCalls) {
+      F.setCallingConv(CallingConv::Fast);
+      for (User *U : F.users())
+        cast<CallBase>(U)->setCallingConv(CallingConv::Fast);
+    }
+    if (Report)
+      Remark(Name, "function " + Name + " internalized" + (DirectCalls ? ", fast calling convention" : ""));
+  }
+  for (GlobalVariable &GV : module->globals()) {
+    std::string Name = GV.getName().str();
+    if (GV.isDeclaration() || GV.hasLocalLinkage() || drv.exports.count(Name))
+      continue;
+    GV.setLinkage(GlobalValue::InternalLinkage);
+    if (Report)
+      Remark(Name, "global " + Name + " internalized");
+  }
+  outStream().flush();
+}
+
+// The functions of the C library that the program defines are unknown to
+// the optimizer: it would take their calls for calls of the library (and
+// e.g. evaluate sqrt(2) with the sqrt of the host)
+static void DefinedLibraryFunctions(const driver& drv, TargetLibraryInfoImpl &TLII) {
+  for (auto &Function : drv.Uses) {
+    LibFunc F;
+    if (TLII.getLibFunc(Function.first, F))
+      TLII.setUnavailable(F);
+  }
+}
+
+/*************************** Streaming ****************************/
+// State of -stream kept from one top-level item to the next.
+// With -O the functions are optimized one at a time, as soon as they have
+// been generated, by the passes of the -O pipeline that work within a
+// function: those that need the whole module (inlining, interprocedural
+// analyses) would need the functions that are still to be parsed.
+// Everything is printed with the same slot tracker, so that metadata get
+// the same numbers in all the functions and in the final list of metadata
+// (see driver::codegen), even though the bodies of the functions are freed
+class StreamState {
+public:
+  std::unique_ptr<TargetMachine> TM;
+  std::unique_ptr<TargetLibraryInfoImpl> TLII;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  FunctionPassManager FPM;
+  ModuleSlotTracker MST;
+  DenseSet<MDNode*> Kept; // Metadata of the printed functions
+  StreamState(driver& drv);
+  void analyses(driver& drv); // Registers the analyses (again, when the library
+            // info changes)
+};
+
+// Named metadata holding the metadata of the functions printed by -stream
+static const char *StreamedMetadata = "kcomp.streamed";
+
+StreamState::StreamState(driver& drv): MST(module, false) {
+  if (drv.optlevel == 0)
+    return;
+  TM = drv.targetMachine();
+  if (!TM)
+    return;
+  module->setTargetTriple(TM->getTargetTriple().str());
+  module->setDataLayout(TM->createDataLayout());
+  Triple TT(TM->getTargetTriple());
+  TLII = std::make_unique<TargetLibraryInfoImpl>(TT);
+  if (drv.veclib == "libmvec")
+    TLII->addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86, TT);
+  analyses(drv);
+
+  PassBuilder PB(TM.get());
+  FPM = PB.buildFunctionSimplificationPipeline(Level(drv.optlevel), ThinOrFullLTOPhase::None);
+  // Vectorization and clean up, as at the end of the -O pipeline
+  FPM.addPass(LoopVectorizePass());
+  FPM.addPass(InstCombinePass());
+  FPM.addPass(SimplifyCFGPass());
+
+  // The functions are optimized for the target: the IR says which one
+  errStream() << "target datalayout = \"" << module->getDataLayoutStr() << "\"\n";
+  errStream() << "target triple = \"" << module->getTargetTriple() << "\"\n\n";
+}
+
+// The library info is copied by its analysis, which must be registered
+// again when the program defines a function of the C library
+void StreamState::analyses(driver& drv) {
+  DefinedLibraryFunctions(drv, *TLII);
+  LAM = LoopAnalysisManager();
+  FAM = FunctionAnalysisManager();
+  CGAM = CGSCCAnalysisManager();
+  MAM = ModuleAnalysisManager();
+  PassBuilder PB(TM.get());
+  FAM.registerPass([&] { return TargetLibraryAnalysis(*TLII); });
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+}
+
+// Keeps the metadata referenced by F, which outlive its body, in a named
+// node of the module: the final list of metadata starts from them
+static void KeepMetadata(StreamState &S, Function &F) {
+  NamedMDNode *Kept = module->getOrInsertNamedMetadata(StreamedMetadata);
+  auto Keep = [&](const SmallVectorImpl<std::pair<unsigned, MDNode*>> &Attached) {
+    for (auto &MD : Attached) {
+      if (S.Kept.insert(MD.second).second)
+        Kept->addOperand(MD.second);
+    }
+  };
+  SmallVector<std::pair<unsigned, MDNode*>, 4> Attached;
+  F.getAllMetadata(Attached);
+  Keep(Attached);
+  for (Instruction &I : instructions(F)) {
+    I.getAllMetadata(Attached);
+    Keep(Attached);
+  }
+}
+
+// Generates a top-level item as soon as the parser has reduced it (-stream).
+// Its functions (the bodies of its parallel loops included) are optimized
+// and printed, then the AST of the item and the bodies of the functions are
+// freed: memory depends on the largest item, not on the length of the
+// program. The functions stay in the module as declarations, for the calls
+// of the following items
+void driver::stream(RootAST *Item) {
+  if (!Item)
+    return;
+  if (!Stream)
+    Stream = new StreamState(*this);
+  Function *Before = module->empty() ? nullptr : &module->getFunctionList().back();
+  Item->codegen(*this);
+  LibFunc Library;
+  FunctionAST *Defined = dynamic_cast<FunctionAST*>(Item);
+  if (Stream->TM && Defined &&
+      Stream->TLII->getLibFunc(std::get<std::string>(Defined->getProto()->getLexVal()), Library))
+    Stream->analyses(*this);
+  // The prototype of an extern is kept in drv.Prototypes; the callers of
+  // a function only know what its body uses (drv.Uses)
+  if (!dynamic_cast<PrototypeAST*>(Item))
+    delete Item;
+  NamedValues.clear();
+
+  // The functions of the item are the definitions added to the module
+  auto First = Before ? std::next(Before->getIterator()) : module->begin();
+  std::vector<Function*> Functions;
+  for (auto F = First; F != module->end(); ++F) {
+    if (!F->isDeclaration())
+      Functions.push_back(&*F);
+  }
+  if (Functions.empty())
+    return;
+  if (Stream->TM) {
+    Function *Generated = &module->getFunctionList().back();
+    for (Function *F : Functions) {
+      Stream->FPM.run(*F, Stream->FAM);
+      Stream->FAM.clear(*F, F->getName());
+    }
+    // Declarations of the intrinsics introduced by the optimizer
+    for (auto F = std::next(Generated->getIterator()); F != module->end(); ++F)
+      emit(&*F);
+  }
+  for (GlobalValue *F : Functions) {
+    F->print(errStream(), Stream->MST);
+    errStream() << "\n";
+  }
+  for (Function *F : Functions) {
+    KeepMetadata(*Stream, *F);
+    F->deleteBody();
+  }
+};
+
+/*************************** Call graph ****************************/
+// With --entry=f,g only the functions called, directly or not, by f and g
+// are generated, and only the globals they use: the others are skipped
+// before their code is generated. The graph
+// links each function to the functions it calls and the globals it uses
+// (read, assigned or passed as arrays), as collected from its AST.
+// Locals named after a global or a function keep it alive: the graph may
+// keep too much, never too little
+std::set<RootAST*> driver::reachable(const std::vector<RootAST*> &Items) const {
+  // Items declaring each name: a function may also have externs, and the
+  // serial compilation keeps the first of them
+  std::map<std::string, std::vector<RootAST*>> Declarations;
+  std::vector<std::string> Worklist(entries.begin(), entries.end());
+  std::set<RootAST*> Live;
+  for (RootAST *Item : Items) {
+    PrototypeAST *Proto = dynamic_cast<PrototypeAST*>(Item);
+    if (FunctionAST *Function = dynamic_cast<FunctionAST*>(Item))
+      Proto = Function->getProto();
+    if (Proto) {
+      std::string Name = std::get<std::string>(Proto->getLexVal());
+      Declarations[Name].push_back(Item);
+    } else if (GlobalVarAST *Global = dynamic_cast<GlobalVarAST*>(Item))
+      Declarations[Global->getName()].push_back(Item);
+    // Record types generate nothing, but the arrays of records need them
+    else if (dynamic_cast<RecordAST*>(Item))
+      Live.insert(Item);
+  }
+  for (const std::string &Entry : entries) {
+    if (!Declarations.count(Entry))
+      LogErrorV("Entry point "+Entry+" is not defined");
+  }
+
+  std::set<std::string> Visited;
+  while (!Worklist.empty()) {
+    std::string Name = Worklist.back();
+    Worklist.pop_back();
+    if (!Visited.insert(Name).second)
+      continue;
+    for (RootAST *Item : Declarations[Name]) {
+      Live.insert(Item);
+      SymbolUses U;
+      Item->collectUses(U);
+      Worklist.insert(Worklist.end(), U.Calls.begin(), U.Calls.end());
+      Worklist.insert(Worklist.end(), U.Reads.begin(), U.Reads.end());
+      Worklist.insert(Worklist.end(), U.ArrayReads.begin(), U.ArrayReads.end());
+      Worklist.insert(Worklist.end(), U.Writes.begin(), U.Writes.end());
+      for (auto &Write : U.ArrayWrites)
+        Worklist.push_back(Write.first);
+    }
+  }
+  return Live;
+};
+
 // Implementazione del metodo codegen, che è una "semplice" chiamata del 
 // metodo omonimo presente nel nodo root (il puntatore root è stato scritto dal parser)
 void driver::codegen() {
-  root->codegen(*this);
+  debugBegin();
+  if (entries.empty())
+    root->codegen(*this);
+  else {
+    std::vector<RootAST*> Items;
+    static_cast<SeqAST*>(root)->flatten(Items);
+    std::set<RootAST*> Live = reachable(Items);
+    for (RootAST *Item : Items) {
+      if (Live.count(Item))
+        Item->codegen(*this);
+    }
+  }
+  debugEnd();
+  finish();
+};
+
+// Sets the target of the module, adds the versions of the multiversioned
+// functions and prints the module, or what has not been printed yet
+void driver::finish() {
+  if (!cpu.empty() || !features.empty()) {
+    if (std::unique_ptr<TargetMachine> TM = targetMachine()) {
+      module->setTargetTriple(TM->getTargetTriple().str());
+      module->setDataLayout(TM->createDataLayout());
+    }
+  }
+  Internalize(*this);
+  Multiversion(*this);
+  // When optimizing, top-level items are not printed one at a time:
+  // the whole module gets printed once the pipeline has run on it.
+  // The same holds for module-wide information: debug info metadata, the
+  // attribute groups of the target and the resolvers of multiversioning
+  if (wholeModule()) {
+    if (optlevel > 0)
+      optimize();
+    module->print(errStream(), nullptr);
+    return;
+  }
+  // Metadata nodes (e.g. loop hints) are referenced by the functions printed
+  // so far but are not part of their text: they get printed at the end.
+  // With -stream the bodies of the functions are gone: their metadata have
+  // been kept in a named node, and numbered by the tracker of the stream
+  ModuleSlotTracker ModuleMST(module);
+  ModuleSlotTracker &MST = Stream ? Stream->MST : ModuleMST;
+  std::vector<const MDNode*> Nodes;
+  std::set<const MDNode*> Visited;
+  if (NamedMDNode *Kept = module->getNamedMetadata(StreamedMetadata)) {
+    for (const MDNode *Node : Kept->operands())
+      Nodes.push_back(Node);
+  }
+  for (Function &F : *module) {
+    for (Instruction &I : instructions(F)) {
+      SmallVector<std::pair<unsigned, MDNode*>, 4> Attached;
+      I.getAllMetadata(Attached);
+      for (auto &MD : Attached) {
+        Nodes.push_back(MD.second);
+      }
+    }
+  }
+  while (!Nodes.empty()) {
+    const MDNode *Node = Nodes.back();
+    Nodes.pop_back();
+    if (!Visited.insert(Node).second) {
+      continue;
+    }
+    Node->print(errStream(), MST, module);
+    errStream() << "\n";
+    for (const MDOperand &Op : Node->operands()) {
+      if (const MDNode *OpNode = dyn_cast_or_null<MDNode>(Op.get())) {
+        Nodes.push_back(OpNode);
+      }
+    }
+  }
+  delete Stream;
+  Stream = nullptr;
+};
+
+// Prints a function, a declaration or a global variable on stderr as soon
+// as its code has been generated. When the module is optimized as a whole,
+// or printed with module-wide information, printing is deferred to
+// driver::codegen; with -stream, functions are printed by driver::stream
+// once the whole top-level item has been generated; the REPL
+// prints nothing
+void driver::emit(GlobalValue *GV) {
+  if (wholeModule() || interactive)
+    return;
+  if (streaming && isa<Function>(GV) && !GV->isDeclaration())
+    return;
+  GV->print(errStream());
+  errStream() << "\n";
+};
+
+/************************ Optimization remarks **************************/
+bool driver::remarks() const {
+  return !rpass.empty() || !rpassmissed.empty() || !rpassanalysis.empty() || saveremarks;
+};
+
+// Prints the remarks of the passes selected by -Rpass, -Rpass-missed and
+// -Rpass-analysis on stdout (stderr holds the IR), at the position of the
+// loop, call or expression they refer to, and keeps track of the outcome of
+// the loop vectorizer for the summary printed after each optimized module
+class RemarkHandler : public DiagnosticHandler {
+private:
+  std::optional<Regex> Passed, Missed, Analysis;
+  bool Summary;
+  // Loops seen by the vectorizer, by position, with what happened to them
+  std::map<std::pair<unsigned,unsigned>, std::string> Loops;
+  std::string File;
+  static bool matches(const std::optional<Regex> &R, StringRef PassName) {
+    return R && R->match(PassName);
+  }
+  void recordLoop(const DiagnosticInfoOptimizationBase &Remark) {
+    auto *Located = dyn_cast<DiagnosticInfoIROptimization>(&Remark);
+    if (!Located || !Located->isLocationAvailable())
+      return;
+    StringRef Path;
+    unsigned Line, Col;
+    Located->getLocation(Path, Line, Col);
+    File = Path.str();
+    std::string &Outcome = Loops[std::make_pair(Line, Col)];
+    std::string VF, IC;
+    for (auto &Arg : Remark.getArgs()) {
+      if (Arg.Key == "VectorizationFactor")
+        VF = Arg.Val;
+      else if (Arg.Key == "InterleaveCount")
+        IC = Arg.Val;
+    }
+    if (Remark.getRemarkName() == "Vectorized") {
+      Outcome = "vectorized, width " + VF + ", interleave count " + IC;
+    } else if (Remark.getRemarkName() == "Interleaved") {
+      Outcome = "not vectorized, interleave count " + IC;
+    } else if (isa<OptimizationRemarkAnalysis>(Remark) && Outcome.empty()) {
+      // The first analysis tells why the loop was not vectorized
+      Outcome = Remark.getMsg();
+    } else if (isa<OptimizationRemarkMissed>(Remark) && Outcome.empty()) {
+      Outcome = "loop not vectorized";
+    }
+  }
+public:
+  RemarkHandler(const driver &drv):
+    Summary(!drv.rpass.empty() || !drv.rpassmissed.empty() || !drv.rpassanalysis.empty()) {
+    if (!drv.rpass.empty()) Passed.emplace(drv.rpass);
+    if (!drv.rpassmissed.empty()) Missed.emplace(drv.rpassmissed);
+    if (!drv.rpassanalysis.empty()) Analysis.emplace(drv.rpassanalysis);
+  };
+  bool isPassedOptRemarkEnabled(StringRef PassName) const override {
+    return matches(Passed, PassName);
+  }
+  bool isMissedOptRemarkEnabled(StringRef PassName) const override {
+    return matches(Missed, PassName);
+  }
+  bool isAnalysisRemarkEnabled(StringRef PassName) const override {
+    return matches(Analysis, PassName);
+  }
+  // The vectorizer is always listened to, to build the summary
+  bool isAnyRemarkEnabled() const override {
+    return Summary;
+  }
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    auto *Remark = dyn_cast<DiagnosticInfoOptimizationBase>(&DI);
+    if (!Remark || DI.getSeverity() != DS_Remark)
+      return false;
+    if (Summary && Remark->getPassName() == "loop-vectorize")
+      recordLoop(*Remark);
+    if (!Remark->isEnabled())
+      return true;
+    std::string Where = "<unknown>";
+    if (auto *Located = dyn_cast<DiagnosticInfoWithLocationBase>(Remark))
+      Where = Located->getLocationStr();
+    const char *Option = isa<OptimizationRemarkMissed>(DI) ? "-Rpass-missed" :
+                         isa<OptimizationRemarkAnalysis>(DI) ? "-Rpass-analysis" : "-Rpass";
+    outStream() << Where << ": remark: " << Remark->getMsg() << " [" << Option << "="
+           << Remark->getPassName() << "]\n";
+    return true;
+  }
+  void printSummary() {
+    if (!Summary || Loops.empty())
+      return;
+    outStream() << "Vectorization summary:\n";
+    for (auto &Loop : Loops)
+      outStream() << "  " << File << ":" << Loop.first.first << ":" << Loop.first.second
+             << ": " << Loop.second << "\n";
+    outStream().flush();
+    Loops.clear();
+  }
+};
+
+// Installs the remark handler (and opens the remarks file) the first time
+// a module is optimized
+static RemarkHandler *SetupRemarks(driver& drv) {
+  if (!drv.remarks() || drv.Remarks)
+    return drv.Remarks;
+  auto Owned = std::make_unique<RemarkHandler>(drv);
+  drv.Remarks = Owned.get();
+  context->setDiagnosticHandler(std::move(Owned));
+  if (drv.saveremarks) {
+    SmallString<128> Name(drv.remarksfile);
+    if (Name.empty()) {
+      Name = drv.file;
+      sys::path::replace_extension(Name, "opt.yaml");
+    }
+    // Relative names refer to the directory of the client of the server
+    if (!drv.workdir.empty() && sys::path::is_relative(Name)) {
+      SmallString<128> Path(drv.workdir);
+      sys::path::append(Path, Name);
+      Name = Path;
+    }
+    auto File = setupLLVMOptimizationRemarks(*context, Name, "", "yaml", false);
+    if (!File) {
+      LogErrorV(toString(File.takeError()));
+    } else {
+      drv.RemarksFile = std::move(*File);
+      drv.RemarksFile->keep();
+    }
+  }
+  return drv.Remarks;
+}
+
+// Runs the standard LLVM optimization pipeline on the module
+void driver::optimize() {
+  // The target machine describes the host to the analyses used by the
+  // optimizer (e.g. the width of the vector registers for the vectorizer)
+  std::unique_ptr<TargetMachine> TM = targetMachine();
+  if (!TM)
+    return;
+  module->setTargetTriple(TM->getTargetTriple().str());
+  module->setDataLayout(TM->createDataLayout());
+
+  // Library info tells the optimizer which calls it knows about and,
+  // with -fveclib, which of them have SIMD variants in a vector library
+  Triple TT(TM->getTargetTriple());
+  TargetLibraryInfoImpl TLII(TT);
+  if (veclib == "libmvec")
+    TLII.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86, TT);
+  DefinedLibraryFunctions(*this, TLII);
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassBuilder PB(TM.get());
+  FAM.registerPass([&] { return TargetLibraryAnalysis(TLII); });
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(Level(optlevel));
+  RemarkHandler *Remarks = SetupRemarks(*this);
+  MPM.run(*module, MAM);
+  if (Remarks)
+    Remarks->printSummary();
+};
+
+/************************** Debug info ****************************/
+// With -g every module gets a compile unit for the source file, every
+// function a subprogram and every instruction the position of the AST node
+// that generated it, so that debuggers and profilers can map the code
+// (optimized or not) back to the lines of the program
+// Optimization remarks need the positions too: without -g, only the line
+// tables are emitted for them
+void driver::debugBegin() {
+  if (!debug && !(remarks() && optlevel > 0))
+    return;
+  DBuilder = new DIBuilder(*module);
+  DIFile *Unit = DBuilder->createFile(sys::path::filename(file), sys::path::parent_path(file));
+  DebugUnit = DBuilder->createCompileUnit(dwarf::DW_LANG_C, Unit, "kcomp", optlevel > 0, "", 0, "",
+      debug ? DICompileUnit::FullDebug : DICompileUnit::LineTablesOnly);
+  module->addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+  module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+};
+
+void driver::debugEnd() {
+  if (!DBuilder)
+    return;
+  DBuilder->finalize();
+  delete DBuilder;
+  DBuilder = nullptr;
+  DebugScopes.clear();
+};
+
+// Instructions created from now on are attributed to the position of Node,
+// in the function being generated (outside functions they get no position)
+void driver::emitLocation(RootAST *Node) {
+  if (!DBuilder)
+    return;
+  if (DebugScopes.empty()) {
+    builder->SetCurrentDebugLocation(DebugLoc());
+    return;
+  }
+  builder->SetCurrentDebugLocation(
+      DILocation::get(*context, Node->Line, Node->Col, DebugScopes.back()));
 };
 
+// Debug type of a value or of a variable: a number (double, or float with
+// -fsingle), an array of numbers (of one or more dimensions) or the address
+// of one (array parameters and arrays in the arena)
+static DIType *DebugType(driver& drv, Type *Ty) {
+  uint64_t Bits = drv.numberType()->getPrimitiveSizeInBits();
+  DIType *Number = drv.DBuilder->createBasicType(drv.single ? "float" : "double", Bits,
+                                                 dwarf::DW_ATE_float);
+  if (Ty->isPointerTy())
+    return drv.DBuilder->createPointerType(Number, 64);
+  if (Ty->isArrayTy()) {
+    SmallVector<Metadata*, 2> Ranges;
+    for (Type *AT = Ty; AT->isArrayTy(); AT = AT->getArrayElementType())
+      Ranges.push_back(drv.DBuilder->getOrCreateSubrange(0, AT->getArrayNumElements()));
+    return drv.DBuilder->createArrayType(Bits * NumElements(Ty), Bits, Number,
+                                         drv.DBuilder->getOrCreateArray(Ranges));
+  }
+  return Number;
+}
+
+// Starts the debug info of a function defined at the position of Node
+static void DebugFunction(driver& drv, Function *F, RootAST *Node) {
+  if (!drv.DBuilder)
+    return;
+  std::vector<Metadata*> Types;
+  Types.push_back(DebugType(drv, F->getReturnType()));
+  for (auto &Arg : F->args())
+    Types.push_back(DebugType(drv, Arg.getType()));
+  DISubroutineType *FT = drv.DBuilder->createSubroutineType(
+      drv.DBuilder->getOrCreateTypeArray(Types));
+  DISubprogram::DISPFlags Flags = DISubprogram::SPFlagDefinition;
+  if (drv.optlevel > 0)
+    Flags |= DISubprogram::SPFlagOptimized;
+  if (F->hasLocalLinkage())
+    Flags |= DISubprogram::SPFlagLocalToUnit;
+  DIFile *Unit = drv.DebugUnit->getFile();
+  DISubprogram *SP = drv.DBuilder->createFunction(Unit, F->getName(), StringRef(), Unit,
+      Node->Line, FT, Node->Line, DINode::FlagPrototyped, Flags);
+  F->setSubprogram(SP);
+  drv.DebugScopes.push_back(SP);
+  drv.emitLocation(Node);
+}
+
+static void DebugFunctionEnd(driver& drv) {
+  if (drv.DBuilder)
+    drv.DebugScopes.pop_back();
+}
+
+// Describes the variable stored by Alloca, declared at the position of Node
+// (ArgNo is the position of a parameter, starting from 1)
+static void DeclareVariable(driver& drv, AllocaInst *Alloca, const std::string &Name,
+                          RootAST *Node, unsigned ArgNo = 0) {
+  if (!drv.debug || !drv.DBuilder || drv.DebugScopes.empty())
+    return;
+  DIScope *Scope = drv.DebugScopes.back();
+  DIFile *Unit = drv.DebugUnit->getFile();
+  DIType *Ty = DebugType(drv, Alloca->getAllocatedType());
+  DILocalVariable *Var = ArgNo ?
+    drv.DBuilder->createParameterVariable(Scope, Name, ArgNo, Unit, Node->Line, Ty, true) :
+    drv.DBuilder->createAutoVariable(Scope, Name, Unit, Node->Line, Ty, true);
+  drv.DBuilder->insertDeclare(Alloca, Var, drv.DBuilder->createExpression(),
+                              DILocation::get(*context, Node->Line, Node->Col, Scope),
+                              builder->GetInsertBlock());
+}
+
 /************************* Sequence tree **************************/
 SeqAST::SeqAST(RootAST* first, RootAST* continuation):
   first(first), continuation(continuation) {};
 
+SeqAST::~SeqAST() {
+  delete first;
+  delete continuation;
+};
+
 // La generazione del codice per una sequenza è banale:
 // mediante chiamate ricorsive viene generato il codice di first e 
-// poi quello di continuation (con gli opportuni controlli di "esistenza")
+// poi quello di continuation (con gli opportuni controlli di "esistenza").
+// The parser builds the sequence from the left: first is the sequence of
+// the previous items and continuation the last one
 Value *SeqAST::codegen(driver& drv) {
-  if (first != nullptr) {
-    Value *f = first->codegen(drv);
-  } else {
-    if (continuation == nullptr) return nullptr;
-  }
-  Value *c = continuation->codegen(drv);
+  if (first != nullptr)
+    first->codegen(drv);
+  if (continuation != nullptr)
+    continuation->codegen(drv);
   return nullptr;
 };
 
+void SeqAST::flatten(std::vector<RootAST*>& Items) const {
+  if (SeqAST *Seq = dynamic_cast<SeqAST*>(first))
+    Seq->flatten(Items);
+  if (continuation != nullptr)
+    Items.push_back(continuation);
+};
+
+void SeqAST::collectUses(SymbolUses& U) const {
+  if (first) first->collectUses(U);
+  if (continuation) continuation->collectUses(U);
+};
+
 /********************* Number Expression Tree *********************/
 NumberExprAST::NumberExprAST(double Val): Val(Val) {};
 
@@ -81,7 +1215,7 @@ lexval NumberExprAST::getLexVal() const {
 // La costante verrà utilizzata in altra parte del processo di generazione
 // Si noti che l'uso del contesto garantisce l'unicità della costanti 
 Value *NumberExprAST::codegen(driver& drv) {  
-  return ConstantFP::get(*context, APFloat(Val));
+  return ConstantFP::get(drv.numberType(), Val);
 };
 
 /******************** Variable Expression Tree ********************/
@@ -103,6 +1237,17 @@ lexval VariableExprAST::getLexVal() const {
 // l'istruzione ma è anche il registro, vista la corrispodenza 1-1 fra le due nozioni), (3)
 // il nome del registro in cui verrà trasferito il valore dalla memoria
 Value *VariableExprAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  // Inside whole-array expressions an array stands for its current element
+  Type *BaseType = nullptr;
+  if (Value *Base = ArrayBase(drv, Name, BaseType)) {
+    if (!drv.ElementIndex) {
+      return LogErrorV("Array "+Name+" used as a scalar");
+    }
+    Value *EP = ElementPtr(drv, Name, Base, BaseType, drv.ElementIndex);
+    return builder->CreateLoad(drv.numberType(), EP, Name.c_str());
+  }
+
   // Gets pointer to memory where the value is stored
   AllocaInst *Alloca = drv.NamedValues[Name];
 
@@ -111,29 +1256,92 @@ Value *VariableExprAST::codegen(driver& drv) {
     return builder->CreateLoad(Alloca->getAllocatedType(), Alloca, Name.c_str());
   }
 
-  GlobalVariable *GlobalVar = module->getGlobalVariable(Name);
+  GlobalVariable *GlobalVar = LookupGlobal(drv, Name);
 
   // Checks if the variable has been previously defined globally
   if (GlobalVar) {
+    if (RecordOf(drv, GlobalVar)) {
+      return LogErrorV("Array of records "+Name+" used as a scalar");
+    }
     return builder->CreateLoad(GlobalVar->getValueType(), GlobalVar, Name.c_str());
   }
   
   return LogErrorV("Variable "+Name+" not defined");
 }
 
+void VariableExprAST::collectUses(SymbolUses& U) const {
+  U.Reads.insert(Name);
+  U.ReadCounts[Name]++;
+};
+
+// Branch weights (!prof metadata) for a conditional branch on Cond:
+// a condition marked likely(...) is expected to be true 2000 times out of
+// 2001, one marked unlikely(...) to be false just as often. Without a hint
+// the branch is left to the heuristics of the optimizer
+static MDNode *BranchWeights(ExprAST *Cond) {
+  BranchHintAST *Hint = dynamic_cast<BranchHintAST*>(Cond);
+  if (!Hint)
+    return nullptr;
+  MDBuilder MDB(*context);
+  return Hint->isLikely() ? MDB.createBranchWeights(2000, 1)
+                          : MDB.createBranchWeights(1, 2000);
+}
+
 /******************** Binary Expression Tree **********************/
 BinaryExprAST::BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS):
   Op(Op), LHS(LHS), RHS(RHS) {};
 
+BinaryExprAST::~BinaryExprAST() {
+  delete LHS;
+  delete RHS;
+};
+
+char BinaryExprAST::getOp() const {
+  return Op;
+};
+
+ExprAST *BinaryExprAST::getLHS() const {
+  return LHS;
+};
+
+ExprAST *BinaryExprAST::getRHS() const {
+  return RHS;
+};
+
 // La generazione del codice in questo caso è di facile comprensione.
 // Vengono ricorsivamente generati il codice per il primo e quello per il secondo
 // operando. Con i valori memorizzati in altrettanti registri SSA si
 // costruisce l'istruzione utilizzando l'opportuno operatore
 Value *BinaryExprAST::codegen(driver& drv) {
+  drv.emitLocation(this);
   Value *L = LHS->codegen(drv);
   if (Op == '!' && L) {
     return builder->CreateXor(L,ConstantInt::get(Type::getInt1Ty(*context), 1));
   }
+  if ((Op == '&' || Op == '|') && L) {
+    // Short-circuit: the right operand is evaluated only when the left one
+    // does not already decide the result (true for 'and', false for 'or')
+    Function *function = builder->GetInsertBlock()->getParent();
+    BasicBlock *RhsBB = BasicBlock::Create(*context, Op == '&' ? "andrhs" : "orrhs", function);
+    BasicBlock *MergeBB = BasicBlock::Create(*context, Op == '&' ? "andend" : "orend");
+    if (Op == '&')
+      builder->CreateCondBr(L, RhsBB, MergeBB, BranchWeights(LHS));
+    else
+      builder->CreateCondBr(L, MergeBB, RhsBB, BranchWeights(LHS));
+    BasicBlock *LhsBB = builder->GetInsertBlock();
+    builder->SetInsertPoint(RhsBB);
+    Value *R = RHS->codegen(drv);
+    if (!R)
+      return nullptr;
+    builder->CreateBr(MergeBB);
+    RhsBB = builder->GetInsertBlock();
+    function->insert(function->end(), MergeBB);
+    builder->SetInsertPoint(MergeBB);
+    PHINode *PN = builder->CreatePHI(Type::getInt1Ty(*context), 2, Op == '&' ? "andres" : "orres");
+    PN->addIncoming(ConstantInt::get(Type::getInt1Ty(*context), Op == '|'), LhsBB);
+    PN->addIncoming(R, RhsBB);
+    return PN;
+  }
   Value *R = RHS->codegen(drv);
   if (!L || !R) 
      return nullptr;
@@ -150,39 +1358,304 @@ Value *BinaryExprAST::codegen(driver& drv) {
     return builder->CreateFCmpULT(L,R,"lttest");
   case '=':
     return builder->CreateFCmpUEQ(L,R,"eqtest");
-  case '&':
-    return builder->CreateAnd(L,R);
-  case '|':
-    return builder->CreateOr(L,R);
   default:  
-    std::cout << Op << std::endl;
+    errStream() << Op << "\n";
     return LogErrorV("Operatore binario non supportato");
   }
 };
 
+void BinaryExprAST::collectUses(SymbolUses& U) const {
+  LHS->collectUses(U);
+  if (RHS) RHS->collectUses(U);
+};
+
 /********************* Call Expression Tree ***********************/
+// Maps a well-known math function, called with the given number of
+// arguments, to the corresponding LLVM intrinsic (if there is one)
+static Intrinsic::ID MathIntrinsic(const std::string &Name, size_t NArgs) {
+  static const std::map<std::string, std::pair<Intrinsic::ID, size_t>> Intrinsics = {
+    {"floor", {Intrinsic::floor, 1}},
+    {"ceil",  {Intrinsic::ceil, 1}},
+    {"sqrt",  {Intrinsic::sqrt, 1}},
+    {"fabs",  {Intrinsic::fabs, 1}},
+    {"sin",   {Intrinsic::sin, 1}},
+    {"cos",   {Intrinsic::cos, 1}},
+    {"exp",   {Intrinsic::exp, 1}},
+    {"log",   {Intrinsic::log, 1}},
+    {"pow",   {Intrinsic::pow, 2}},
+    {"min",   {Intrinsic::minnum, 2}},
+    {"max",   {Intrinsic::maxnum, 2}},
+    {"fma",   {Intrinsic::fma, 3}}
+  };
+  auto It = Intrinsics.find(Name);
+  if (It == Intrinsics.end() || It->second.second != NArgs)
+    return Intrinsic::not_intrinsic;
+  return It->second.first;
+}
+
+// Remarks of the compile-time evaluation of the calls, as if it were a pass
+// named consteval (-Rpass=consteval, -Rpass-missed=consteval)
+static void ConstevalRemark(driver& drv, RootAST *Call, bool Missed, const std::string &Msg) {
+  const std::string &Pattern = Missed ? drv.rpassmissed : drv.rpass;
+  if (Pattern.empty() || !Regex(Pattern).match("consteval"))
+    return;
+  outStream() << drv.file << ":" << Call->Line << ":" << Call->Col << ": remark: " << Msg
+              << (Missed ? " [-Rpass-missed=consteval]\n" : " [-Rpass=consteval]\n");
+}
+
 /* Call Expression Tree */
 CallExprAST::CallExprAST(std::string Callee, std::vector<ExprAST*> Args):
   Callee(Callee),  Args(std::move(Args)) {};
 
+CallExprAST::~CallExprAST() {
+  for (auto Arg : Args)
+    delete Arg;
+};
+
 lexval CallExprAST::getLexVal() const {
   lexval lval = Callee;
   return lval;
 };
 
+const std::vector<ExprAST*> &CallExprAST::getArgs() const {
+  return Args;
+};
+
+// Generates sum(exp) and dot(exp1, exp2), i.e. the sum of the elements of
+// a whole-array expression (of the products of two of them for dot)
+static Value *ArraySum(driver& drv, const std::vector<ExprAST*> &Args) {
+  Value *Length = nullptr;
+  for (auto arg : Args) {
+    if (!ElementwiseLength(drv, arg, Length)) {
+      return nullptr;
+    }
+  }
+  if (!Length) {
+    return LogErrorV("sum and dot require array arguments");
+  }
+
+  Value *Init = ConstantFP::get(drv.numberType(), 0.0);
+  return ElementLoop(drv, Length, Init, [&](Value *Acc) -> Value* {
+    Value *ElementVal = nullptr;
+    for (auto arg : Args) {
+      Value *V = arg->codegen(drv);
+      if (!V) {
+        return nullptr;
+      }
+      ElementVal = ElementVal ? builder->CreateFMul(ElementVal, V, "mulres") : V;
+    }
+    // The additions can be reordered, so that the sum can be vectorized
+    IRBuilderBase::FastMathFlagGuard Guard(*builder);
+    FastMathFlags FMF;
+    FMF.setAllowReassoc();
+    builder->setFastMathFlags(FMF);
+    return builder->CreateFAdd(Acc, ElementVal, "sumres");
+  });
+}
+
+// Generates the address of an array passed as argument of a call to Callee
+static Value *ArrayArgument(driver& drv, const std::string &Callee, ExprAST *Arg) {
+  VariableExprAST *Var = dynamic_cast<VariableExprAST*>(Arg);
+  Type *BaseType = nullptr;
+  Value *Base = nullptr;
+  if (Var) {
+    Base = ArrayBase(drv, std::get<std::string>(Var->getLexVal()), BaseType);
+  }
+  if (!Base) {
+    return LogErrorV("Function "+Callee+" expects an array argument");
+  }
+  // Local arrays allocated in the arena, array parameters, ... hold the address
+  if (BaseType->isPointerTy()) {
+    return builder->CreateLoad(BaseType, Base, std::get<std::string>(Var->getLexVal())+"ptr");
+  }
+  return Base;
+}
+
+// Builtins implemented by the array kernels of the runtime library (see
+// runtime/kernels.cpp): the arrays come first, then the scalars. The kernels
+// take the addresses of the arrays, their number of elements and the scalars
+struct ArrayKernel {
+  const char *Name;     // Function of the runtime library
+  unsigned Arrays;
+  unsigned Scalars;
+  bool Reads;           // Only reads the arrays and returns a value
+  bool Writes;          // Writes its last array
+};
+
+static const std::map<std::string, ArrayKernel> ArrayKernels = {
+  {"sort",      {"krt_sort", 1, 0, false, true}},
+  {"minval",    {"krt_minval", 1, 0, true, false}},
+  {"maxval",    {"krt_maxval", 1, 0, true, false}},
+  {"fill",      {"krt_fill", 1, 1, false, true}},
+  {"copy",      {"krt_copy", 2, 0, false, true}},
+  {"rand_fill", {"krt_rand_fill", 1, 1, false, true}}
+};
+
+// Kernel of the builtin Callee called with NArgs arguments, nullptr if
+// there is none. An extra argument gives the number of elements, required
+// when the size of an array is not known (e.g. array parameters)
+static const ArrayKernel *LookupArrayKernel(const std::string &Callee, size_t NArgs) {
+  auto It = ArrayKernels.find(Callee);
+  if (It == ArrayKernels.end())
+    return nullptr;
+  size_t N = It->second.Arrays + It->second.Scalars;
+  return NArgs == N || NArgs == N + 1 ? &It->second : nullptr;
+}
+
+// Generates the call of an array kernel. The number of elements is the
+// explicit one, or the size of the arrays (the shortest one for copy)
+static Value *ArrayKernelCall(driver& drv, const std::string &Callee, const ArrayKernel &K,
+                              const std::vector<ExprAST*> &Args) {
+  Type *NumberTy = drv.numberType();
+  Type *IndexType = Type::getInt64Ty(*context);
+  Type *PtrTy = PointerType::getUnqual(*context);
+  std::vector<Value*> ArgsV;
+  for (unsigned i=0; i<K.Arrays; i++) {
+    ArgsV.push_back(ArrayArgument(drv, Callee, Args[i]));
+    if (!ArgsV.back())
+      return nullptr;
+  }
+  Value *Length = nullptr;
+  if (Args.size() > K.Arrays + K.Scalars) {
+    Value *N = Args.back()->codegen(drv);
+    if (!N)
+      return nullptr;
+    Length = builder->CreateFPToUI(N, IndexType, "len");
+  } else {
+    for (unsigned i=0; i<K.Arrays; i++) {
+      const std::string &Name = std::get<std::string>(Args[i]->getLexVal());
+      Value *ArrayLen = ArrayLength(drv, Name);
+      if (!ArrayLen)
+        return LogErrorV("Size of array "+Name+" not known: pass the number of elements to "+Callee);
+      if (Length && Length != ArrayLen) {
+        if (isa<Constant>(Length) && isa<Constant>(ArrayLen))
+          return LogErrorV("Arrays passed to "+Callee+" have different sizes");
+        ArrayLen = builder->CreateBinaryIntrinsic(Intrinsic::umin, Length, ArrayLen, nullptr, "minlen");
+      }
+      Length = ArrayLen;
+    }
+  }
+  ArgsV.push_back(Length);
+  for (unsigned i=0; i<K.Scalars; i++) {
+    ArgsV.push_back(Args[K.Arrays + i]->codegen(drv));
+    if (!ArgsV.back())
+      return nullptr;
+  }
+
+  std::vector<Type*> Params(K.Arrays, PtrTy);
+  Params.push_back(IndexType);
+  Params.insert(Params.end(), K.Scalars, NumberTy);
+  FunctionType *FT = FunctionType::get(K.Reads ? NumberTy : Type::getVoidTy(*context), Params, false);
+  std::string Name = drv.single ? std::string(K.Name) + "f" : K.Name;
+  Function *F = RuntimeFunction(drv, Name, FT, [&](Function *F) {
+    F->setDoesNotThrow();
+    for (unsigned i=0; i<K.Arrays; i++) {
+      F->addParamAttr(i, Attribute::NoCapture);
+      if (K.Reads || (K.Writes && i+1 < K.Arrays))
+        F->addParamAttr(i, Attribute::ReadOnly);
+    }
+  });
+  Value *Result = builder->CreateCall(F, ArgsV, K.Reads ? "kernelres" : "");
+  return K.Reads ? Result : ConstantFP::get(NumberTy, 0.0);
+}
+
+// Adds to Globals the variables and arrays that the function Name, or a
+// function it calls, uses without declaring them (i.e. the globals)
+static void GlobalsUsed(driver& drv, const std::string &Name, std::set<std::string> &Visited,
+                        std::set<std::string> &Globals) {
+  if (!Visited.insert(Name).second)
+    return;
+  const FunctionUses *U = drv.uses(Name);
+  if (!U)
+    return;
+  Globals.insert(U->Reads.begin(), U->Reads.end());
+  Globals.insert(U->Writes.begin(), U->Writes.end());
+  for (auto &Callee : U->Calls)
+    GlobalsUsed(drv, Callee, Visited, Globals);
+}
+
+// The arrays passed to the array parameters of a function must not overlap:
+// the same array cannot be passed twice, nor a global array that the
+// function (or a function it calls) uses. Functions whose body is
+// not known yet (externs) are only checked for the former
+static bool CheckArrayArguments(driver& drv, const std::string &Callee, Function *CalleeF,
+                                const std::vector<ExprAST*> &Args) {
+  std::set<std::string> Passed;
+  std::set<std::string> Globals;
+  bool GlobalsKnown = false;
+  for (int i=0, e=Args.size(); i<e; i++) {
+    VariableExprAST *Var = dynamic_cast<VariableExprAST*>(Args[i]);
+    if (!CalleeF->getArg(i)->getType()->isPointerTy() || !Var) {
+      continue;
+    }
+    std::string Name = std::get<std::string>(Var->getLexVal());
+    if (!Passed.insert(Name).second) {
+      LogErrorV("Array "+Name+" is passed twice to "+Callee+
+                ", whose array parameters must not overlap");
+      return false;
+    }
+    if (drv.NamedValues[Name]) {
+      continue;
+    }
+    if (!GlobalsKnown) {
+      std::set<std::string> Visited;
+      GlobalsUsed(drv, Callee, Visited, Globals);
+      GlobalsKnown = true;
+    }
+    if (Globals.count(Name)) {
+      LogErrorV("Global array "+Name+" is passed to "+Callee+
+                ", which also uses it: array parameters must not overlap");
+      return false;
+    }
+  }
+  return true;
+}
+
 Value* CallExprAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  // sum(exp) and dot(exp1, exp2) are reductions of whole-array expressions,
+  // unless the program declares functions with the same names
+  if (!LookupFunction(drv, Callee) &&
+      ((Callee == "sum" && Args.size() == 1) || (Callee == "dot" && Args.size() == 2))) {
+    return ArraySum(drv, Args);
+  }
+  // Likewise for the builtins of the array kernels (sort, fill, ...)
+  if (!LookupFunction(drv, Callee)) {
+    if (const ArrayKernel *K = LookupArrayKernel(Callee, Args.size()))
+      return ArrayKernelCall(drv, Callee, *K, Args);
+  }
+
   // La generazione del codice corrispondente ad una chiamata di funzione
   // inizia cercando nel modulo corrente (l'unico, nel nostro caso) una funzione
   // il cui nome coincide con il nome memorizzato nel nodo dell'AST
   // Se la funzione non viene trovata (e dunque non è stata precedentemente definita)
   // viene generato un errore
-  Function *CalleeF = module->getFunction(Callee);
+  Function *CalleeF = LookupFunction(drv, Callee);
   if (!CalleeF)
      return LogErrorV("Funzione non definita");
   // Il secondo controllo è che la funzione recuperata abbia tanti parametri
   // quanti sono gi argomenti previsti nel nodo AST
   if (CalleeF->arg_size() != Args.size())
      return LogErrorV("Numero di argomenti non corretto");
+  // Array parameters are noalias (see PrototypeAST::codegen)
+  if (!CheckArrayArguments(drv, Callee, CalleeF, Args)) {
+    return nullptr;
+  }
+  // Pure functions call only pure functions (the math builtins are pure);
+  // memo functions may be called only by memo functions, as they write
+  // their cache. A function defined in Kaleidoscope is not a builtin, even
+  // where it is only declared (in the modules of the REPL and of -threads)
+  bool Builtin = drv.builtins && !drv.uses(Callee) &&
+                 MathIntrinsic(Callee, Args.size()) != Intrinsic::not_intrinsic;
+  if (drv.Pure && !Builtin) {
+    PrototypeAST *CalleeProto = drv.Prototypes.count(Callee) ? drv.Prototypes[Callee] : nullptr;
+    if (!CalleeProto || !CalleeProto->isPure())
+      return LogErrorV("Pure function "+std::get<std::string>(drv.Pure->getLexVal())+
+                       " calls "+Callee+", which is not pure");
+    if (CalleeProto->memoSize() && !drv.Pure->memoSize())
+      return LogErrorV("Pure function "+std::get<std::string>(drv.Pure->getLexVal())+
+                       " calls memo function "+Callee+": declare it memo too");
+  }
   // Passato con successo anche il secondo controllo, viene predisposta
   // ricorsivamente la valutazione degli argomenti presenti nella chiamata 
   // (si ricordi che gli argomenti possono essere espressioni arbitarie)
@@ -191,19 +1664,102 @@ Value* CallExprAST::codegen(driver& drv) {
   // del builder, che viene chiamato subito dopo per la generazione dell'istruzione
   // IR di chiamata
   std::vector<Value *> ArgsV;
-  for (auto arg : Args) {
-     ArgsV.push_back(arg->codegen(drv));
+  for (int i=0, e=Args.size(); i<e; i++) {
+     // Arrays are passed by address, without copying them
+     if (CalleeF->getArg(i)->getType()->isPointerTy())
+        ArgsV.push_back(ArrayArgument(drv, Callee, Args[i]));
+     else
+        ArgsV.push_back(Args[i]->codegen(drv));
      if (!ArgsV.back())
         return nullptr;
   }
-  return builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  // Calls of pure functions and math builtins whose arguments are all
+  // constants are evaluated at compile time by the interpreter, within the
+  // budget of -fconstexpr-steps=, and replaced by their result. If the
+  // evaluation runs out of steps or reaches something it cannot do without
+  // side effects, the call is generated as usual
+  if (drv.constexprsteps && !drv.single && (Builtin || drv.PureFunctions.count(Callee)) &&
+      all_of(ArgsV, [](Value *V) { return isa<ConstantFP>(V); })) {
+    std::vector<double> Values;
+    for (Value *V : ArgsV)
+      Values.push_back(cast<ConstantFP>(V)->getValueAPF().convertToDouble());
+    double Result;
+    std::string Why;
+    if (drv.fold(Callee, Values, Result, Why)) {
+      ConstevalRemark(drv, this, false, "call to "+Callee+" evaluated at compile time");
+      return ConstantFP::get(drv.numberType(), Result);
+    }
+    ConstevalRemark(drv, this, true, "call to "+Callee+" left to run time: "+Why);
+  }
+  // Calls to well-known math externs are lowered to LLVM intrinsics, so that
+  // the optimizer knows their semantics (constant folding, LICM, vectorization).
+  // Functions defined in Kaleidoscope are never replaced
+  if (Builtin &&
+      all_of(CalleeF->args(), [&](Argument &A) { return A.getType() == drv.numberType(); })) {
+    Intrinsic::ID ID = MathIntrinsic(Callee, Args.size());
+    // The declaration is printed the first time the intrinsic gets used
+    // (with -stream, the functions using it may have been freed already)
+    Type *NumberTy = drv.numberType();
+    bool Declared = module->getFunction(Intrinsic::getName(ID, {NumberTy}, module));
+    Function *IntrinsicF = Intrinsic::getDeclaration(module, ID, {NumberTy});
+    if (!Declared)
+      drv.emit(IntrinsicF);
+    CalleeF = IntrinsicF;
+  }
+  CallInst *Call = builder->CreateCall(CalleeF, ArgsV, "calltmp");
+  // Nor does the code generator of the JIT, which compiles each module of
+  // the REPL on its own (the optimizer is told by DefinedLibraryFunctions)
+  if (drv.interactive && CalleeF->isDeclaration() && drv.uses(Callee))
+    Call->addFnAttr(Attribute::NoBuiltin);
+  return Call;
 }
 
+void CallExprAST::collectUses(SymbolUses& U) const {
+  U.Calls.insert(Callee);
+  for (auto arg : Args)
+    arg->collectUses(U);
+  // Array kernels writing a whole array (the index is unknown)
+  const ArrayKernel *K = LookupArrayKernel(Callee, Args.size());
+  VariableExprAST *Var = K ? dynamic_cast<VariableExprAST*>(Args[K->Arrays-1]) : nullptr;
+  if (Var && K->Writes)
+    U.ArrayWrites.push_back(std::make_pair(std::get<std::string>(Var->getLexVal()), nullptr));
+};
+
+/************************* Branch Hint Tree ***************************/
+BranchHintAST::BranchHintAST(ExprAST* Cond, bool Likely):
+   Cond(Cond), Likely(Likely) {};
+
+BranchHintAST::~BranchHintAST() {
+  delete Cond;
+};
+
+bool BranchHintAST::isLikely() const {
+  return Likely;
+};
+
+// The hint only affects the branches that test the condition (see
+// BranchWeights), its value is the one of the condition
+Value* BranchHintAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  return Cond->codegen(drv);
+};
+
+void BranchHintAST::collectUses(SymbolUses& U) const {
+  Cond->collectUses(U);
+};
+
 /************************* If Expression Tree *************************/
 IfExprAST::IfExprAST(ExprAST* Cond, ExprAST* TrueExp, ExprAST* FalseExp):
    Cond(Cond), TrueExp(TrueExp), FalseExp(FalseExp) {};
+
+IfExprAST::~IfExprAST() {
+  delete Cond;
+  delete TrueExp;
+  delete FalseExp;
+};
    
 Value* IfExprAST::codegen(driver& drv) {
+    drv.emitLocation(this);
     // Viene dapprima generato il codice per valutare la condizione, che
     // memorizza il risultato (di tipo i1, dunque booleano) nel registro SSA 
     // che viene "memorizzato" in CondV. 
@@ -224,7 +1780,7 @@ Value* IfExprAST::codegen(driver& drv) {
     // di altri blocchi, che naturalmente andrebbero inseriti prima di FalseBB
     
     // Ora possiamo crere l'istruzione di salto condizionato
-    builder->CreateCondBr(CondV, TrueBB, FalseBB);
+    builder->CreateCondBr(CondV, TrueBB, FalseBB, BranchWeights(Cond));
     
     // "Posizioniamo" il builder all'inizio del blocco true, 
     // generiamo ricorsivamente il codice da eseguire in caso di
@@ -278,12 +1834,18 @@ Value* IfExprAST::codegen(driver& drv) {
     // 1) Dapprima si crea il nodo PHI specificando quanti sono i possibili nodi sorgente
     // 2) Per ogni possibile nodo sorgente, viene poi inserita l'etichetta e il registro
     //    SSA da cui prelevare il valore 
-    PHINode *PN = builder->CreatePHI(Type::getDoubleTy(*context), 2, "condval");
+    PHINode *PN = builder->CreatePHI(drv.numberType(), 2, "condval");
     PN->addIncoming(TrueV, TrueBB);
     PN->addIncoming(FalseV, FalseBB);
     return PN;
 };
 
+void IfExprAST::collectUses(SymbolUses& U) const {
+  Cond->collectUses(U);
+  TrueExp->collectUses(U);
+  FalseExp->collectUses(U);
+};
+
 /********************** Block Expression Tree *********************/
 /*
 BlockExprAST::BlockExprAST(std::vector<VarBindingAST*> Def, ExprAST* Val): 
@@ -345,6 +1907,13 @@ Value* BlockExprAST::codegen(driver& drv) {
 BlockAST::BlockAST(std::vector<VarBindingAST*> Def, std::vector<RootAST*> Stmts): 
   Def(std::move(Def)), Stmts(std::move(Stmts)) {};
 
+BlockAST::~BlockAST() {
+  for (auto Binding : Def)
+    delete Binding;
+  for (auto Stmt : Stmts)
+    delete Stmt;
+};
+
 Value* BlockAST::codegen(driver& drv) {
   // A block expression could or could not start with one or more local
   // variable definitions.
@@ -352,6 +1921,15 @@ Value* BlockAST::codegen(driver& drv) {
   // and constants as well, see VarBindingAST).
   // It's important to manage the scope since the new variable should shadow
   // variables with the same name outside of the block expression
+  // Arrays allocated in the arena are freed at the end of the block
+  Value *Mark = nullptr;
+  for (auto def : Def) {
+    if (def->onHeap()) {
+      Mark = ArenaMark(drv);
+      break;
+    }
+  }
+
   std::vector<AllocaInst*> AllocaTmp;
   for (int i=0, e=Def.size(); i<e; i++) {
     // For each variable defined in this block expression, generate its
@@ -373,6 +1951,10 @@ Value* BlockAST::codegen(driver& drv) {
     if (!Val)
       return LogErrorV("Statement generation error");
   };
+  if (Mark) {
+    ArenaRelease(drv, Mark);
+    drv.ArenaMarks.pop_back();
+  }
 
   // Before exiting block, restore external scope
   for (int i=0, e=Def.size(); i<e; i++) {
@@ -383,21 +1965,36 @@ Value* BlockAST::codegen(driver& drv) {
   return Val;
 };
 
+void BlockAST::collectUses(SymbolUses& U) const {
+  for (auto def : Def)
+    def->collectUses(U);
+  for (auto stmt : Stmts)
+    stmt->collectUses(U);
+};
+
 /************************* Var binding Tree *************************/
 VarBindingAST::VarBindingAST(const std::string Name, ExprAST* Val):
    Name(Name), Val(Val) {};
+
+VarBindingAST::~VarBindingAST() {
+  delete Val;
+};
    
 const std::string& VarBindingAST::getName() const { 
    return Name; 
 };
 
+bool VarBindingAST::onHeap() const {
+  return false;
+};
+
 AllocaInst* VarBindingAST::codegen(driver& drv) {
   // Gets current basic block's function, which will be passed to
   // CreateEntryBlockAlloca
   Function *fun = builder->GetInsertBlock()->getParent();
 
   // Creates the alloca instruction at the start of the function and returns it
-  AllocaInst *Alloca = CreateEntryBlockAlloca(fun, Name);
+  AllocaInst *Alloca = CreateEntryBlockAlloca(drv, fun, Name);
 
   // Generates code and returns the value of RHS
   Value *BoundVal = nullptr;
@@ -406,20 +2003,31 @@ AllocaInst* VarBindingAST::codegen(driver& drv) {
     if (!BoundVal)
       return nullptr;
   } else {
-    BoundVal = ConstantFP::get(Type::getDoubleTy(*context), 0.0);
+    BoundVal = ConstantFP::get(drv.numberType(), 0.0);
   }
   // Stores value of RHS in the allocated memory, so that it can be retrieved
   // when needed by a load on the memory pointer by Alloca, which can be
   // retrieved by name in the symbol table
+  drv.emitLocation(this);
   builder->CreateStore(BoundVal, Alloca);
+  DeclareVariable(drv, Alloca, Name, this);
    
   // Returns alloca instruction which will get stored in the symbol table
   return Alloca;
 };
 
+void VarBindingAST::collectUses(SymbolUses& U) const {
+  U.Bound.insert(Name);
+  if (Val) Val->collectUses(U);
+};
+
 /************************* Prototype Tree *************************/
-PrototypeAST::PrototypeAST(std::string Name, std::vector<std::string> Args):
-  Name(Name), Args(std::move(Args)), emitcode(true) {};  //Di regola il codice viene emesso
+PrototypeAST::PrototypeAST(std::string Name, std::vector<std::string> Args,
+                           std::vector<bool> ArrayArgs):
+  Name(Name), Args(std::move(Args)), ArrayArgs(std::move(ArrayArgs)),
+  emitcode(true), pure(false), memo(0), memokeep(false) {  //Di regola il codice viene emesso
+  this->ArrayArgs.resize(this->Args.size(), false);
+};
 
 lexval PrototypeAST::getLexVal() const {
    lexval lval = Name;
@@ -430,25 +2038,54 @@ const std::vector<std::string>& PrototypeAST::getArgs() const {
    return Args;
 };
 
+const std::vector<bool>& PrototypeAST::getArrayArgs() const { 
+   return ArrayArgs;
+};
+
 // Previene la doppia emissione del codice. Si veda il commento più avanti.
 void PrototypeAST::noemit() { 
    emitcode = false; 
 };
 
+// A memo function is pure too: the cache does not change its results
+void PrototypeAST::setPure(int Memo, bool Keep) {
+   pure = true;
+   memo = Memo;
+   memokeep = Keep;
+};
+
+bool PrototypeAST::isPure() const {
+   return pure;
+};
+
+int PrototypeAST::memoSize() const {
+   return memo;
+};
+
+bool PrototypeAST::memoKeep() const {
+   return memokeep;
+};
+
 Function *PrototypeAST::codegen(driver& drv) {
   // Costruisce una struttura, qui chiamata FT, che rappresenta il "tipo" di una
   // funzione. Con ciò si intende a sua volta una coppia composta dal tipo
   // del risultato (valore di ritorno) e da un vettore che contiene il tipo di tutti
   // i parametri. Si ricordi, tuttavia, che nel nostro caso l'unico tipo è double.
   
-  // Prima definiamo il vettore (qui chiamato Doubles) con il tipo degli argomenti
-  std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*context));
+  // Prima definiamo il vettore (qui chiamato Doubles) con il tipo degli argomenti.
+  // Array parameters are pointers to the first element of the caller's array
+  std::vector<Type*> Doubles(Args.size(), drv.numberType());
+  for (int i=0, e=Args.size(); i<e; i++) {
+    if (ArrayArgs[i])
+      Doubles[i] = PointerType::getUnqual(*context);
+  }
   // Quindi definiamo il tipo (FT) della funzione
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*context), Doubles, false);
+  FunctionType *FT = FunctionType::get(drv.numberType(), Doubles, false);
   // Infine definiamo una funzione (al momento senza body) del tipo creato e con il nome
   // presente nel nodo AST. ExternalLinkage vuol dire che la funzione può avere
   // visibilità anche al di fuori del modulo
   Function *F = Function::Create(FT, Function::ExternalLinkage, Name, *module);
+  drv.Prototypes[Name] = this;
 
   // Ad ogni parametro della funzione F (che, è bene ricordare, è la rappresentazione 
   // llvm di una funzione, non è una funzione C++) attribuiamo ora il nome specificato dal
@@ -457,6 +2094,32 @@ Function *PrototypeAST::codegen(driver& drv) {
   for (auto &Arg : F->args())
     Arg.setName(Args[Idx++]);
 
+  // Arrays passed as arguments must not overlap each other (or the global
+  // arrays used by the function), so that their accesses can be reordered
+  // and vectorized; their elements are aligned as numbers. The calls are
+  // checked by CheckArrayArguments
+  Align NumberAlign(drv.numberType()->getPrimitiveSizeInBits() / 8);
+  for (auto &Arg : F->args()) {
+    if (Arg.getType()->isPointerTy()) {
+      Arg.addAttr(Attribute::NoAlias);
+      Arg.addAttr(Attribute::getWithAlignment(*context, NumberAlign));
+    }
+  }
+
+  // Calls to pure functions can be removed when unused, merged when they
+  // have the same arguments and hoisted out of loops. A pure function with
+  // array parameters only reads them; memo functions write their cache
+  if (pure) {
+    if (!memo && is_contained(ArrayArgs, true)) {
+      F->setOnlyReadsMemory();
+      F->setOnlyAccessesArgMemory();
+    } else if (!memo) {
+      F->setDoesNotAccessMemory();
+    }
+    F->setDoesNotThrow();
+    F->addFnAttr(Attribute::WillReturn);
+  }
+
   /* Abbiamo completato la creazione del codice del prototipo.
      Il codice può quindi essere emesso, ma solo se esso corrisponde
      ad una dichiarazione extern. Se invece il prototipo fa parte
@@ -467,21 +2130,185 @@ Function *PrototypeAST::codegen(driver& drv) {
      funzione.
   */
   if (emitcode) {
-    F->print(errs());
-    fprintf(stderr, "\n");
+    drv.emit(F);
   };
   
   return F;
 }
 
+/************************** Pure functions ****************************/
+// A pure function uses only its parameters and local variables (it does
+// not assign the elements of its array parameters) and calls only pure
+// functions; only memo functions may call memo functions (see CallExprAST).
+// Its local arrays must live on the stack: the arena is memory of the
+// runtime library, which readnone and argmemonly would hide
+static bool CheckPure(const std::string &Name, PrototypeAST *Proto, ExprAST *Body) {
+  SymbolUses U;
+  Body->collectUses(U);
+  const std::vector<std::string> &Args = Proto->getArgs();
+  std::set<std::string> Locals(Args.begin(), Args.end());
+  Locals.insert(U.Bound.begin(), U.Bound.end());
+  std::set<std::string> Used = U.Reads;
+  Used.insert(U.ArrayReads.begin(), U.ArrayReads.end());
+  Used.insert(U.Writes.begin(), U.Writes.end());
+  for (auto &Write : U.ArrayWrites) {
+    Used.insert(Write.first);
+    auto Arg = std::find(Args.begin(), Args.end(), Write.first);
+    if (Arg != Args.end() && !U.Bound.count(Write.first)) {
+      LogErrorV("Pure function "+Name+" assigns the elements of its array parameter "+Write.first);
+      return false;
+    }
+  }
+  for (auto &Var : Used) {
+    if (!Locals.count(Var)) {
+      LogErrorV("Pure function "+Name+" uses global variable "+Var);
+      return false;
+    }
+  }
+  if (!U.HeapArrays.empty()) {
+    LogErrorV("Pure function "+Name+" allocates array "+*U.HeapArrays.begin()+
+              " in the arena: its local arrays must have a small constant size");
+    return false;
+  }
+  if (Proto->memoSize() && is_contained(Proto->getArrayArgs(), true)) {
+    LogErrorV("Memo function "+Name+" cannot have array parameters");
+    return false;
+  }
+  return true;
+}
+
+/*************************** Memoization ****************************/
+// The cache of a memo function f is the internal global f.memo: a direct
+// mapped table of entries [version, arguments..., result], all stored as
+// integers as wide as the numbers. The entry of the arguments is chosen by
+// Fibonacci hashing of their bits. The version makes the cache safe when
+// the function is called by the iterations of a parfor (a seqlock): it is
+// 0 for an empty entry, odd while the entry is being written
+
+// Entry of the arguments of the current call, and the version read by the lookup
+struct MemoEntry {
+  Value *Ptr = nullptr;
+  Type *Ty = nullptr;
+  Value *Version = nullptr;
+  std::vector<Value*> Keys;
+};
+
+static Value *MemoSlot(MemoEntry &E, unsigned Slot) {
+  Type *Int32Ty = Type::getInt32Ty(*context);
+  return builder->CreateInBoundsGEP(E.Ty, E.Ptr, {ConstantInt::get(Int32Ty, 0), ConstantInt::get(Int32Ty, Slot)});
+}
+
+static Value *MemoLoad(MemoEntry &E, unsigned Slot, AtomicOrdering Order, const Twine &Name) {
+  Type *IntTy = E.Ty->getArrayElementType();
+  LoadInst *Load = builder->CreateLoad(IntTy, MemoSlot(E, Slot), Name);
+  Load->setAtomic(Order);
+  Load->setAlignment(Align(IntTy->getPrimitiveSizeInBits() / 8));
+  return Load;
+}
+
+static void MemoStoreSlot(MemoEntry &E, unsigned Slot, Value *V, AtomicOrdering Order) {
+  Type *IntTy = E.Ty->getArrayElementType();
+  StoreInst *Store = builder->CreateStore(V, MemoSlot(E, Slot));
+  Store->setAtomic(Order);
+  Store->setAlignment(Align(IntTy->getPrimitiveSizeInBits() / 8));
+}
+
+// Looks up the arguments of F in its cache: on a hit the cached result is
+// returned, otherwise the body is generated in the block left current
+static MemoEntry MemoLookup(driver& drv, PrototypeAST *Proto, Function *F) {
+  std::string Name = std::get<std::string>(Proto->getLexVal());
+  Type *NumberTy = drv.numberType();
+  Type *IntTy = IntegerType::get(*context, NumberTy->getPrimitiveSizeInBits());
+  Type *Int64Ty = Type::getInt64Ty(*context);
+  unsigned Bits = std::max(1u, Log2_32_Ceil(Proto->memoSize()));
+
+  MemoEntry E;
+  E.Ty = ArrayType::get(IntTy, F->arg_size() + 2);
+  Type *CacheTy = ArrayType::get(E.Ty, uint64_t(1) << Bits);
+  GlobalVariable *Cache = new GlobalVariable(*module, CacheTy, false, GlobalValue::InternalLinkage,
+                                             Constant::getNullValue(CacheTy), Name+".memo");
+  drv.emit(Cache);
+
+  const uint64_t Golden = 0x9e3779b97f4a7c15ULL;
+  Value *Hash = ConstantInt::get(Int64Ty, 0);
+  for (auto &Arg : F->args()) {
+    Value *Key = builder->CreateBitCast(&Arg, IntTy, Arg.getName()+".bits");
+    E.Keys.push_back(Key);
+    Hash = builder->CreateXor(Hash, builder->CreateZExt(Key, Int64Ty));
+    Hash = builder->CreateMul(Hash, ConstantInt::get(Int64Ty, Golden), "memohash");
+  }
+  Value *Index = builder->CreateLShr(Hash, 64 - Bits, "memoindex");
+  E.Ptr = builder->CreateInBoundsGEP(CacheTy, Cache, {ConstantInt::get(Int64Ty, 0), Index}, "memoentry");
+
+  // Hit: the version is even and not 0, the arguments are the same and
+  // the version has not changed while reading them
+  E.Version = MemoLoad(E, 0, AtomicOrdering::Acquire, "memoversion");
+  Value *Hit = builder->CreateICmpEQ(builder->CreateAnd(E.Version, 1), ConstantInt::get(IntTy, 0));
+  Hit = builder->CreateAnd(Hit, builder->CreateICmpNE(E.Version, ConstantInt::get(IntTy, 0)));
+  for (unsigned i=0, e=E.Keys.size(); i<e; i++) {
+    Value *Cached = MemoLoad(E, i + 1, AtomicOrdering::Monotonic, "memokey");
+    Hit = builder->CreateAnd(Hit, builder->CreateICmpEQ(Cached, E.Keys[i]));
+  }
+  Value *Result = MemoLoad(E, E.Keys.size() + 1, AtomicOrdering::Monotonic, "memoresult");
+  builder->CreateFence(AtomicOrdering::Acquire);
+  Value *Again = MemoLoad(E, 0, AtomicOrdering::Monotonic, "memoversion");
+  Hit = builder->CreateAnd(Hit, builder->CreateICmpEQ(Again, E.Version), "memohit");
+
+  BasicBlock *HitBB = BasicBlock::Create(*context, "memohit", F);
+  BasicBlock *MissBB = BasicBlock::Create(*context, "memomiss", F);
+  builder->CreateCondBr(Hit, HitBB, MissBB);
+  builder->SetInsertPoint(HitBB);
+  builder->CreateRet(builder->CreateBitCast(Result, NumberTy));
+  builder->SetInsertPoint(MissBB);
+  return E;
+}
+
+// Stores the result of the call in its entry, unless another thread is
+// writing it. A full entry is replaced, or kept with memo(n, keep)
+static void MemoStore(driver& drv, PrototypeAST *Proto, Function *F, MemoEntry &E, Value *RetVal) {
+  Type *IntTy = E.Ty->getArrayElementType();
+  Value *Old = MemoLoad(E, 0, AtomicOrdering::Monotonic, "memoversion");
+  Value *Free = Proto->memoKeep()
+                ? builder->CreateICmpEQ(Old, ConstantInt::get(IntTy, 0))
+                : builder->CreateICmpEQ(builder->CreateAnd(Old, 1), ConstantInt::get(IntTy, 0));
+  BasicBlock *LockBB = BasicBlock::Create(*context, "memolock", F);
+  BasicBlock *WriteBB = BasicBlock::Create(*context, "memowrite", F);
+  BasicBlock *DoneBB = BasicBlock::Create(*context, "memodone", F);
+  builder->CreateCondBr(Free, LockBB, DoneBB);
+
+  builder->SetInsertPoint(LockBB);
+  Value *Locked = builder->CreateAtomicCmpXchg(MemoSlot(E, 0), Old, builder->CreateAdd(Old, ConstantInt::get(IntTy, 1)),
+                                               MaybeAlign(IntTy->getPrimitiveSizeInBits() / 8),
+                                               AtomicOrdering::Acquire, AtomicOrdering::Monotonic);
+  builder->CreateCondBr(builder->CreateExtractValue(Locked, 1), WriteBB, DoneBB);
+
+  builder->SetInsertPoint(WriteBB);
+  builder->CreateFence(AtomicOrdering::Release);
+  for (unsigned i=0, e=E.Keys.size(); i<e; i++) {
+    MemoStoreSlot(E, i + 1, E.Keys[i], AtomicOrdering::Monotonic);
+  }
+  MemoStoreSlot(E, E.Keys.size() + 1, builder->CreateBitCast(RetVal, IntTy), AtomicOrdering::Monotonic);
+  MemoStoreSlot(E, 0, builder->CreateAdd(Old, ConstantInt::get(IntTy, 2)), AtomicOrdering::Release);
+  builder->CreateBr(DoneBB);
+
+  builder->SetInsertPoint(DoneBB);
+}
+
 /************************* Function Tree **************************/
 FunctionAST::FunctionAST(PrototypeAST* Proto, ExprAST* Body): Proto(Proto), Body(Body) {};
 
+// The prototype is not freed: it stays in drv.Prototypes, the functions
+// declared so far
+FunctionAST::~FunctionAST() {
+  delete Body;
+};
+
 Function *FunctionAST::codegen(driver& drv) {
   // Verifica che la funzione non sia già presente nel modulo, cioò che non
-  // si tenti una "doppia definizion"
-  Function *function = 
-      module->getFunction(std::get<std::string>(Proto->getLexVal()));
+  // si tenti una "doppia definizion" (with -threads, in the module of a
+  // previous item; the REPL lets functions be defined again)
+  std::string Name = std::get<std::string>(Proto->getLexVal());
+  Function *function = drv.interactive ? module->getFunction(Name) : LookupFunction(drv, Name);
   // Se la funzione non è già presente, si prova a definirla, innanzitutto
   // generando (ma non emettendo) il codice del prototipo
   if (!function)
@@ -492,9 +2319,20 @@ Function *FunctionAST::codegen(driver& drv) {
   if (!function)
     return nullptr;  
 
+  if (!checkPure()) {
+    function->eraseFromParent();
+    return nullptr;
+  }
+
   // Altrimenti si crea un blocco di base in cui iniziare a inserire il codice
+  TargetAttributes(drv, function);
   BasicBlock *BB = BasicBlock::Create(*context, "entry", function);
+  drv.ArrayLengths.clear();
+  drv.RowTypes.clear();
+  drv.ArenaMarks.clear();
+  drv.Loops.clear();
   builder->SetInsertPoint(BB);
+  DebugFunction(drv, function, this);
  
   // Ora viene la parte "più delicata". Per ogni parametro formale della
   // funzione, nella symbol table si registra una coppia in cui la chiave
@@ -511,79 +2349,241 @@ Function *FunctionAST::codegen(driver& drv) {
   
   for (auto &Arg : function->args()) {
     // Genera l'istruzione di allocazione per il parametro corrente
-    AllocaInst *Alloca = CreateEntryBlockAlloca(function, Arg.getName());
+    // (array parameters are stored as the address of the array)
+    AllocaInst *Alloca = CreateEntryBlockAlloca(function, Arg.getName(), Arg.getType());
     // Genera un'istruzione per la memorizzazione del parametro nell'area
     // di memoria allocata
     builder->CreateStore(&Arg, Alloca);
+    DeclareVariable(drv, Alloca, std::string(Arg.getName()), this, Arg.getArgNo() + 1);
     // Registra gli argomenti nella symbol table per eventuale riferimento futuro
     drv.NamedValues[std::string(Arg.getName())] = Alloca;
   } 
+
+  // A memo function first looks up its arguments in the cache
+  MemoEntry Memo;
+  if (Proto->memoSize()) {
+    Memo = MemoLookup(drv, Proto, function);
+  }
   
   // Ora può essere generato il codice corssipondente al body (che potrà
   // fare riferimento alla symbol table)
-  if (Value *RetVal = Body->codegen(drv)) {
+  // What the body uses is known to its own (recursive) calls as well
+  bool HadUses = drv.Uses.count(Name);
+  FunctionUses PreviousUses = HadUses ? drv.Uses[Name] : FunctionUses();
+  drv.Uses[Name] = uses();
+  drv.Pure = Proto->isPure() ? Proto : nullptr;
+  Value *RetVal = Body->codegen(drv);
+  drv.Pure = nullptr;
+  if (RetVal) {
     // Se la generazione termina senza errori, ciò che rimane da fare è
     // di generare l'istruzione return, che ("a tempo di esecuzione") prenderà
     // il valore lasciato nel registro RetVal 
+    if (Proto->memoSize()) {
+      MemoStore(drv, Proto, function, Memo, RetVal);
+    }
     builder->CreateRet(RetVal);
 
     // Effettua la validazione del codice e un controllo di consistenza
     verifyFunction(*function);
+    DebugFunctionEnd(drv);
+    // Calls with constant arguments may now run the function at compile time
+    if (Proto->isPure())
+      drv.PureFunctions[Name] = this;
+    else
+      drv.PureFunctions.erase(Name);
  
     // Emissione del codice su su stderr) 
-    function->print(errs());
-    fprintf(stderr, "\n");
+    drv.emit(function);
     return function;
   }
 
   // Errore nella definizione. La funzione viene rimossa
+  DebugFunctionEnd(drv);
   function->eraseFromParent();
+  if (HadUses)
+    drv.Uses[Name] = PreviousUses;
+  else
+    drv.Uses.erase(Name);
   return nullptr;
 };
 
+PrototypeAST *FunctionAST::getProto() const {
+  return Proto;
+};
+
+bool FunctionAST::checkPure() const {
+  return !Proto->isPure() || CheckPure(std::get<std::string>(Proto->getLexVal()), Proto, Body);
+};
+
+void FunctionAST::collectUses(SymbolUses& U) const {
+  for (auto &Arg : Proto->getArgs())
+    U.Bound.insert(Arg);
+  Body->collectUses(U);
+};
+
+FunctionUses FunctionAST::uses() const {
+  SymbolUses U;
+  collectUses(U);
+  std::set<std::string> Reads = U.Reads;
+  Reads.insert(U.ArrayReads.begin(), U.ArrayReads.end());
+  std::set<std::string> Writes = U.Writes;
+  for (auto &Write : U.ArrayWrites)
+    Writes.insert(Write.first);
+  FunctionUses F;
+  for (auto &Var : Reads) {
+    if (!U.Bound.count(Var))
+      F.Reads.insert(Var);
+  }
+  for (auto &Var : Writes) {
+    if (!U.Bound.count(Var))
+      F.Writes.insert(Var);
+  }
+  F.Calls = U.Calls;
+  return F;
+};
+
 /*********************** Global Variable Tree ************************/
-GlobalVarAST::GlobalVarAST(const std::string Name):
-   Name(Name) {};
+GlobalVarAST::GlobalVarAST(const std::string Name, ExprAST *Init):
+   Name(Name), Init(Init) {};
+
+GlobalVarAST::~GlobalVarAST() {
+  delete Init;
+};
    
 const std::string& GlobalVarAST::getName() const { 
    return Name; 
 };
 
+Type *GlobalVarAST::getType(driver& drv) const {
+  return drv.numberType();
+};
+
+// Global variables are common symbols, except in the REPL where they are
+// defined once and for all by their own module
+static GlobalValue::LinkageTypes GlobalLinkage(driver& drv) {
+  return drv.interactive ? GlobalValue::ExternalLinkage : GlobalValue::CommonLinkage;
+}
+
+// Generates the initializer of a global in a temporary function, outside
+// the scope of any local variable, and returns it if it folds to a constant
+static Constant *GlobalInitializer(driver& drv, const std::string &Name, ExprAST *Init) {
+  IRBuilderBase::InsertPointGuard Guard(*builder);
+  Function *F = Function::Create(FunctionType::get(drv.numberType(), false),
+                                 Function::InternalLinkage, "", module);
+  builder->SetInsertPoint(BasicBlock::Create(*context, "entry", F));
+  std::map<std::string, AllocaInst*> Locals;
+  std::swap(Locals, drv.NamedValues);
+  Value *Val = Init->codegen(drv);
+  std::swap(Locals, drv.NamedValues);
+  Constant *C = dyn_cast_or_null<Constant>(Val);
+  F->eraseFromParent();
+  if (Val && !C)
+    LogErrorV("Initializer of global "+Name+" cannot be evaluated at compile time");
+  return C;
+}
+
 GlobalVariable* GlobalVarAST::codegen(driver& drv) {
   // Checks if global variable has been already defined
-  if (module->getGlobalVariable(Name)) {
+  if (LookupGlobal(drv, Name)) {
     return (GlobalVariable*)LogErrorV("Global variable "+Name+" has already been defined");
   }
 
-  // Create global variable
-  GlobalVariable* GlobalVar = new GlobalVariable(*module, Type::getDoubleTy(*context), false, GlobalValue::CommonLinkage, ConstantFP::get(Type::getDoubleTy(*context), 0.0), Name);
+  // The initial value must be a constant: calls are evaluated at compile
+  // time (see CallExprAST::codegen), there is no code running at startup
+  Constant *InitVal = ConstantFP::get(getType(drv), 0.0);
+  if (Init && !(InitVal = GlobalInitializer(drv, Name, Init)))
+    return nullptr;
+
+  // Create global variable (common symbols are initialized to zero)
+  GlobalVariable* GlobalVar = new GlobalVariable(*module, getType(drv), false,
+      Init ? GlobalValue::ExternalLinkage : GlobalLinkage(drv), InitVal, Name);
+  drv.GlobalTypes[Name] = GlobalVar->getValueType();
+
+  // Print global variable
+  drv.emit(GlobalVar);
+
+  // Return global variable
+  return GlobalVar;
+};
+
+void GlobalVarAST::collectUses(SymbolUses& U) const {
+  if (Init) Init->collectUses(U);
+};
+
+/*************************** Record Tree ****************************/
+RecordAST::RecordAST(const std::string Name, std::vector<std::string> Fields, bool SoA):
+  Name(Name), Fields(std::move(Fields)), SoA(SoA) {};
 
-  // Print global variable
-  GlobalVar->print(errs());
-  std::cerr << std::endl;
+Record RecordAST::getRecord() const {
+  return Record{Name, Fields, SoA, Line, Col};
+};
 
-  // Return global variable
-  return GlobalVar;
+// Records the type: with -threads it has already been recorded, from this
+// same declaration, before the items are generated (see parallel.cpp)
+Value *RecordAST::codegen(driver& drv) {
+  auto It = drv.Records.find(Name);
+  if (It != drv.Records.end() && (It->second.Line != Line || It->second.Col != Col)) {
+    return LogErrorV("Record "+Name+" has already been defined");
+  }
+  for (auto F = Fields.begin(); F != Fields.end(); ++F) {
+    if (std::find(Fields.begin(), F, *F) != F) {
+      return LogErrorV("Record "+Name+" has two fields named "+*F);
+    }
+  }
+  drv.Records[Name] = getRecord();
+  return nullptr;
 };
 
 /************************* Assignment Tree **************************/
 AssignmentAST::AssignmentAST(const std::string Name, ExprAST* Val):
    Name(Name), Val(Val) {};
+
+AssignmentAST::~AssignmentAST() {
+  delete Val;
+};
    
 const std::string& AssignmentAST::getName() const { 
    return Name; 
 };
 
 Value* AssignmentAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  // An assignment to an array assigns all of its elements (whole-array
+  // assignment, e.g. C = A + B * s): the value is computed element by element
+  Type *BaseType = nullptr;
+  if (Value *Base = ArrayBase(drv, Name, BaseType)) {
+    Value *Length = ArrayLength(drv, Name);
+    if (!Length) {
+      return LogErrorV("Size of array "+Name+" not known");
+    }
+    if (!ElementwiseLength(drv, Val, Length)) {
+      return nullptr;
+    }
+    Value *Init = ConstantFP::get(drv.numberType(), 0.0);
+    Value *Done = ElementLoop(drv, Length, Init, [&](Value *Acc) -> Value* {
+      Value *ElementVal = Val->codegen(drv);
+      if (!ElementVal) {
+        return nullptr;
+      }
+      builder->CreateStore(ElementVal, ElementPtr(drv, Name, Base, BaseType, drv.ElementIndex));
+      return Acc;
+    });
+    return Done ? Base : nullptr;
+  }
+
   // Gets pointer to memory where the value is stored
   Value *Alloca = drv.NamedValues[Name];
 
   // Checks if the variable has been previously defined
   if (!Alloca) {
-    Alloca = module->getGlobalVariable(Name);
-    if (!Alloca) {
+    GlobalVariable *GlobalVar = LookupGlobal(drv, Name);
+    if (!GlobalVar) {
       return LogErrorV("Variable "+Name+" not defined");
     }
+    if (RecordOf(drv, GlobalVar)) {
+      return LogErrorV("Array of records "+Name+" used as a scalar");
+    }
+    Alloca = GlobalVar;
   }
 
   // Generate new value
@@ -599,11 +2599,24 @@ Value* AssignmentAST::codegen(driver& drv) {
   return Alloca;
 };
 
+void AssignmentAST::collectUses(SymbolUses& U) const {
+  U.Writes.insert(Name);
+  U.Assignments.push_back(std::make_pair(Name, Val));
+  Val->collectUses(U);
+};
+
 /************************* If Statement Tree **************************/
 IfStmtAST::IfStmtAST(ExprAST* Cond, RootAST* TrueStmt, RootAST* FalseStmt):
    Cond(Cond), TrueStmt(TrueStmt), FalseStmt(FalseStmt) {};
+
+IfStmtAST::~IfStmtAST() {
+  delete Cond;
+  delete TrueStmt;
+  delete FalseStmt;
+};
    
 Value* IfStmtAST::codegen(driver& drv) {
+  drv.emitLocation(this);
   // Generates code to evaluate the condition and returns the (boolean)
   // result which gets saved in CondV
   Value* CondV = Cond->codegen(drv);
@@ -626,9 +2639,9 @@ Value* IfStmtAST::codegen(driver& drv) {
     
   // Creates and inserts conditional branch instruction
   if (FalseBB) {
-    builder->CreateCondBr(CondV, TrueBB, FalseBB);
+    builder->CreateCondBr(CondV, TrueBB, FalseBB, BranchWeights(Cond));
   } else {
-    builder->CreateCondBr(CondV, TrueBB, MergeBB);
+    builder->CreateCondBr(CondV, TrueBB, MergeBB, BranchWeights(Cond));
   }
 
   // Positions the builder insertion point to the start of TrueBB,
@@ -668,13 +2681,23 @@ Value* IfStmtAST::codegen(driver& drv) {
   function->insert(function->end(), MergeBB);
   // Positions the builder insertion point to the start of MergeBB
   builder->SetInsertPoint(MergeBB);
-  return ConstantFP::get(Type::getDoubleTy(*context), 0.0);
+  return ConstantFP::get(drv.numberType(), 0.0);
+};
+
+void IfStmtAST::collectUses(SymbolUses& U) const {
+  Cond->collectUses(U);
+  TrueStmt->collectUses(U);
+  if (FalseStmt) FalseStmt->collectUses(U);
 };
 
 /************************* For Initialization Tree **************************/
 ForInitAST::ForInitAST(RootAST* Init, bool Binding):
   Init(Init), Binding(Binding) {};
 
+ForInitAST::~ForInitAST() {
+  delete Init;
+};
+
 const bool ForInitAST::isBinding() const {
   return Binding;
 }
@@ -686,15 +2709,35 @@ const std::string& ForInitAST::getName() const {
   return static_cast<AssignmentAST*>(Init)->getName();
 }
    
+bool ForInitAST::onHeap() const {
+  return isBinding() && static_cast<VarBindingAST*>(Init)->onHeap();
+}
+
 Value* ForInitAST::codegen(driver& drv) {
   return Init->codegen(drv);
 }
 
+void ForInitAST::collectUses(SymbolUses& U) const {
+  Init->collectUses(U);
+};
+
 /************************* For Statement Tree **************************/
 ForStmtAST::ForStmtAST(ForInitAST* Init, ExprAST* Cond, RootAST* Update, RootAST* Body):
   Init(Init), Cond(Cond), Update(Update), Body(Body) {};
+
+ForStmtAST::~ForStmtAST() {
+  delete Init;
+  delete Cond;
+  delete Update;
+  delete Body;
+};
+
+void ForStmtAST::setLabel(const std::string &L) {
+  Label = L;
+};
    
 Value* ForStmtAST::codegen(driver& drv) {
+  drv.emitLocation(this);
   // Creates basic blocks (not inserted yet)
   Function *function = builder->GetInsertBlock()->getParent();
   BasicBlock *HeaderBB =  BasicBlock::Create(*context, "loopheader");
@@ -702,22 +2745,30 @@ Value* ForStmtAST::codegen(driver& drv) {
   BasicBlock *LatchBB =  BasicBlock::Create(*context, "loopupdate");
   BasicBlock *ExitBB =  BasicBlock::Create(*context, "loopexit");
 
-  // Generate loop counter variable initialization
-  Value* CounterAlloca = Init->codegen(drv);
+  // An array bound by the initialization lives until the end of the loop
+  Value *Mark = nullptr;
+  if (Init && Init->onHeap()) {
+    Mark = ArenaMark(drv);
+  }
+
+  // Generate loop counter variable initialization (while loops have none)
+  Value* CounterAlloca = Init ? Init->codegen(drv) : ConstantFP::get(drv.numberType(), 0.0);
   if (!CounterAlloca) {
     return nullptr;
   }
 
   // Inserts the counter in the symbol table if it is a binding
   AllocaInst* AllocaTmp = nullptr;
-  if (Init->isBinding()) {
+  if (Init && Init->isBinding()) {
     // If it exists a variable with the same name, it gets temporarily
     // removed and the current one gets inserted (shadowing)
     AllocaTmp = drv.NamedValues[Init->getName()];
     drv.NamedValues[Init->getName()] = static_cast<AllocaInst*>(CounterAlloca);
   }
 
-  // Create unconditional branch to HeaderBB
+  // Create unconditional branch to HeaderBB (which gives the loop its
+  // position in debug info and optimization remarks)
+  drv.emitLocation(this);
   builder->CreateBr(HeaderBB);
 
   // Inserts HeaderBB (which is also the exiting node) in the function
@@ -734,14 +2785,16 @@ Value* ForStmtAST::codegen(driver& drv) {
   // Creates conditional branch:
   //   - True: jump to starting block of loop body
   //   - False: jump to exit block
-  builder->CreateCondBr(CondV, BodyBB, ExitBB);
+  builder->CreateCondBr(CondV, BodyBB, ExitBB, BranchWeights(Cond));
 
   // Inserts BodyBB in the function and sets it as the builder's insertion block
   function->insert(function->end(), BodyBB);
   builder->SetInsertPoint(BodyBB);
 
-  // Generates loop body
+  // Generates loop body: break jumps to ExitBB and continue to LatchBB
+  drv.Loops.push_back({Label, ExitBB, LatchBB, drv.ArenaMarks.size()});
   Value* BodyV = Body->codegen(drv);
+  drv.Loops.pop_back();
   if (!BodyV) {
     return nullptr;
   }
@@ -754,49 +2807,168 @@ Value* ForStmtAST::codegen(driver& drv) {
   builder->SetInsertPoint(LatchBB);
 
   // Generates counter update code
-  Value* UpdateV = Update->codegen(drv);
-  if (!UpdateV) {
+  if (Update && !Update->codegen(drv)) {
     return nullptr;
   }
   
   // Creates unconditional branch to HeaderBB
-  builder->CreateBr(HeaderBB);
+  drv.emitLocation(this);
+  LoopMetadata(builder->CreateBr(HeaderBB), {});
 
   // Inserts ExitBB in the function and sets it as the builder's insertion block
   function->insert(function->end(), ExitBB);
   builder->SetInsertPoint(ExitBB);
 
   // Before exiting block, restore external scope
-  if (Init->isBinding()) {
+  if (Init && Init->isBinding()) {
     drv.NamedValues[Init->getName()] = AllocaTmp;
   }
+  if (Mark) {
+    ArenaRelease(drv, Mark);
+    drv.ArenaMarks.pop_back();
+  }
+
+  return ConstantFP::get(drv.numberType(), 0.0);
+};
+
+void ForStmtAST::collectUses(SymbolUses& U) const {
+  if (Init) Init->collectUses(U);
+  Cond->collectUses(U);
+  if (Update) Update->collectUses(U);
+  Body->collectUses(U);
+};
 
-  return ConstantFP::get(Type::getDoubleTy(*context), 0.0);
+/************************ Break Statement Tree ************************/
+BreakStmtAST::BreakStmtAST(bool Continue, const std::string Label):
+  Continue(Continue), Label(Label) {};
+
+Value* BreakStmtAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  const std::string Stmt = Continue ? "continue" : "break";
+  // The target is the innermost loop, or the innermost one with the label
+  auto Target = drv.Loops.rbegin();
+  while (!Label.empty() && Target != drv.Loops.rend() && Target->Label != Label)
+    ++Target;
+  if (Target == drv.Loops.rend()) {
+    if (Label.empty())
+      return LogErrorV(Stmt+" outside of a loop");
+    return LogErrorV(Stmt+": no enclosing loop labelled "+Label);
+  }
+  BasicBlock *Dest = Continue ? Target->Continue : Target->Break;
+  if (!Dest)
+    return LogErrorV("break cannot leave a parfor loop");
+
+  // Frees the arrays allocated in the arena by the blocks being left: the
+  // oldest of their marks frees all of them
+  if (Target->Marks < drv.ArenaMarks.size())
+    ArenaRelease(drv, drv.ArenaMarks[Target->Marks]);
+  builder->CreateBr(Dest);
+
+  // The statements following break or continue in the same block are
+  // unreachable: they are generated in a block with no predecessors,
+  // which the optimizer removes
+  Function *function = builder->GetInsertBlock()->getParent();
+  builder->SetInsertPoint(BasicBlock::Create(*context, "after" + Stmt, function));
+  return ConstantFP::get(drv.numberType(), 0.0);
 };
 
 /************************* Array Binding Tree **************************/
-ArrayBindingAST::ArrayBindingAST(const std::string Name, int Size, std::vector<ExprAST*> ExprList):
-  VarBindingAST(Name, nullptr), Size(Size), ExprList(std::move(ExprList)) {};
-   
-AllocaInst* ArrayBindingAST::CreateEntryBlockAlloca(Function *fun, StringRef VarName) {
+// Larger local arrays are allocated in the arena instead of the stack
+static const int MaxStackArraySize = 1024;
+
+ArrayBindingAST::ArrayBindingAST(const std::string Name, std::vector<ExprAST*> Dims, std::vector<ExprAST*> ExprList):
+  VarBindingAST(Name, nullptr), Dims(std::move(Dims)), Size(1), ExprList(std::move(ExprList)) {
+  for (auto Dim : this->Dims) {
+    NumberExprAST *Num = dynamic_cast<NumberExprAST*>(Dim);
+    Size = Num && Size >= 0 ? Size * int(std::get<double>(Num->getLexVal())) : -1;
+  }
+};
+
+ArrayBindingAST::~ArrayBindingAST() {
+  for (auto Dim : Dims)
+    delete Dim;
+  for (auto Exp : ExprList)
+    delete Exp;
+};
+
+// The extents of the dimensions after the first one must be constant: they
+// give the type of the rows (nullptr if they are not)
+Type *ArrayBindingAST::rowType(driver& drv) const {
+  Type *Row = drv.numberType();
+  for (size_t i=Dims.size()-1; i>0; i--) {
+    NumberExprAST *Num = dynamic_cast<NumberExprAST*>(Dims[i]);
+    if (!Num) {
+      return nullptr;
+    }
+    Row = ArrayType::get(Row, std::get<double>(Num->getLexVal()));
+  }
+  return Row;
+};
+
+bool ArrayBindingAST::onHeap() const {
+  return Size < 0 || Size > MaxStackArraySize;
+};
+
+AllocaInst* ArrayBindingAST::CreateEntryBlockAlloca(driver& drv, Function *fun, StringRef VarName) {
   IRBuilder<> TmpB(&fun->getEntryBlock(), fun->getEntryBlock().begin());
-  ArrayType *ArrayType = ArrayType::get(Type::getDoubleTy(*context), Size);
+  Type *Row = rowType(drv);
+  ArrayType *ArrayType = ArrayType::get(Row, Size / NumElements(Row));
   return TmpB.CreateAlloca(ArrayType, nullptr, VarName);
 }
 
 AllocaInst* ArrayBindingAST::codegen(driver& drv) {
+  drv.emitLocation(this);
   // if vector is not empty and Size != ExprList's size, then return nullptr
   if (ExprList.size() && ExprList.size() != Size) {
+    if (Size < 0) {
+      return (AllocaInst*)LogErrorV("Array "+Name+" with an initializer list must have a constant size");
+    }
     return nullptr;
   }
+  Type *Row = rowType(drv);
+  if (!Row) {
+    return (AllocaInst*)LogErrorV("Array "+Name+" must have constant sizes after the first one");
+  }
 
   // CreateEntryAlloca
   Function *fun = builder->GetInsertBlock()->getParent();
 
-  // Creates the alloca instruction at the start of the function and returns it
-  AllocaInst *Alloca = ArrayBindingAST::CreateEntryBlockAlloca(fun, Name);
-  if (!Alloca) {
-    return nullptr;
+  AllocaInst *Alloca = nullptr;
+  Type *BaseType = nullptr;
+  if (!onHeap()) {
+    // Creates the alloca instruction at the start of the function and returns it
+    Alloca = ArrayBindingAST::CreateEntryBlockAlloca(drv, fun, Name);
+    BaseType = Alloca->getAllocatedType();
+  } else {
+    // The elements are allocated in the arena and the variable holds their address
+    Type *IndexType = Type::getInt64Ty(*context);
+    Value *Length = nullptr;
+    if (Size >= 0) {
+      Length = ConstantInt::get(IndexType, Size);
+    } else {
+      Value *SizeV = Dims[0]->codegen(drv);
+      if (!SizeV) {
+        return nullptr;
+      }
+      Length = builder->CreateFPToUI(SizeV, IndexType, Name+"len");
+      if (Row->isArrayTy()) {
+        Length = builder->CreateMul(Length, ConstantInt::get(IndexType, NumElements(Row)), Name+"len");
+      }
+    }
+    BaseType = PointerType::getUnqual(*context);
+    FunctionType *FT = FunctionType::get(BaseType, {IndexType}, false);
+    const char *AllocName = drv.single ? "krt_arena_allocf" : "krt_arena_alloc";
+    Function *Alloc = RuntimeFunction(drv, AllocName, FT, [](Function *F) {
+      F->addRetAttr(Attribute::NoAlias);
+      F->addRetAttr(Attribute::getWithAlignment(*context, Align(64)));
+    });
+    Value *Mem = builder->CreateCall(Alloc, {Length}, Name+"mem");
+    Alloca = ::CreateEntryBlockAlloca(fun, Name, BaseType);
+    builder->CreateStore(Mem, Alloca);
+    drv.ArrayLengths[Alloca] = Length;
+    if (Row->isArrayTy()) {
+      drv.RowTypes[Alloca] = Row;
+    }
   }
 
   // Generates code for each expression in ExprList and saves the values in Vals
@@ -812,176 +2984,601 @@ AllocaInst* ArrayBindingAST::codegen(driver& drv) {
 
   // Creates a GEP and a store for each value in Vals
   // (won't generate any if ExprList is empty)
-  ArrayType *ArrayType = ArrayType::get(Type::getDoubleTy(*context), Size);
   Type *IndexType = IntegerType::get(*context, 32);
-  Constant *BaseIndex = ConstantInt::get(IndexType, 0);
   for (int i=0, e=Vals.size(); i<e; i++) {
     Constant *Index = ConstantInt::get(IndexType, i);
-    Value* EP = builder->CreateInBoundsGEP(ArrayType, Alloca, {BaseIndex, Index});
+    Value* EP = ElementPtr(drv, Name, Alloca, BaseType, Index);
     builder->CreateStore(Vals[i], EP);
   }
+  DeclareVariable(drv, Alloca, Name, this);
 
   // Return alloca instruction
   return Alloca;
 };
 
+void ArrayBindingAST::collectUses(SymbolUses& U) const {
+  U.Bound.insert(Name);
+  if (onHeap())
+    U.HeapArrays.insert(Name);
+  for (auto Dim : Dims)
+    Dim->collectUses(U);
+  for (auto exp : ExprList)
+    exp->collectUses(U);
+};
+
 /************************* Array Expression Tree **************************/
-ArrayExprAST::ArrayExprAST(const std::string &Name, ExprAST* Index):
-  Name(Name), Index(Index) {};
+ArrayExprAST::ArrayExprAST(const std::string &Name, std::vector<ExprAST*> Indices):
+  Name(Name), Indices(std::move(Indices)) {};
+
+ArrayExprAST::~ArrayExprAST() {
+  for (auto Index : Indices)
+    delete Index;
+};
 
 Value *ArrayExprAST::codegen(driver& drv) {
-  // Gets array base pointer
-  AllocaInst *Alloca = drv.NamedValues[Name];
+  drv.emitLocation(this);
+  Value* EP = ArrayElementPtr(drv, Name, Indices);
+  if (!EP) {
+    return nullptr;
+  }
 
-  // Checks if the variable has been previously defined locally
-  if (Alloca) {
-    // Checks if the variable is an array
-    if (!Alloca->getAllocatedType()->isArrayTy()) {
-      return LogErrorV("Variable "+Name+" is not an array");
-    }
+  // Creates and returns load instruction for Name[Index]
+  return builder->CreateLoad(drv.numberType(), EP, Name.c_str());
+}
 
-    // Generates code and gets value of Index
-    Value* IndexFP = Index->codegen(drv);
-    if (!IndexFP) {
-      return nullptr;
-    }
+void ArrayExprAST::collectUses(SymbolUses& U) const {
+  U.ArrayReads.insert(Name);
+  U.ArrayReadIndices.push_back(std::make_pair(Name, Indices[0]));
+  for (auto Index : Indices)
+    Index->collectUses(U);
+};
 
-    // Creates conversion instruction from double to int
-    Type *IndexType = IntegerType::get(*context, 32);
-    Value *IndexInt = builder->CreateFPToUI(IndexFP, IndexType);
-    Constant *BaseIndex = ConstantInt::get(IndexType, 0);
+/************************* Array Assignment Tree **************************/
+ArrayAssignmentAST::ArrayAssignmentAST(const std::string Name, std::vector<ExprAST*> Indices, ExprAST* Val):
+  AssignmentAST(Name, Val), Indices(std::move(Indices)) {};
 
-    // Creates GEP instruction
-    Value* EP = builder->CreateInBoundsGEP(Alloca->getAllocatedType(), Alloca, {BaseIndex, IndexInt});
+ArrayAssignmentAST::~ArrayAssignmentAST() {
+  for (auto Index : Indices)
+    delete Index;
+};
 
-    // Creates and returns load instruction for Name[Index]
-    return builder->CreateLoad(Type::getDoubleTy(*context), EP, Name.c_str());
+Value* ArrayAssignmentAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  Value* EP = ArrayElementPtr(drv, Name, Indices);
+  if (!EP) {
+    return nullptr;
   }
 
-  // Gets array
-  GlobalVariable *GlobalVar = module->getGlobalVariable(Name);
+  // Generates code and gets value to assign to Name[Index]
+  Value* BoundVal = Val->codegen(drv);
+  if (!BoundVal) {
+    return nullptr;
+  }
 
-  // Checks if the variable has been previously defined globally
-  if (GlobalVar) {
-    // Checks if the variable is an array
-    if (!GlobalVar->getValueType()->isArrayTy()) {
-      return LogErrorV("Variable "+Name+" is not an array");
-    }
+  // Creates and returns store instruction for Name[Index]=Val
+  builder->CreateStore(BoundVal, EP);
 
-    // Generates code and gets value of Index
-    Value* IndexFP = Index->codegen(drv);
-    if (!IndexFP) {
-      return nullptr;
-    }
+  return EP;
+};
 
-    // Creates conversion instruction from double to int
-    Type *IndexType = IntegerType::get(*context, 32);
-    Value *IndexInt = builder->CreateFPToUI(IndexFP, IndexType);
-    Constant *BaseIndex = ConstantInt::get(IndexType, 0);
+// The write is recorded with its first index, which selects the row
+void ArrayAssignmentAST::collectUses(SymbolUses& U) const {
+  U.ArrayWrites.push_back(std::make_pair(Name, Indices[0]));
+  for (auto Index : Indices)
+    Index->collectUses(U);
+  Val->collectUses(U);
+};
 
-    // Creates GEP instruction
-    Value* EP = builder->CreateInBoundsGEP(GlobalVar->getValueType(), GlobalVar, {BaseIndex, IndexInt});
+/*********************** Global Array Tree ************************/
+GlobalArrayAST::GlobalArrayAST(const std::string Name, std::vector<int> Dims):
+  GlobalVarAST(Name), Dims(std::move(Dims)) {};
+
+// Multi-dimensional arrays are arrays of rows: [r x [c x double]]
+Type *GlobalArrayAST::getType(driver& drv) const {
+  Type *Ty = drv.numberType();
+  for (auto Dim = Dims.rbegin(); Dim != Dims.rend(); ++Dim)
+    Ty = ArrayType::get(Ty, *Dim);
+  return Ty;
+};
 
-    // Creates and returns load instruction for Name[Index]
-    return builder->CreateLoad(Type::getDoubleTy(*context), EP, Name.c_str());
+GlobalVariable* GlobalArrayAST::codegen(driver& drv) {
+  // Checks if global variable has been already defined
+  if (LookupGlobal(drv, Name)) {
+    return (GlobalVariable*)LogErrorV("Global variable "+Name+" has already been defined");
   }
 
-  return LogErrorV("Variable "+Name+" not defined");
+  // Create global variable
+  GlobalVariable* GlobalVar = new GlobalVariable(*module, getType(drv), false, GlobalLinkage(drv), Constant::getNullValue(getType(drv)), Name);
+  drv.GlobalTypes[Name] = GlobalVar->getValueType();
+
+  // Print global variable
+  drv.emit(GlobalVar);
+
+  // Return global variable
+  return GlobalVar;
+};
+/*********************** Global Record Tree ************************/
+GlobalRecordAST::GlobalRecordAST(const std::string Name, const std::string RecordName, int Size):
+  GlobalVarAST(Name), RecordName(RecordName), Size(Size) {};
+
+const std::string& GlobalRecordAST::getRecordName() const {
+  return RecordName;
+};
+
+// [n x {double, ...}] with a number for each field, or for the struct of
+// arrays layout {[n x double], ...} with an array for each field
+Type *GlobalRecordAST::getType(driver& drv) const {
+  auto It = drv.Records.find(RecordName);
+  if (It == drv.Records.end()) {
+    return nullptr;
+  }
+  const Record &R = It->second;
+  if (R.SoA) {
+    Type *FieldTy = ArrayType::get(drv.numberType(), Size);
+    return StructType::get(*context, std::vector<Type*>(R.Fields.size(), FieldTy));
+  }
+  Type *ElementTy = StructType::get(*context, std::vector<Type*>(R.Fields.size(), drv.numberType()));
+  return ArrayType::get(ElementTy, Size);
+};
+
+GlobalVariable* GlobalRecordAST::codegen(driver& drv) {
+  // Checks if global variable has been already defined
+  if (LookupGlobal(drv, Name)) {
+    return (GlobalVariable*)LogErrorV("Global variable "+Name+" has already been defined");
+  }
+  Type *Ty = getType(drv);
+  if (!Ty) {
+    return (GlobalVariable*)LogErrorV("Record "+RecordName+" not defined");
+  }
+
+  // Create global variable
+  GlobalVariable* GlobalVar = new GlobalVariable(*module, Ty, false, GlobalLinkage(drv), Constant::getNullValue(Ty), Name);
+  drv.GlobalTypes[Name] = Ty;
+  drv.RecordArrays[Name] = RecordName;
+
+  // Print global variable
+  drv.emit(GlobalVar);
+
+  // Return global variable
+  return GlobalVar;
+};
+
+/************************* Field Expression Tree **************************/
+FieldExprAST::FieldExprAST(const std::string &Name, ExprAST* Index, const std::string &Field):
+  Name(Name), Index(Index), Field(Field) {};
+
+FieldExprAST::~FieldExprAST() {
+  delete Index;
+};
+
+Value *FieldExprAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  Value *FP = FieldPtr(drv, Name, Index, Field);
+  if (!FP) {
+    return nullptr;
+  }
+  return builder->CreateLoad(drv.numberType(), FP, Name+"."+Field);
 }
 
-/************************* Array Assignment Tree **************************/
-ArrayAssignmentAST::ArrayAssignmentAST(const std::string Name, ExprAST* Index, ExprAST* Val):
-  AssignmentAST(Name, Val), Index(Index) {};
+void FieldExprAST::collectUses(SymbolUses& U) const {
+  U.ArrayReads.insert(Name);
+  U.ArrayReadIndices.push_back(std::make_pair(Name, Index));
+  Index->collectUses(U);
+};
 
-Value* ArrayAssignmentAST::codegen(driver& drv) {
-  // Gets array base pointer
-  AllocaInst *Alloca = drv.NamedValues[Name];
+/************************* Field Assignment Tree **************************/
+FieldAssignmentAST::FieldAssignmentAST(const std::string Name, ExprAST* Index, const std::string Field, ExprAST* Val):
+  AssignmentAST(Name, Val), Index(Index), Field(Field) {};
 
-  Value *EP = nullptr;
-  Value *RetVal = nullptr;
-  // Checks if the variable has been previously defined locally
-  if (Alloca) {
-    // Checks if the variable is an array
-    if (!Alloca->getAllocatedType()->isArrayTy()) {
-      return LogErrorV("Variable "+Name+" is not an array");
-    }
+FieldAssignmentAST::~FieldAssignmentAST() {
+  delete Index;
+};
 
-    // Generates code and gets value of Index
-    Value* IndexFP = Index->codegen(drv);
-    if (!IndexFP) {
-      return nullptr;
-    }
+Value* FieldAssignmentAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  Value *FP = FieldPtr(drv, Name, Index, Field);
+  if (!FP) {
+    return nullptr;
+  }
+  Value* BoundVal = Val->codegen(drv);
+  if (!BoundVal) {
+    return nullptr;
+  }
+  builder->CreateStore(BoundVal, FP);
+  return FP;
+};
+
+void FieldAssignmentAST::collectUses(SymbolUses& U) const {
+  U.ArrayWrites.push_back(std::make_pair(Name, Index));
+  Index->collectUses(U);
+  Val->collectUses(U);
+};
 
-    // Creates conversion instruction from double to int
-    Type *IndexType = IntegerType::get(*context, 32);
-    Value *IndexInt = builder->CreateFPToUI(IndexFP, IndexType);
-    Constant *BaseIndex = ConstantInt::get(IndexType, 0);
+/********************* Parallel For Statement Tree **********************/
+ParForStmtAST::ParForStmtAST(const std::string VarName, ExprAST* Start, const std::string CondVar,
+                             ExprAST* End, const std::string UpdateVar, const std::string RedOp,
+                             const std::string RedVar, RootAST* Body):
+  VarName(VarName), Start(Start), CondVar(CondVar), End(End), UpdateVar(UpdateVar),
+  RedOp(RedOp), RedVar(RedVar), Body(Body) {};
+
+ParForStmtAST::~ParForStmtAST() {
+  delete Start;
+  delete End;
+  delete Body;
+};
 
-    // Creates GEP instruction
-    EP = builder->CreateInBoundsGEP(Alloca->getAllocatedType(), Alloca, {BaseIndex, IndexInt});
-    RetVal = Alloca;
+void ParForStmtAST::collectUses(SymbolUses& U) const {
+  U.Bound.insert(VarName);
+  Start->collectUses(U);
+  End->collectUses(U);
+  if (!RedVar.empty()) {
+    U.Reads.insert(RedVar);
+    U.ReadCounts[RedVar]++;
+    U.Writes.insert(RedVar);
+    U.Assignments.push_back(std::make_pair(RedVar, nullptr));
   }
+  Body->collectUses(U);
+};
 
-  // Gets array
-  GlobalVariable *GlobalVar = module->getGlobalVariable(Name);
+// Maps the reduction operator of a parfor loop to its runtime code
+static int ReductionOp(const std::string &Op) {
+  if (Op == "+") return KRT_RED_ADD;
+  if (Op == "*") return KRT_RED_MUL;
+  if (Op == "min") return KRT_RED_MIN;
+  if (Op == "max") return KRT_RED_MAX;
+  return KRT_RED_NONE;
+}
 
-  // Checks if the variable has been previously defined globally
-  if (GlobalVar) {
-    // Checks if the variable is an array
-    if (!GlobalVar->getValueType()->isArrayTy()) {
-      return LogErrorV("Variable "+Name+" is not an array");
-    }
+// Neutral element of a reduction operator
+static Value *ReductionIdentity(driver& drv, int Op) {
+  switch (Op) {
+  case KRT_RED_MUL:
+    return ConstantFP::get(drv.numberType(), 1.0);
+  case KRT_RED_MIN:
+    return ConstantFP::getInfinity(drv.numberType(), false);
+  case KRT_RED_MAX:
+    return ConstantFP::getInfinity(drv.numberType(), true);
+  default:
+    return ConstantFP::get(drv.numberType(), 0.0);
+  }
+}
 
-    // Generates code and gets value of Index
-    Value* IndexFP = Index->codegen(drv);
-    if (!IndexFP) {
-      return nullptr;
+// Combines two partial results of a reduction
+static Value *ReductionCombine(int Op, Value *L, Value *R) {
+  switch (Op) {
+  case KRT_RED_MUL:
+    return builder->CreateFMul(L, R, "redmul");
+  case KRT_RED_MIN:
+    return builder->CreateBinaryIntrinsic(Intrinsic::minnum, L, R, nullptr, "redmin");
+  case KRT_RED_MAX:
+    return builder->CreateBinaryIntrinsic(Intrinsic::maxnum, L, R, nullptr, "redmax");
+  default:
+    return builder->CreateFAdd(L, R, "redadd");
+  }
+}
+
+// Generates the outlined body of the loop, i.e. a function
+//   double body(double lo, double hi, ptr env)
+// that runs the iterations lo, lo+1, ... smaller than hi and returns their
+// partial reduction. The captured variables are read from env: scalars are
+// copied (each chunk works on private copies) and arrays are passed by address.
+// The runtime library works in double: with -fsingle the bounds and the
+// result are converted
+Function *ParForStmtAST::outline(driver& drv, const std::vector<std::string>& Captured,
+                                 StructType *EnvType) {
+  Type *NumberTy = drv.numberType();
+  Type *DoubleTy = Type::getDoubleTy(*context);
+  FunctionType *FT = FunctionType::get(DoubleTy,
+      {DoubleTy, DoubleTy, PointerType::getUnqual(*context)}, false);
+  // The outlined function is placed (and printed) before the enclosing one
+  Function *Parent = builder->GetInsertBlock()->getParent();
+  Function *F = Function::Create(FT, Function::InternalLinkage, Parent->getName() + ".parfor");
+  module->getFunctionList().insert(Parent->getIterator(), F);
+  TargetAttributes(drv, F);
+  Argument *Lo = F->getArg(0);
+  Argument *Hi = F->getArg(1);
+  Argument *Env = F->getArg(2);
+  Lo->setName("lo");
+  Hi->setName("hi");
+  Env->setName("env");
+
+  // The body is generated in a new function: the insertion point and the
+  // symbol table of the enclosing function are restored afterwards
+  IRBuilderBase::InsertPoint SavedIP = builder->saveIP();
+  DebugLoc SavedLoc = builder->getCurrentDebugLocation();
+  std::map<std::string, AllocaInst*> SavedValues = drv.NamedValues;
+  drv.NamedValues.clear();
+  std::vector<Value*> SavedMarks = drv.ArenaMarks;
+  std::vector<LoopTarget> SavedLoops = drv.Loops;
+  drv.ArenaMarks.clear();
+  drv.Loops.clear();
+
+  BasicBlock *EntryBB = BasicBlock::Create(*context, "entry", F);
+  builder->SetInsertPoint(EntryBB);
+  DebugFunction(drv, F, this);
+  for (int i=0, e=Captured.size(); i<e; i++) {
+    Type *FieldType = EnvType->getElementType(i);
+    Value *FieldPtr = builder->CreateStructGEP(EnvType, Env, i);
+    Value *V = builder->CreateLoad(FieldType, FieldPtr, Captured[i]);
+    AllocaInst *Alloca = CreateEntryBlockAlloca(F, Captured[i], FieldType);
+    builder->CreateStore(V, Alloca);
+    drv.NamedValues[Captured[i]] = Alloca;
+    // Arrays are captured by address: multi-dimensional ones keep their rows
+    AllocaInst *Outer = SavedValues[Captured[i]];
+    Type *Row = RowType(drv, Outer, Outer->getAllocatedType());
+    if (Row->isArrayTy()) {
+      drv.RowTypes[Alloca] = Row;
     }
+  }
+  AllocaInst *Counter = CreateEntryBlockAlloca(drv, F, VarName);
+  builder->CreateStore(builder->CreateFPTrunc(Lo, NumberTy, "lo"), Counter);
+  Value *HiV = builder->CreateFPTrunc(Hi, NumberTy, "hi");
+  DeclareVariable(drv, Counter, VarName, this);
+  drv.NamedValues[VarName] = Counter;
+  AllocaInst *Red = nullptr;
+  if (!RedVar.empty()) {
+    // Each chunk starts its partial result from the neutral element
+    Red = CreateEntryBlockAlloca(drv, F, RedVar);
+    builder->CreateStore(ReductionIdentity(drv, ReductionOp(RedOp)), Red);
+    drv.NamedValues[RedVar] = Red;
+  }
+
+  BasicBlock *HeaderBB = BasicBlock::Create(*context, "loopheader", F);
+  BasicBlock *BodyBB = BasicBlock::Create(*context, "loopbody");
+  BasicBlock *LatchBB = BasicBlock::Create(*context, "loopupdate");
+  BasicBlock *ExitBB = BasicBlock::Create(*context, "loopexit");
+  builder->CreateBr(HeaderBB);
+
+  // Loop condition: VarName < hi
+  builder->SetInsertPoint(HeaderBB);
+  Value *CounterV = builder->CreateLoad(NumberTy, Counter, VarName);
+  Value *CondV = builder->CreateFCmpULT(CounterV, HiV, "lttest");
+  builder->CreateCondBr(CondV, BodyBB, ExitBB);
+
+  // continue ends the iteration, break is rejected: the iterations are
+  // not run in order
+  F->insert(F->end(), BodyBB);
+  builder->SetInsertPoint(BodyBB);
+  drv.Loops.push_back({"", nullptr, LatchBB, 0});
+  Value *BodyV = Body->codegen(drv);
+  drv.Loops = SavedLoops;
+  drv.ArenaMarks = SavedMarks;
+  if (!BodyV) {
+    DebugFunctionEnd(drv);
+    F->eraseFromParent();
+    drv.NamedValues = SavedValues;
+    builder->restoreIP(SavedIP);
+    builder->SetCurrentDebugLocation(SavedLoc);
+    return nullptr;
+  }
+  builder->CreateBr(LatchBB);
+
+  // Counter update: ++VarName
+  F->insert(F->end(), LatchBB);
+  builder->SetInsertPoint(LatchBB);
+  CounterV = builder->CreateLoad(NumberTy, Counter, VarName);
+  Value *NextV = builder->CreateFAdd(CounterV, ConstantFP::get(NumberTy, 1.0), "addres");
+  builder->CreateStore(NextV, Counter);
+  builder->CreateBr(HeaderBB);
+
+  // Returns the partial reduction of the chunk
+  F->insert(F->end(), ExitBB);
+  builder->SetInsertPoint(ExitBB);
+  if (Red)
+    builder->CreateRet(builder->CreateFPExt(builder->CreateLoad(NumberTy, Red, RedVar), DoubleTy));
+  else
+    builder->CreateRet(ConstantFP::get(DoubleTy, 0.0));
+
+  verifyFunction(*F);
+  DebugFunctionEnd(drv);
+  drv.emit(F);
+
+  drv.NamedValues = SavedValues;
+  builder->restoreIP(SavedIP);
+  builder->SetCurrentDebugLocation(SavedLoc);
+  return F;
+}
 
-    // Creates conversion instruction from double to int
-    Type *IndexType = IntegerType::get(*context, 32);
-    Value *IndexInt = builder->CreateFPToUI(IndexFP, IndexType);
-    Constant *BaseIndex = ConstantInt::get(IndexType, 0);
+// Whether E is the variable Name
+static bool IsVariable(ExprAST *E, const std::string &Name) {
+  VariableExprAST *Var = dynamic_cast<VariableExprAST*>(E);
+  return Var && std::get<std::string>(Var->getLexVal()) == Name;
+}
 
-    // Creates GEP instruction
-    EP = builder->CreateInBoundsGEP(GlobalVar->getValueType(), GlobalVar, {BaseIndex, IndexInt});
-    RetVal = GlobalVar;
+// Whether Val updates the reduction variable Var as Var = Var op e (for
+// + and *, also Var - e and Var / e), or Var = min(Var, e) and max
+static bool ReductionUpdate(const std::string &Op, const std::string &Var, ExprAST *Val) {
+  if (BinaryExprAST *Bin = dynamic_cast<BinaryExprAST*>(Val)) {
+    char BinOp = Bin->getOp();
+    bool Left = IsVariable(Bin->getLHS(), Var);
+    bool Right = IsVariable(Bin->getRHS(), Var);
+    if (Op == "+")
+      return (BinOp == '+' && (Left || Right)) || (BinOp == '-' && Left);
+    if (Op == "*")
+      return (BinOp == '*' && (Left || Right)) || (BinOp == '/' && Left);
+    return false;
   }
+  if (CallExprAST *Call = dynamic_cast<CallExprAST*>(Val)) {
+    const std::vector<ExprAST*> &Args = Call->getArgs();
+    return (Op == "min" || Op == "max") && std::get<std::string>(Call->getLexVal()) == Op &&
+           Args.size() == 2 && (IsVariable(Args[0], Var) || IsVariable(Args[1], Var));
+  }
+  return false;
+}
 
-  if (EP) {
-    // Generates code and gets value to assign to Name[Index]
-    Value* BoundVal = Val->codegen(drv);
-    if (!BoundVal) {
-      return nullptr;
-    }
+// Whether the function Name, or a function it calls, assigns a global
+// variable (returned in Global). Only the functions defined so far are known
+static bool WritesGlobal(driver& drv, const std::string &Name, std::set<std::string> &Visited,
+                         std::string &Global) {
+  if (!Visited.insert(Name).second)
+    return false;
+  const FunctionUses *U = drv.uses(Name);
+  if (!U)
+    return false;
+  if (!U->Writes.empty()) {
+    Global = *U->Writes.begin();
+    return true;
+  }
+  for (auto &Callee : U->Calls) {
+    if (WritesGlobal(drv, Callee, Visited, Global))
+      return true;
+  }
+  return false;
+}
 
-    // Creates and returns store instruction for Name[Index]=Val
-    builder->CreateStore(BoundVal, EP);
+Value* ParForStmtAST::codegen(driver& drv) {
+  drv.emitLocation(this);
+  // Only loops of the form parfor (var i = a; i < b; ++i) are supported,
+  // whose iterations are independent of the order in which they are run
+  if (CondVar != VarName || UpdateVar != VarName) {
+    return LogErrorV("parfor loop must have the form parfor (var "+VarName+" = a; "+
+                     VarName+" < b; ++"+VarName+")");
+  }
 
-    return RetVal;
+  int Op = ReductionOp(RedOp);
+  AllocaInst *RedAlloca = nullptr;
+  if (!RedOp.empty()) {
+    if (Op == KRT_RED_NONE) {
+      return LogErrorV("Reduction operator "+RedOp+" not supported");
+    }
+    RedAlloca = drv.NamedValues[RedVar];
+    if (!RedAlloca || RedAlloca->getAllocatedType() != drv.numberType()) {
+      return LogErrorV("Reduction variable "+RedVar+" must be a local variable");
+    }
   }
 
-  return LogErrorV("Variable "+Name+" not defined");
-};
+  // Iterations run concurrently, so the body may only assign variables
+  // declared inside it, the reduction variable and the elements of arrays
+  // indexed by the loop variable. Anything else would be a loop-carried
+  // dependence (or a data race) between iterations
+  SymbolUses U;
+  Body->collectUses(U);
+  for (auto &Name : U.Writes) {
+    if (Name == VarName) {
+      return LogErrorV("parfor body cannot assign loop variable "+VarName);
+    }
+    if (Name != RedVar && !U.Bound.count(Name)) {
+      return LogErrorV("parfor body cannot assign variable "+Name+" declared outside the loop");
+    }
+  }
+  std::set<std::string> Written; // Arrays declared outside, assigned by the body
+  for (auto &Write : U.ArrayWrites) {
+    if (U.Bound.count(Write.first)) {
+      continue;
+    }
+    if (!IsVariable(Write.second, VarName)) {
+      return LogErrorV("parfor body assigns "+Write.first+" at an index other than "+
+                       VarName+": possible loop-carried dependence");
+    }
+    Written.insert(Write.first);
+  }
+  // Those arrays can be read only at the element of the iteration, too
+  for (auto &Read : U.ArrayReadIndices) {
+    if (Written.count(Read.first) && !IsVariable(Read.second, VarName)) {
+      return LogErrorV("parfor body reads "+Read.first+" at an index other than "+VarName+
+                       ", and assigns it: possible loop-carried dependence");
+    }
+  }
+  for (auto &Name : Written) {
+    if (U.Reads.count(Name)) {
+      return LogErrorV("parfor body uses the whole array "+Name+
+                       ", and assigns it: possible loop-carried dependence");
+    }
+  }
+  // Each chunk accumulates into its own copy of the reduction variable,
+  // starting from the neutral element: the body may only update it with
+  // s = s op e, and never read it otherwise
+  if (!RedVar.empty()) {
+    unsigned Updates = 0;
+    for (auto &Assign : U.Assignments) {
+      if (Assign.first != RedVar) {
+        continue;
+      }
+      if (!ReductionUpdate(RedOp, RedVar, Assign.second)) {
+        return LogErrorV("parfor body can only update reduction variable "+RedVar+" as "+
+                         RedVar+" = "+(Op == KRT_RED_MIN || Op == KRT_RED_MAX ?
+                         RedOp+"("+RedVar+", e)" : RedVar+" "+RedOp+" e"));
+      }
+      Updates++;
+    }
+    if (U.ReadCounts[RedVar] != Updates) {
+      return LogErrorV("parfor body reads reduction variable "+RedVar+
+                       " outside of its updates");
+    }
+  }
+  // Functions called by the body must not assign globals, which would be
+  // a data race between the iterations. Externs are not checked
+  for (auto &Callee : U.Calls) {
+    std::set<std::string> Visited;
+    std::string Global;
+    if (WritesGlobal(drv, Callee, Visited, Global)) {
+      return LogErrorV("parfor body calls "+Callee+", which assigns global variable "+
+                       Global+": possible data race");
+    }
+  }
 
-/*********************** Global Array Tree ************************/
-GlobalArrayAST::GlobalArrayAST(const std::string Name, int Size):
-  GlobalVarAST(Name), Size(Size) {};
+  // Generates loop bounds
+  Value *StartV = Start->codegen(drv);
+  if (!StartV) {
+    return nullptr;
+  }
+  Value *EndV = End->codegen(drv);
+  if (!EndV) {
+    return nullptr;
+  }
 
-GlobalVariable* GlobalArrayAST::codegen(driver& drv) {
-  // Checks if global variable has been already defined
-  if (module->getGlobalVariable(Name)) {
-    return (GlobalVariable*)LogErrorV("Global variable "+Name+" has already been defined");
+  // Local variables used by the body are captured in an environment
+  // structure: scalars by value and arrays by address
+  std::set<std::string> Refs = U.Reads;
+  Refs.insert(U.ArrayReads.begin(), U.ArrayReads.end());
+  for (auto &Write : U.ArrayWrites) {
+    Refs.insert(Write.first);
+  }
+  std::vector<std::string> Captured;
+  std::vector<Type*> Fields;
+  for (auto &Name : Refs) {
+    auto It = drv.NamedValues.find(Name);
+    if (Name == VarName || Name == RedVar || It == drv.NamedValues.end() || !It->second) {
+      continue;
+    }
+    Type *AllocatedType = It->second->getAllocatedType();
+    Captured.push_back(Name);
+    Fields.push_back(AllocatedType->isArrayTy() ? PointerType::getUnqual(*context) : AllocatedType);
   }
+  StructType *EnvType = StructType::get(*context, Fields);
 
-  // Create global variable
-  ArrayType *ArrayType = ArrayType::get(Type::getDoubleTy(*context), Size);
-  GlobalVariable* GlobalVar = new GlobalVariable(*module, ArrayType, false, GlobalValue::CommonLinkage, Constant::getNullValue(ArrayType), Name);
+  Function *function = builder->GetInsertBlock()->getParent();
+  AllocaInst *Env = CreateEntryBlockAlloca(function, "parforenv", EnvType);
+  for (int i=0, e=Captured.size(); i<e; i++) {
+    AllocaInst *Alloca = drv.NamedValues[Captured[i]];
+    Value *V = Alloca;
+    if (!Alloca->getAllocatedType()->isArrayTy()) {
+      V = builder->CreateLoad(Alloca->getAllocatedType(), Alloca, Captured[i]);
+    }
+    builder->CreateStore(V, builder->CreateStructGEP(EnvType, Env, i));
+  }
 
-  // Print global variable
-  GlobalVar->print(errs());
-  std::cerr << std::endl;
+  Function *BodyF = outline(drv, Captured, EnvType);
+  if (!BodyF) {
+    return nullptr;
+  }
 
-  // Return global variable
-  return GlobalVar;
-};
\ No newline at end of file
+  // Runs the loop on the thread pool of the runtime library
+  Type *DoubleTy = Type::getDoubleTy(*context);
+  Type *PtrTy = PointerType::getUnqual(*context);
+  FunctionType *FT = FunctionType::get(DoubleTy,
+      {PtrTy, PtrTy, DoubleTy, DoubleTy, Type::getInt32Ty(*context)}, false);
+  Function *ParFor = RuntimeFunction(drv, "krt_parfor", FT);
+  Value *OpV = ConstantInt::get(Type::getInt32Ty(*context), Op);
+  Value *Total = builder->CreateCall(ParFor, {BodyF, Env, builder->CreateFPExt(StartV, DoubleTy),
+                                     builder->CreateFPExt(EndV, DoubleTy), OpV}, "parfortmp");
+  Total = builder->CreateFPTrunc(Total, drv.numberType());
+
+  // Combines the result of the loop with the value of the reduction variable
+  if (RedAlloca) {
+    Value *RedV = builder->CreateLoad(RedAlloca->getAllocatedType(), RedAlloca, RedVar);
+    builder->CreateStore(ReductionCombine(Op, RedV, Total), RedAlloca);
+  }
+
+  return ConstantFP::get(drv.numberType(), 0.0);
+};
@@ -4,18 +4,45 @@
 #include "llvm/ADT/APFloat.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+/******************** Optimization and target modules **********************/
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize/LoopVectorize.h"
+#include "llvm/TargetParser/Host.h"
 /**************** C++ modules and generic data types ***********************/
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <utility>
 #include <vector>
 #include <variant>
 
@@ -27,10 +54,45 @@ using namespace llvm;
 // Flex va proprio a cercare YY_DECL perché
 // deve espanderla (usando M4) nel punto appropriato
 # define YY_DECL \
-  yy::parser::symbol_type yylex (driver& drv)
+  yy::parser::symbol_type yylex (driver& drv, void *yyscanner)
 // Per il parser è sufficiente una forward declaration
 YY_DECL;
 
+class RemarkHandler;
+class StreamState;
+class Interpreter;
+
+// Output of the compiler (stderr and stdout unless redirected, see server.cpp)
+raw_ostream &errStream();
+raw_ostream &outStream();
+void redirectOutput(raw_ostream *Err, raw_ostream *Out);
+
+// Loop that break and continue statements can leave or restart
+struct LoopTarget {
+  std::string Label;    // Empty if the loop has no label
+  BasicBlock *Break;    // loopexit, nullptr if the loop cannot be left (parfor)
+  BasicBlock *Continue; // loopupdate
+  size_t Marks;         // Arena marks taken outside of the loop body
+};
+
+// Record type declared by struct: its fields are numbers. Arrays of records
+// store them one after the other (array of structs) or keep an array for
+// each field (struct of arrays, layout soa)
+struct Record {
+  std::string Name;
+  std::vector<std::string> Fields;
+  bool SoA;
+  unsigned Line, Col; // Position of the declaration
+};
+
+// Globals used by a function, recorded when it is defined: its callers
+// inspect them even after its AST has been freed (see driver::stream)
+struct FunctionUses {
+  std::set<std::string> Reads;   // Global variables and arrays read
+  std::set<std::string> Writes;  // Global variables and arrays assigned
+  std::set<std::string> Calls;   // Called functions
+};
+
 // Classe che organizza e gestisce il processo di compilazione
 class driver
 {
@@ -41,26 +103,134 @@ public:
             // che alloca uno spazio di memoria della dimensione necessaria per 
             // memorizzare un variabile del tipo di x (nel nostro caso solo double)
   RootAST* root;      // A fine parsing "punta" alla radice dell'AST
-  int parse (const std::string& f);
+  int parse (const std::string& f, unsigned line = 1, unsigned column = 1); // The text
+            // starts at line and column of f (a part of the file, see parallel.cpp)
+  int parse_string (const std::string& src, const std::string& name = "<stdin>",
+                    unsigned line = 1, unsigned column = 1); // Parses text typed in the
+            // REPL, sent to the compile server or split by -threads
   std::string file;
+  std::string input;  // Text to be parsed instead of file (see parse_string)
   bool trace_parsing; // Abilita le tracce di debug el parser
   void scan_begin (); // Implementata nello scanner
   void scan_end ();   // Implementata nello scanner
   bool trace_scanning;// Abilita le tracce di debug nello scanner
+  void *scanner;      // State of the scanner while parsing (it is reentrant)
   yy::location location; // Utillizata dallo scannar per localizzare i token
+  int optlevel;       // Optimization level (-O0, -O1, -O2, -O3)
+  bool builtins;      // Lowers well-known math externs to LLVM intrinsics
+  bool single;        // Numbers are floats instead of doubles (-fsingle)
+  Type *numberType() const; // Type of the numbers: double, or float with -fsingle
+  std::string veclib; // Vector math library used by the vectorizer (-fveclib=)
+  std::set<std::string> jitevents; // Tools notified of the code compiled by the JIT
+  std::string cpu;    // Target CPU (-march=, -mcpu=), generic if empty
+  std::string features; // Target features (-mattr=, e.g. +avx2,-avx512f)
+  std::set<std::string> multiversion; // Functions compiled for several ISA levels
+  bool wholeModule() const; // The module is printed at the end, not item by item
+  std::unique_ptr<TargetMachine> targetMachine(); // Machine the code is generated for
+  std::string rpass, rpassmissed, rpassanalysis; // Passes whose optimization remarks
+            // are printed (-Rpass=, -Rpass-missed=, -Rpass-analysis=)
+  bool saveremarks;   // Saves all the remarks in a YAML file (-fsave-optimization-record)
+  std::string remarksfile; // Name of that file, file.opt.yaml by default
+  std::string workdir; // Directory of relative file names, if not the current one
+  RemarkHandler *Remarks; // Installed in the context the first time a module is optimized
+  std::unique_ptr<ToolOutputFile> RemarksFile;
+  bool remarks() const; // Some remarks are requested
+  Value *ElementIndex; // Current element in whole-array expressions (see ElementLoop)
+  std::map<AllocaInst*, Value*> ArrayLengths; // Number of elements of the arrays
+            // allocated in the arena, whose variables only hold their address
+  std::map<AllocaInst*, Type*> RowTypes; // Rows of the multi-dimensional arrays that
+            // are reached through a pointer (allocated in the arena, captured by parfor)
+  std::vector<Value*> ArenaMarks; // Arena marks of the blocks being generated
+  std::vector<LoopTarget> Loops;  // Loops being generated, the innermost last
+  PrototypeAST *Pure; // Function being generated, if it is pure (or memo)
+  bool interactive;   // REPL mode: every top-level item has its own module
+  bool streaming;     // Top-level items are generated as soon as they are parsed (-stream)
+  StreamState *Stream; // Optimizer and metadata of -stream, created with the first item
+  void stream(RootAST *Item); // Generates, prints and frees a top-level item
+  bool lazy;          // Functions are compiled by the JIT when first called
+  bool interp;        // Functions are interpreted until they get hot (see bytecode.cpp)
+  std::map<std::string, PrototypeAST*> Prototypes; // Functions and globals defined
+  std::map<std::string, Type*> GlobalTypes;        // so far, declared again in each module
+  std::map<std::string, Record> Records; // Record types declared so far
+  std::map<std::string, std::string> RecordArrays; // Record of each global array of records
+  unsigned threads;   // Threads parsing and generating the items of a file (-threads=), 0 if serial
+  std::map<std::string, size_t> DeclaredBy; // With -threads, first top-level item declaring
+  size_t Item;        // each function and global, and item being generated
+  bool previous(const std::string &Name) const; // Name was declared by a previous item,
+            // in another module: it must be declared again in this one
+  int parallel(const std::string &f, const std::string *Text); // Compiles f with -threads
+            // (Text holds the program when sent to the compile server, see parallel.cpp)
+  std::set<std::string> exports; // Functions and globals exported by the file (export,
+            // -fexport=): if there are any, the others get internal linkage
+  bool pure;          // Some functions are pure or memo: their attributes are printed
+            // as attribute groups, at the end of the module
+  std::map<std::string, FunctionUses> Uses; // Globals used by the functions defined so
+            // far, inspected by the callers (see ParForStmtAST::codegen)
+  std::map<std::string, size_t> DefinedBy; // With -threads, item defining each function
+  const FunctionUses *uses(const std::string &Name) const; // Uses of Name, if it is
+            // defined by a previous item (or has already been generated, serially)
+  std::map<std::string, FunctionAST*> PureFunctions; // Pure functions defined so far,
+            // which calls with constant arguments are evaluated at compile time
+  unsigned long constexprsteps; // Budget of each evaluation (-fconstexpr-steps=), 0 disables it
+  std::shared_ptr<Interpreter> Folder; // Interpreter running those evaluations
+  bool fold(const std::string &Name, const std::vector<double> &Args, double &Result,
+            std::string &Why); // Evaluates a call at compile time (see bytecode.cpp)
+  std::set<std::string> entries; // Entry points of the program (--entry=): the other
+            // functions and globals are generated only if they are reachable from them
+  std::set<RootAST*> reachable(const std::vector<RootAST*> &Items) const; // The top-level
+            // items to generate: those reachable from the entry points (see the call graph)
   void codegen();
+  void finish();      // Completes the module and prints what is left of it
+  void optimize();    // Runs the optimization pipeline on the whole module
+  void emit(GlobalValue *GV); // Prints a top-level item as soon as it is generated
+  int repl();         // Read-eval-print loop on a JIT (see jit.cpp)
+  int run(const std::string& f); // Runs the program f on the JIT
+  bool debug;         // Emits DWARF debug info (-g)
+  DIBuilder *DBuilder; // Debug info of the current module, nullptr without -g
+  DICompileUnit *DebugUnit;
+  std::vector<DIScope*> DebugScopes; // Functions being generated
+  void debugBegin();  // Creates the compile unit of the current module
+  void debugEnd();    // Completes the debug info of the current module
+  void emitLocation(RootAST *Node); // Source position of the next instructions
 };
 
 typedef std::variant<std::string,double> lexval;
 const lexval NONE = 0.0;
 
+// Simboli a cui fa riferimento un sottoalbero dell'AST, raccolti da collectUses
+struct SymbolUses {
+  std::set<std::string> Reads;   // Variables read (and arrays used as a whole)
+  std::set<std::string> ArrayReads; // Arrays read element by element
+  std::set<std::string> Writes;  // Variables assigned
+  std::set<std::string> Bound;   // Variables and arrays declared in the subtree
+  std::set<std::string> Calls;   // Called functions
+  std::vector<std::pair<std::string,ExprAST*>> ArrayWrites; // Array element assignments
+  std::vector<std::pair<std::string,ExprAST*>> ArrayReadIndices; // Array element reads
+  std::vector<std::pair<std::string,ExprAST*>> Assignments; // Variable assignments (and values)
+  std::map<std::string, unsigned> ReadCounts; // Times each variable is read
+  std::set<std::string> HeapArrays; // Local arrays allocated in the arena
+};
+
+class BytecodeBuilder;
+
+// Inizio della regola ridotta per ultima dal parser (si veda YYLLOC_DEFAULT),
+// in the thread running it
+extern thread_local yy::position ParsePosition;
+
 // Classe base dell'intera gerarchia di classi che rappresentano
 // gli elementi del programma
 class RootAST {
 public:
+  // Source position of the node, recorded when the parser creates it
+  unsigned Line, Col;
+  RootAST(): Line(ParsePosition.line), Col(ParsePosition.column) {};
   virtual ~RootAST() {};
   virtual lexval getLexVal() const {return NONE;};
   virtual Value *codegen(driver& drv) { return nullptr; };
+  virtual void collectUses(SymbolUses& U) const {};
+  // Generates the bytecode of the interpreter (see bytecode.cpp) and returns
+  // the register holding the value, or -1 if the construct is not supported
+  virtual int bytecode(BytecodeBuilder& B) const { return -1; };
 };
 
 // Classe che rappresenta la sequenza di statement
@@ -71,7 +241,10 @@ private:
 
 public:
   SeqAST(RootAST* first, RootAST* continuation);
+  ~SeqAST();
   Value *codegen(driver& drv) override;
+  void flatten(std::vector<RootAST*>& Items) const; // Top-level items, in order
+  void collectUses(SymbolUses& U) const override;
 };
 
 /// ExprAST - Classe base per tutti i nodi espressione
@@ -86,6 +259,7 @@ public:
   NumberExprAST(double Val);
   lexval getLexVal() const override;
   Value *codegen(driver& drv) override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// VariableExprAST - Classe per la rappresentazione di riferimenti a variabili
@@ -97,6 +271,8 @@ public:
   VariableExprAST(const std::string &Name);
   lexval getLexVal() const override;
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// BinaryExprAST - Classe per la rappresentazione di operatori binari
@@ -108,7 +284,13 @@ private:
 
 public:
   BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS);
+  ~BinaryExprAST();
+  char getOp() const;
+  ExprAST *getLHS() const;
+  ExprAST *getRHS() const;
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// CallExprAST - Classe per la rappresentazione di chiamate di funzione
@@ -119,8 +301,26 @@ private:
 
 public:
   CallExprAST(std::string Callee, std::vector<ExprAST*> Args);
+  ~CallExprAST();
   lexval getLexVal() const override;
+  const std::vector<ExprAST*> &getArgs() const;
+  Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
+};
+
+/// BranchHintAST - Condizione annotata con likely(...) o unlikely(...)
+class BranchHintAST : public ExprAST {
+private:
+  ExprAST* Cond;
+  bool Likely;
+public:
+  BranchHintAST(ExprAST* Cond, bool Likely);
+  ~BranchHintAST();
+  bool isLikely() const;
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// IfExprAST
@@ -131,7 +331,10 @@ private:
   ExprAST* FalseExp;
 public:
   IfExprAST(ExprAST* Cond, ExprAST* TrueExp, ExprAST* FalseExp);
+  ~IfExprAST();
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// BlockExprAST
@@ -153,7 +356,10 @@ private:
   std::vector<RootAST*> Stmts;
 public:
   BlockAST(std::vector<VarBindingAST*> Def, std::vector<RootAST*> Stmts);
+  ~BlockAST();
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// VarBindingAST
@@ -164,8 +370,12 @@ protected:
   const std::string Name;
 public:
   VarBindingAST(const std::string Name, ExprAST* Val);
+  ~VarBindingAST();
   AllocaInst *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
   const std::string& getName() const;
+  virtual bool onHeap() const;
 };
 
 /// PrototypeAST - Classe per la rappresentazione dei prototipi di funzione
@@ -175,14 +385,25 @@ class PrototypeAST : public RootAST {
 private:
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<bool> ArrayArgs;  // Parameters declared as A[], passed by address
   bool emitcode;
+  bool pure;          // Declared pure or memo: no side effects, the result
+                      // depends only on the arguments
+  int memo;           // Entries of the cache of a memo function, 0 if none
+  bool memokeep;      // A full entry of the cache is kept instead of replaced
 
 public:
-  PrototypeAST(std::string Name, std::vector<std::string> Args);
+  PrototypeAST(std::string Name, std::vector<std::string> Args,
+               std::vector<bool> ArrayArgs = std::vector<bool>());
   const std::vector<std::string> &getArgs() const;
+  const std::vector<bool> &getArrayArgs() const;
   lexval getLexVal() const override;
   Function *codegen(driver& drv) override;
   void noemit();
+  void setPure(int Memo = 0, bool Keep = false);
+  bool isPure() const;
+  int memoSize() const;
+  bool memoKeep() const;
 };
 
 /// FunctionAST - Classe che rappresenta la definizione di una funzione
@@ -194,17 +415,39 @@ private:
   
 public:
   FunctionAST(PrototypeAST* Proto, ExprAST* Body);
+  ~FunctionAST();
   Function *codegen(driver& drv) override;
+  PrototypeAST *getProto() const;
+  bool checkPure() const; // Checks the body of a pure function (see CheckPure)
+  FunctionUses uses() const; // Globals used by the body and functions it calls
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// GlobalVarAST
 class GlobalVarAST : public RootAST {
 protected:
   const std::string Name;
+  ExprAST *Init;      // Initial value, evaluated at compile time (0 if there is none)
 public:
-  GlobalVarAST(const std::string Name);
+  GlobalVarAST(const std::string Name, ExprAST *Init = nullptr);
+  ~GlobalVarAST();
   GlobalVariable *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
   const std::string& getName() const;
+  virtual Type *getType(driver& drv) const; // Type of the variable in the current context
+};
+
+/// RecordAST - Dichiarazione di un tipo record (struct)
+class RecordAST : public RootAST {
+private:
+  std::string Name;
+  std::vector<std::string> Fields;
+  bool SoA;
+public:
+  RecordAST(const std::string Name, std::vector<std::string> Fields, bool SoA);
+  Value *codegen(driver& drv) override;
+  Record getRecord() const;
 };
 
 /// AssignmentAST
@@ -214,7 +457,10 @@ protected:
   ExprAST* Val;
 public:
   AssignmentAST(const std::string Name, ExprAST* Val);
+  ~AssignmentAST();
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
   const std::string& getName() const;
 };
 
@@ -226,7 +472,10 @@ private:
   RootAST* FalseStmt;
 public:
   IfStmtAST(ExprAST* Cond, RootAST* TrueStmt, RootAST* FalseStmt);
+  ~IfStmtAST();
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// ForInitAST
@@ -236,34 +485,62 @@ private:
   bool Binding;
 public:
   ForInitAST(RootAST* Init, bool Binding);
+  ~ForInitAST();
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
   const bool isBinding() const;
+  bool onHeap() const;
   const std::string& getName() const;
 };
 
 /// ForStmtAST
+// Also represents while loops, which have neither Init nor Update
 class ForStmtAST : public RootAST {
 private:
   ForInitAST* Init;
   ExprAST* Cond;
   RootAST* Update;
   RootAST* Body;
+  std::string Label;
 public:
   ForStmtAST(ForInitAST* Init, ExprAST* Cond, RootAST* Update, RootAST* Body);
+  ~ForStmtAST();
+  void setLabel(const std::string &L);
+  Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
+};
+
+/// BreakStmtAST - break e continue, eventualmente seguiti da un'etichetta
+class BreakStmtAST : public RootAST {
+private:
+  bool Continue;
+  std::string Label;   // Empty for the innermost loop
+public:
+  BreakStmtAST(bool Continue, const std::string Label);
   Value *codegen(driver& drv) override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// ArrayBindingAST
 class ArrayBindingAST : public VarBindingAST {
 private:
-  int Size;
+  std::vector<ExprAST*> Dims; // Extent of each dimension (only the first one may
+                              // be known only at runtime)
+  int Size;           // Number of elements, -1 if known only at runtime
   std::vector<ExprAST*> ExprList;
   // const std::string Name;
   // ExprAST* Val;
-  AllocaInst *CreateEntryBlockAlloca(Function *, StringRef);
+  AllocaInst *CreateEntryBlockAlloca(driver&, Function *, StringRef);
+  Type *rowType(driver& drv) const; // Type of the elements of the first dimension
 public:
-  ArrayBindingAST(const std::string Name, int Size, std::vector<ExprAST*> ExprList);
+  ArrayBindingAST(const std::string Name, std::vector<ExprAST*> Dims, std::vector<ExprAST*> ExprList);
+  ~ArrayBindingAST();
   AllocaInst *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
+  bool onHeap() const override;
   // const std::string& getName() const;
 };
 
@@ -271,28 +548,93 @@ public:
 class ArrayExprAST : public ExprAST {
 private:
   std::string Name;
-  ExprAST* Index;
+  std::vector<ExprAST*> Indices; // One for each dimension
 public:
-  ArrayExprAST(const std::string &Name, ExprAST* Index);
+  ArrayExprAST(const std::string &Name, std::vector<ExprAST*> Indices);
+  ~ArrayExprAST();
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// ArrayAssignmentAST
 class ArrayAssignmentAST : public AssignmentAST {
 private:
-  ExprAST* Index;
+  std::vector<ExprAST*> Indices; // One for each dimension
 public:
-  ArrayAssignmentAST(const std::string Name, ExprAST* Index, ExprAST* Val);
+  ArrayAssignmentAST(const std::string Name, std::vector<ExprAST*> Indices, ExprAST* Val);
+  ~ArrayAssignmentAST();
   Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+  int bytecode(BytecodeBuilder& B) const override;
 };
 
 /// GlobalArrayAST
 class GlobalArrayAST : public GlobalVarAST {
 private:
+  std::vector<int> Dims; // Extent of each dimension
+public:
+  GlobalArrayAST(const std::string Name, std::vector<int> Dims);
+  GlobalVariable *codegen(driver& drv) override;
+  Type *getType(driver& drv) const override;
+};
+
+/// GlobalRecordAST - Array globale di record
+class GlobalRecordAST : public GlobalVarAST {
+private:
+  std::string RecordName;
   int Size;
 public:
-  GlobalArrayAST(const std::string Name, int Size);
+  GlobalRecordAST(const std::string Name, const std::string RecordName, int Size);
   GlobalVariable *codegen(driver& drv) override;
+  Type *getType(driver& drv) const override; // nullptr if the record is not declared
+  const std::string& getRecordName() const;
+};
+
+/// FieldExprAST - Campo di un elemento di un array di record, P[i].x
+class FieldExprAST : public ExprAST {
+private:
+  std::string Name;
+  ExprAST* Index;
+  std::string Field;
+public:
+  FieldExprAST(const std::string &Name, ExprAST* Index, const std::string &Field);
+  ~FieldExprAST();
+  Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+};
+
+/// FieldAssignmentAST
+class FieldAssignmentAST : public AssignmentAST {
+private:
+  ExprAST* Index;
+  std::string Field;
+public:
+  FieldAssignmentAST(const std::string Name, ExprAST* Index, const std::string Field, ExprAST* Val);
+  ~FieldAssignmentAST();
+  Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
+};
+
+/// ParForStmtAST
+class ParForStmtAST : public RootAST {
+private:
+  std::string VarName;
+  ExprAST* Start;
+  std::string CondVar;
+  ExprAST* End;
+  std::string UpdateVar;
+  std::string RedOp;    // Reduction operator ("+", "*", "min", "max" or empty)
+  std::string RedVar;   // Reduction variable
+  RootAST* Body;
+  Function *outline(driver& drv, const std::vector<std::string>& Captured, StructType *EnvType);
+public:
+  ParForStmtAST(const std::string VarName, ExprAST* Start, const std::string CondVar,
+                ExprAST* End, const std::string UpdateVar, const std::string RedOp,
+                const std::string RedVar, RootAST* Body);
+  ~ParForStmtAST();
+  Value *codegen(driver& drv) override;
+  void collectUses(SymbolUses& U) const override;
 };
 
 #endif // ! DRIVER_HH
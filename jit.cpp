@@ -0,0 +1,486 @@
+#include <cinttypes>
+#include <iostream>
+#include <mutex>
+#include <unistd.h>
+#include "jit.hpp"
+#include "bytecode.hpp"
+#include "runtime/krt.h"
+
+extern thread_local LLVMContext *context;
+extern thread_local Module *module;
+extern thread_local IRBuilder<> *builder;
+Value *LogErrorV(const std::string Str);
+
+/******************************* JIT compiler ******************************/
+KaleidoscopeJIT::KaleidoscopeJIT(std::unique_ptr<LLJIT> J,
+                                 std::unique_ptr<IndirectStubsManager> Stubs):
+  J(std::move(J)), Stubs(std::move(Stubs)), Versions(0) {};
+
+// Prints the error (if any) and tells whether the operation succeeded
+bool KaleidoscopeJIT::check(Error Err) {
+  if (Err) {
+    logAllUnhandledErrors(std::move(Err), errs(), "JIT error: ");
+    return false;
+  }
+  return true;
+}
+
+/**************************** Profilers and debuggers ***********************/
+// Writes the address, size and name of each function compiled by the JIT
+// to /tmp/perf-<pid>.map, where perf looks up the symbols of the code it
+// cannot find in a file
+class PerfMapListener : public JITEventListener {
+private:
+  std::mutex Lock;
+  FILE *Map;
+public:
+  PerfMapListener() {
+    std::string Name = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+    Map = fopen(Name.c_str(), "w");
+    if (!Map)
+      LogErrorV("Cannot open " + Name);
+  }
+
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    if (!Map)
+      return;
+    // The object for debuggers has the addresses of the loaded sections
+    object::OwningBinary<object::ObjectFile> DebugObj = L.getObjectForDebug(Obj);
+    if (!DebugObj.getBinary())
+      return;
+    const object::ObjectFile *Loaded = DebugObj.getBinary();
+    std::lock_guard<std::mutex> Guard(Lock);
+    for (auto &P : object::computeSymbolSizes(*Loaded)) {
+      object::SymbolRef Sym = P.first;
+      Expected<object::SymbolRef::Type> Type = Sym.getType();
+      if (!Type) {
+        consumeError(Type.takeError());
+        continue;
+      }
+      if (*Type != object::SymbolRef::ST_Function)
+        continue;
+      Expected<StringRef> Name = Sym.getName();
+      Expected<uint64_t> Addr = Sym.getAddress();
+      if (!Name || !Addr) {
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      fprintf(Map, "%" PRIx64 " %" PRIx64 " %s\n", *Addr, P.second, Name->str().c_str());
+    }
+    fflush(Map);
+  }
+};
+
+// Listeners selected by -jit-events: perf gets both the perf map and the
+// jitdump file (when LLVM is built with perf support, see perf inject --jit);
+// gdb gets the objects through its JIT interface, with their debug info (-g)
+static std::vector<JITEventListener*> EventListeners(const driver& drv) {
+  std::vector<JITEventListener*> Listeners;
+  if (drv.jitevents.count("perf")) {
+    static PerfMapListener PerfMap;
+    Listeners.push_back(&PerfMap);
+    static std::unique_ptr<JITEventListener> JitDump(JITEventListener::createPerfJITEventListener());
+    if (JitDump)
+      Listeners.push_back(JitDump.get());
+  }
+  if (drv.jitevents.count("gdb"))
+    Listeners.push_back(JITEventListener::createGDBRegistrationListener());
+  return Listeners;
+}
+
+std::unique_ptr<KaleidoscopeJIT> KaleidoscopeJIT::Create(const driver& drv) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  LLJITBuilder Builder;
+  std::vector<JITEventListener*> Listeners = EventListeners(drv);
+  if (!Listeners.empty()) {
+    // Event listeners are notified by the RuntimeDyld linker
+    Builder.setObjectLinkingLayerCreator(
+        [Listeners](ExecutionSession &ES, const Triple &TT) -> Expected<std::unique_ptr<ObjectLayer>> {
+      auto Layer = std::make_unique<RTDyldObjectLinkingLayer>(ES, [] {
+        return std::make_unique<SectionMemoryManager>();
+      });
+      for (JITEventListener *L : Listeners)
+        Layer->registerJITEventListener(*L);
+      return std::unique_ptr<ObjectLayer>(std::move(Layer));
+    });
+  }
+  auto J = Builder.create();
+  if (!J) {
+    logAllUnhandledErrors(J.takeError(), errs(), "JIT error: ");
+    return nullptr;
+  }
+  auto StubsBuilder = createLocalIndirectStubsManagerBuilder((*J)->getTargetTriple());
+  if (!StubsBuilder) {
+    LogErrorV("JIT error: no stubs for target " + (*J)->getTargetTriple().str());
+    return nullptr;
+  }
+  std::unique_ptr<KaleidoscopeJIT> JIT(new KaleidoscopeJIT(std::move(*J), StubsBuilder()));
+
+  // The generated code can call the functions of the process (e.g. the
+  // C math library) and those of the runtime library, linked in kcomp
+  JITDylib &JD = JIT->J->getMainJITDylib();
+  char Prefix = JIT->J->getDataLayout().getGlobalPrefix();
+  JD.addGenerator(cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(Prefix)));
+  SymbolMap Runtime;
+  auto Define = [&](const char *Name, void *Addr) {
+    Runtime[JIT->J->mangleAndIntern(Name)] =
+        ExecutorSymbolDef(ExecutorAddr::fromPtr(Addr), JITSymbolFlags::Exported);
+  };
+  Define("krt_parfor", (void*)&krt_parfor);
+  Define("krt_arena_mark", (void*)&krt_arena_mark);
+  Define("krt_arena_release", (void*)&krt_arena_release);
+  Define("krt_arena_alloc", (void*)&krt_arena_alloc);
+  Define("krt_arena_allocf", (void*)&krt_arena_allocf);
+  Define("krt_sort", (void*)&krt_sort);
+  Define("krt_minval", (void*)&krt_minval);
+  Define("krt_maxval", (void*)&krt_maxval);
+  Define("krt_fill", (void*)&krt_fill);
+  Define("krt_copy", (void*)&krt_copy);
+  Define("krt_rand_fill", (void*)&krt_rand_fill);
+  Define("krt_sortf", (void*)&krt_sortf);
+  Define("krt_minvalf", (void*)&krt_minvalf);
+  Define("krt_maxvalf", (void*)&krt_maxvalf);
+  Define("krt_fillf", (void*)&krt_fillf);
+  Define("krt_copyf", (void*)&krt_copyf);
+  Define("krt_rand_fillf", (void*)&krt_rand_fillf);
+  if (!JIT->check(JD.define(absoluteSymbols(std::move(Runtime)))))
+    return nullptr;
+  return JIT;
+}
+
+const DataLayout &KaleidoscopeJIT::getDataLayout() const {
+  return J->getDataLayout();
+}
+
+// Compiles the module defining F. The code gets a new name at each
+// definition (f.1, f.2, ...) while the name of the function belongs to
+// its stub, which is created the first time and redirected afterwards
+bool KaleidoscopeJIT::addFunction(ThreadSafeModule TSM, Function *F) {
+  std::string Name = F->getName().str();
+  FunctionType *FT = F->getFunctionType();
+  auto Sig = Signatures.find(Name);
+  if (Sig != Signatures.end() && Sig->second != FT) {
+    LogErrorV("Function "+Name+" redefined with a different prototype");
+    return false;
+  }
+  std::string Impl = Name + "." + std::to_string(++Versions);
+  F->setName(Impl);
+
+  ResourceTrackerSP RT = J->getMainJITDylib().createResourceTracker();
+  if (!check(J->addIRModule(RT, std::move(TSM))))
+    return false;
+  auto Addr = J->lookup(Impl);
+  if (!Addr) {
+    check(Addr.takeError());
+    check(RT->remove());
+    return false;
+  }
+
+  if (Sig != Signatures.end())
+    return check(Stubs->updatePointer(Name, *Addr));
+  if (!check(Stubs->createStub(Name, *Addr, JITSymbolFlags::Exported)))
+    return false;
+  ExecutorSymbolDef Stub = Stubs->findStub(Name, true);
+  if (!check(J->getMainJITDylib().define(absoluteSymbols({{J->mangleAndIntern(Name), Stub}}))))
+    return false;
+  Signatures[Name] = FT;
+  return true;
+}
+
+// Reached when the code of a lazy function cannot be generated
+static void LazyCompileError() {
+  std::cerr << "Lazy compilation failed" << std::endl;
+  exit(1);
+}
+
+// Functions may be called for the first time by several threads at once
+// (e.g. in a parfor loop), but code generation uses global state. The
+// context, module and builder are thread-local: a worker thread of the
+// runtime library would get a context of its own, while the code must be
+// generated in the one shared with the JIT (the types of the globals and
+// of the records recorded by the driver belong to it)
+static std::mutex CodegenMutex;
+
+// Materialization unit of a lazy function: it defines the symbol of the
+// code of the function, which is generated from the AST when it is needed
+class FunctionMaterializationUnit : public MaterializationUnit {
+private:
+  driver& drv;
+  FunctionAST *Fn;
+  std::string Impl;   // Name of the code of the function
+  IRLayer &Layer;
+  ThreadSafeContext TSCtx;
+  DataLayout DL;
+public:
+  FunctionMaterializationUnit(driver& drv, FunctionAST *Fn, const std::string &Impl,
+                              SymbolStringPtr Sym, IRLayer &Layer,
+                              ThreadSafeContext TSCtx, const DataLayout &DL):
+    MaterializationUnit(Interface(SymbolFlagsMap({{Sym, JITSymbolFlags::Exported |
+                                                   JITSymbolFlags::Callable}}), nullptr)),
+    drv(drv), Fn(Fn), Impl(Impl), Layer(Layer), TSCtx(std::move(TSCtx)), DL(DL) {};
+
+  StringRef getName() const override {
+    return "FunctionMaterializationUnit";
+  }
+
+  void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+    std::lock_guard<std::mutex> Lock(CodegenMutex);
+    LLVMContext *SavedContext = context;
+    Module *SavedModule = module;
+    IRBuilder<> *SavedBuilder = builder;
+    Module *M;
+    bool Generated;
+    {
+      auto CtxLock = TSCtx.getLock();
+      context = TSCtx.getContext();
+      module = M = new Module("lazy", *context);
+      builder = new IRBuilder<>(*context);
+      module->setDataLayout(DL);
+      drv.debugBegin();
+      Function *F = Fn->codegen(drv);
+      drv.debugEnd();
+      if (F) {
+        if (drv.optlevel > 0) {
+          drv.optimize();
+          module->setDataLayout(DL);
+        }
+        F->setName(Impl);
+      } else
+        delete module;
+      delete builder;
+      Generated = F != nullptr;
+    }
+    context = SavedContext;
+    module = SavedModule;
+    builder = SavedBuilder;
+    if (!Generated) {
+      R->failMaterialization();
+      return;
+    }
+    Layer.emit(std::move(R), ThreadSafeModule(std::unique_ptr<Module>(M), TSCtx));
+  }
+
+  void discard(const JITDylib &JD, const SymbolStringPtr &Sym) override {}
+};
+
+// Defines a function whose code is generated and compiled when it is called
+// for the first time. The name of the function belongs to a stub (a lazy
+// reexport) that triggers the compilation of the code (f.impl)
+bool KaleidoscopeJIT::addLazyFunction(driver& drv, FunctionAST *Fn, ThreadSafeContext& TSCtx) {
+  if (!LazyCalls) {
+    auto LCTM = createLocalLazyCallThroughManager(J->getTargetTriple(), J->getExecutionSession(),
+                                                  ExecutorAddr::fromPtr(&LazyCompileError));
+    if (!LCTM) {
+      return check(LCTM.takeError());
+    }
+    LazyCalls = std::move(*LCTM);
+  }
+  std::string Name = std::get<std::string>(Fn->getProto()->getLexVal());
+  std::string Impl = Name + ".impl";
+  SymbolStringPtr ImplSym = J->mangleAndIntern(Impl);
+  JITDylib &JD = J->getMainJITDylib();
+  auto MU = std::make_unique<FunctionMaterializationUnit>(drv, Fn, Impl, ImplSym,
+      J->getIRTransformLayer(), TSCtx, J->getDataLayout());
+  if (!check(JD.define(std::move(MU))))
+    return false;
+  SymbolAliasMap Alias;
+  Alias[J->mangleAndIntern(Name)] =
+      SymbolAliasMapEntry(ImplSym, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+  return check(JD.define(lazyReexports(*LazyCalls, *Stubs, JD, std::move(Alias))));
+}
+
+// Adds a module with global variables or declarations, which gets
+// compiled when one of its symbols is used
+bool KaleidoscopeJIT::addModule(ThreadSafeModule TSM) {
+  return check(J->addIRModule(std::move(TSM)));
+}
+
+// Compiles the module, calls its function Name (with no arguments) and
+// throws the code away. With -fsingle the function returns a float
+bool KaleidoscopeJIT::evaluate(ThreadSafeModule TSM, const std::string &Name, double &Result) {
+  bool Single = TSM.withModuleDo([&](Module &M) {
+    return M.getFunction(Name)->getReturnType()->isFloatTy();
+  });
+  ResourceTrackerSP RT = J->getMainJITDylib().createResourceTracker();
+  if (!check(J->addIRModule(RT, std::move(TSM))))
+    return false;
+  auto Addr = J->lookup(Name);
+  if (!Addr) {
+    check(Addr.takeError());
+    check(RT->remove());
+    return false;
+  }
+  if (Single) {
+    float (*FP)() = Addr->toPtr<float (*)()>();
+    Result = FP();
+  } else {
+    double (*FP)() = Addr->toPtr<double (*)()>();
+    Result = FP();
+  }
+  return check(RT->remove());
+}
+
+// Address of the symbol Name (compiling it if needed), nullptr if it is
+// not defined
+void *KaleidoscopeJIT::lookup(const std::string &Name) {
+  auto Addr = J->lookup(Name);
+  if (!Addr) {
+    consumeError(Addr.takeError());
+    return nullptr;
+  }
+  return Addr->toPtr<void*>();
+}
+
+/*********************************** REPL **********************************/
+// Compiles a top-level item into a new module and runs it when it is an
+// expression (i.e. the body of the anonymous function __anon_expr)
+static void ReplItem(driver& drv, KaleidoscopeJIT& JIT, ThreadSafeContext& TSCtx, RootAST *Item) {
+  // Lazy functions are only recorded: their prototype is enough to call them
+  FunctionAST *Fn = dynamic_cast<FunctionAST*>(Item);
+  if (drv.lazy && Fn) {
+    std::string Name = std::get<std::string>(Fn->getProto()->getLexVal());
+    if (Name != "__anon_expr") {
+      if (drv.Prototypes.count(Name)) {
+        LogErrorV("Function "+Name+" already defined");
+      } else if (Fn->checkPure() && JIT.addLazyFunction(drv, Fn, TSCtx)) {
+        drv.Prototypes[Name] = Fn->getProto();
+        drv.Uses[Name] = Fn->uses();
+        // Pure functions are checked here, as their calls with constant
+        // arguments may run before the body is generated
+        if (Fn->getProto()->isPure())
+          drv.PureFunctions[Name] = Fn;
+      }
+      return;
+    }
+  }
+
+  module = new Module("repl", *context);
+  module->setDataLayout(JIT.getDataLayout());
+
+  // A definition that fails must not replace the previous one
+  std::map<std::string, PrototypeAST*> SavedPrototypes = drv.Prototypes;
+  std::map<std::string, Type*> SavedGlobals = drv.GlobalTypes;
+  drv.debugBegin();
+  Value *V = Item->codegen(drv);
+  drv.debugEnd();
+  if (!V) {
+    drv.Prototypes = SavedPrototypes;
+    drv.GlobalTypes = SavedGlobals;
+    delete module;
+    return;
+  }
+  if (drv.optlevel > 0) {
+    drv.optimize();
+    module->setDataLayout(JIT.getDataLayout());
+  }
+
+  ThreadSafeModule TSM(std::unique_ptr<Module>(module), TSCtx);
+  Function *F = dyn_cast<Function>(V);
+  bool Done;
+  if (F && F->getName() == "__anon_expr") {
+    drv.Prototypes.erase("__anon_expr");
+    double Result;
+    Done = JIT.evaluate(std::move(TSM), "__anon_expr", Result);
+    if (Done)
+      std::cout << Result << std::endl;
+  } else if (F && !F->isDeclaration()) {
+    Done = JIT.addFunction(std::move(TSM), F);
+  } else {
+    Done = JIT.addModule(std::move(TSM));
+  }
+  if (!Done) {
+    drv.Prototypes = SavedPrototypes;
+    drv.GlobalTypes = SavedGlobals;
+  }
+}
+
+// The modules compiled by the JIT share the global context
+static ThreadSafeContext &SharedContext() {
+  static ThreadSafeContext TSCtx(std::unique_ptr<LLVMContext>{context});
+  return TSCtx;
+}
+
+// Reads the program from stdin one top-level item at a time. An item is
+// complete when its braces are balanced and it ends with ';'.
+// Functions can be redefined, so they are never compiled lazily
+int driver::repl() {
+  std::unique_ptr<KaleidoscopeJIT> JIT = KaleidoscopeJIT::Create(*this);
+  if (!JIT)
+    return 1;
+  ThreadSafeContext &TSCtx = SharedContext();
+  interactive = true;
+  lazy = false;
+
+  std::string Text, Line;
+  int Depth = 0;
+  std::cerr << "ready> ";
+  while (std::getline(std::cin, Line)) {
+    Text += Line + "\n";
+    for (char c : Line) {
+      if (c == '{') Depth++;
+      if (c == '}') Depth--;
+    }
+    size_t Last = Text.find_last_not_of(" \t\n");
+    if (Last == std::string::npos) {
+      Text.clear();
+      std::cerr << "ready> ";
+      continue;
+    }
+    if (Depth > 0 || Text[Last] != ';') {
+      std::cerr << "...> ";
+      continue;
+    }
+    if (!parse_string(Text)) {
+      std::vector<RootAST*> Items;
+      static_cast<SeqAST*>(root)->flatten(Items);
+      for (auto Item : Items)
+        ReplItem(*this, *JIT, TSCtx, Item);
+    }
+    Text.clear();
+    Depth = 0;
+    std::cerr << "ready> ";
+  }
+  std::cerr << std::endl;
+  return 0;
+}
+
+// Compiles the program f with the JIT and evaluates its top-level
+// expressions in order, printing their values
+int driver::run(const std::string &f) {
+  std::unique_ptr<KaleidoscopeJIT> JIT = KaleidoscopeJIT::Create(*this);
+  if (!JIT)
+    return 1;
+  ThreadSafeContext &TSCtx = SharedContext();
+  interactive = true;
+  if (parse(f))
+    return 1;
+  std::vector<RootAST*> Items;
+  static_cast<SeqAST*>(root)->flatten(Items);
+  if (!interp) {
+    for (auto Item : Items)
+      ReplItem(*this, *JIT, TSCtx, Item);
+    return 0;
+  }
+
+  // Functions are registered both with the interpreter and (lazily) with the
+  // JIT, which compiles them only when they get promoted
+  Interpreter Interp(*this, *JIT);
+  for (auto Item : Items) {
+    FunctionAST *Fn = dynamic_cast<FunctionAST*>(Item);
+    std::string Name = Fn ? std::get<std::string>(Fn->getProto()->getLexVal()) : "";
+    double Result;
+    if (Name == "__anon_expr" && Interp.evaluate(Fn, Result)) {
+      std::cout << Result << std::endl;
+      continue;
+    }
+    ReplItem(*this, *JIT, TSCtx, Item);
+    if (Fn && Prototypes.count(Name) && Prototypes[Name] == Fn->getProto())
+      Interp.add(Fn);
+  }
+  return 0;
+}
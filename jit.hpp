@@ -0,0 +1,46 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+/******************************* JIT modules *******************************/
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Object/SymbolSize.h"
+
+#include "driver.hpp"
+
+using namespace llvm::orc;
+
+// JIT compiler used by the REPL, built on ORC's LLJIT. Every top-level item
+// is added as a module of its own, so the time needed to compile an item
+// does not depend on the items entered before it.
+// Functions are called through stubs (indirect jumps) that are redirected
+// when a function gets defined again: the code calling it keeps working
+// and does not need to be compiled again.
+// In lazy mode the code of a function is generated from its AST only when
+// the function gets called for the first time.
+// With -jit-events the compiled code is reported to profilers and debuggers
+class KaleidoscopeJIT {
+private:
+  std::unique_ptr<LLJIT> J;
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  std::map<std::string, FunctionType*> Signatures; // Functions with a stub
+  std::unique_ptr<LazyCallThroughManager> LazyCalls; // Stubs of lazy functions
+  unsigned Versions;  // Number of function definitions compiled so far
+  KaleidoscopeJIT(std::unique_ptr<LLJIT> J, std::unique_ptr<IndirectStubsManager> Stubs);
+  bool check(Error Err);
+public:
+  static std::unique_ptr<KaleidoscopeJIT> Create(const driver& drv);
+  const DataLayout &getDataLayout() const;
+  bool addFunction(ThreadSafeModule TSM, Function *F);
+  bool addModule(ThreadSafeModule TSM);
+  bool addLazyFunction(driver& drv, FunctionAST *Fn, ThreadSafeContext& TSCtx);
+  bool evaluate(ThreadSafeModule TSM, const std::string &Name, double &Result);
+  void *lookup(const std::string &Name);
+};
+
+#endif // ! JIT_HPP
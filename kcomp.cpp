@@ -1,24 +1,204 @@
 #include <iostream>
+#include <sstream>
+#include <thread>
 #include "driver.hpp"
+#include "server.hpp"
 
-extern LLVMContext *context;
-extern Module *module;
-extern IRBuilder<> *builder;
+extern thread_local LLVMContext *context;
+extern thread_local Module *module;
+extern thread_local IRBuilder<> *builder;
 
-int main (int argc, char *argv[]) {
+// -stream generates the IR of each top-level item while parsing: it cannot
+// be used with the options that need the whole module or run the program
+static bool streamable(driver &drv, bool jit) {
+  if (drv.streaming && (jit || drv.wholeModule() || drv.remarks() || !drv.entries.empty())) {
+    errStream() << "-stream cannot be used with -run, -repl, -g, -march, -mcpu, -mattr, "
+                   "-fmultiversion, -fexport, -threads, --entry and optimization remarks\n";
+    return false;
+  }
+  return true;
+}
+
+// Compiles (or runs) the files of the command line args, with the options
+// preceding them. Sources holds the text of the files when they have been
+// sent to the compile server, which must not read them itself
+int compile (const std::vector<std::string> &args, const std::map<std::string, std::string> *Sources,
+             const std::string &workdir) {
   int res = 0;
   driver drv;
-  int i = 1;
+  drv.workdir = workdir;
+  bool repl = false;
+  bool run = false;
+  int i = 0;
+  int argc = args.size();
   while (i<argc) {
-    if (argv[i] == std::string ("-p"))
+    std::string arg = args[i];
+    if (arg == "-p")
       drv.trace_parsing = true; // Abilita tracce debug nel parser
-    else if (argv[i] == std::string ("-s"))
+    else if (arg == "-s")
       drv.trace_scanning = true;// Abilita tracce debug nello scanner
-    else  if (!drv.parse(argv[i])) { // Parsing e creazione dell'AST
+    else if (arg == "-O0" || arg == "-O1" || arg == "-O2" || arg == "-O3")
+      drv.optlevel = arg[2] - '0';  // Ottimizzazione dell'intero modulo
+    else if (arg == "-repl")
+      repl = true;                  // Ciclo interattivo con compilazione JIT
+    else if (arg == "-run")
+      run = true;                   // Esecuzione dei programmi con il JIT
+    else if (arg == "-lazy")
+      drv.lazy = true;              // Funzioni compilate alla prima chiamata
+    else if (arg == "-interp")
+      drv.lazy = drv.interp = true; // Interprete, JIT solo per le funzioni calde
+    else if (arg == "-stream")
+      drv.streaming = true;         // Generazione di un elemento alla volta, durante il parsing
+    else if (arg.rfind("-threads=", 0) == 0) {
+      unsigned n = std::atoi(arg.c_str() + 9); // Thread per parsing e generazione, uno per core se 0
+      drv.threads = n ? n : std::max(1u, std::thread::hardware_concurrency());
+    }
+    else if (arg == "-g")
+      drv.debug = true;             // Informazioni di debug DWARF
+    else if (arg == "-fsingle")
+      drv.single = true;            // Numeri in singola precisione (float)
+    else if (arg.rfind("-fconstexpr-steps=", 0) == 0)
+      drv.constexprsteps = std::strtoul(arg.c_str() + 18, nullptr, 10); // Passi delle
+                                    // chiamate valutate in compilazione, 0 per non valutarle
+    else if (arg == "-fno-builtin")
+      drv.builtins = false;         // Le funzioni matematiche restano chiamate opache
+    else if (arg.rfind("-fveclib=", 0) == 0) {
+      drv.veclib = arg.substr(9);   // Libreria matematica vettoriale per il vectorizer
+      if (drv.veclib != "libmvec" && drv.veclib != "none") {
+        errStream() << "unsupported vector library: " << drv.veclib << "\n";
+        return 1;
+      }
+    }
+    else if (arg.rfind("-Rpass", 0) == 0 && arg.find('=') != std::string::npos) {
+      std::string Kind = arg.substr(0, arg.find('='));
+      std::string Pattern = arg.substr(arg.find('=') + 1);
+      std::string Error;
+      if (!Regex(Pattern).isValid(Error)) {
+        errStream() << "invalid regular expression in " << arg << ": " << Error << "\n";
+        return 1;
+      }
+      if (Kind == "-Rpass")
+        drv.rpass = Pattern;        // Ottimizzazioni effettuate
+      else if (Kind == "-Rpass-missed")
+        drv.rpassmissed = Pattern;  // Ottimizzazioni mancate
+      else if (Kind == "-Rpass-analysis")
+        drv.rpassanalysis = Pattern; // Motivazioni delle scelte dell'ottimizzatore
+      else {
+        errStream() << "unknown option: " << arg << "\n";
+        return 1;
+      }
+    }
+    else if (arg == "-fsave-optimization-record")
+      drv.saveremarks = true;       // Tutti i remark in file.opt.yaml
+    else if (arg.rfind("-foptimization-record-file=", 0) == 0) {
+      drv.saveremarks = true;
+      drv.remarksfile = arg.substr(27);
+    }
+    else if (arg.rfind("-march=", 0) == 0 || arg.rfind("-mcpu=", 0) == 0) {
+      drv.cpu = arg.substr(arg.find('=') + 1); // CPU per cui generare il codice
+      if (drv.cpu == "native") {
+        drv.cpu = sys::getHostCPUName().str();
+        StringMap<bool> HostFeatures;
+        std::string Features;
+        if (sys::getHostCPUFeatures(HostFeatures)) {
+          for (auto &Feature : HostFeatures)
+            Features += (Features.empty() ? "" : ",") + std::string(Feature.second ? "+" : "-") +
+                        Feature.first().str();
+        }
+        drv.features = Features + (drv.features.empty() ? "" : "," + drv.features);
+      }
+    }
+    else if (arg.rfind("-mattr=", 0) == 0) {
+      std::string Attrs = arg.substr(7); // Feature aggiunte (+) o tolte (-)
+      drv.features += (drv.features.empty() ? "" : ",") + Attrs;
+    }
+    else if (arg.rfind("-fmultiversion=", 0) == 0) {
+      std::stringstream Names(arg.substr(15)); // Funzioni compilate per più livelli ISA
+      std::string Name;
+      while (std::getline(Names, Name, ','))
+        drv.multiversion.insert(Name);
+    }
+    else if (arg.rfind("-fexport=", 0) == 0) {
+      std::stringstream Names(arg.substr(9)); // Funzioni e globali visibili fuori dal modulo
+      std::string Name;
+      while (std::getline(Names, Name, ','))
+        drv.exports.insert(Name);
+    }
+    else if (arg.rfind("--entry=", 0) == 0) {
+      std::stringstream Names(arg.substr(8)); // Punti di ingresso del programma
+      std::string Name;
+      while (std::getline(Names, Name, ','))
+        drv.entries.insert(Name);
+    }
+    else if (arg.rfind("-jit-events=", 0) == 0) {
+      std::stringstream Events(arg.substr(12)); // Profiler e debugger del codice JIT
+      std::string Event;
+      while (std::getline(Events, Event, ',')) {
+        if (Event != "perf" && Event != "gdb") {
+          errStream() << "unsupported JIT event listener: " << Event << "\n";
+          return 1;
+        }
+        drv.jitevents.insert(Event);
+      }
+    }
+    else if (!streamable(drv, run || repl))
+      return 1;
+    else if (drv.interp && drv.single) {
+      errStream() << "-interp cannot be used with -fsingle\n";
+      return 1;
+    }
+    else if (run)
+      res |= drv.run(arg);
+    else if (Sources) {
+      auto Source = Sources->find(arg);
+      if (Source == Sources->end()) {
+        errStream() << "cannot open " << arg << "\n";
+        res = 1;
+      } else if (drv.threads)
+        res |= drv.parallel(arg, &Source->second);
+      else if (!drv.parse_string(Source->second, arg)) {
+        drv.codegen();
+      } else
+        res = 1;
+    }
+    else if (drv.threads)
+      res |= drv.parallel(arg, nullptr); // Parsing e generazione degli elementi in parallelo
+    else  if (!drv.parse(arg)) {     // Parsing e creazione dell'AST
       drv.codegen();                 // Visita AST e generazione dell'IR (su stderr)
     } else
       res = 1;
     i++;
   };
+  if (repl && !streamable(drv, true))
+    return 1;
+  if (repl)
+    res = drv.repl();
   return res;
 }
+
+int main (int argc, char *argv[]) {
+  std::vector<std::string> args(argv + 1, argv + argc);
+  // --server and --client come first, possibly with --socket= and --jobs=
+  std::string socket = defaultSocket();
+  unsigned jobs = 0;
+  bool server = false, client = false;
+  while (!args.empty() && args[0].rfind("--", 0) == 0) {
+    if (args[0] == "--server")
+      server = true;               // Demone di compilazione
+    else if (args[0] == "--client")
+      client = true;               // Compilazione affidata al demone
+    else if (args[0].rfind("--socket=", 0) == 0)
+      socket = args[0].substr(9);  // Socket Unix del demone
+    else if (args[0].rfind("--jobs=", 0) == 0)
+      jobs = std::atoi(args[0].c_str() + 7); // Thread del demone
+    else
+      break;
+    args.erase(args.begin());
+  }
+  if (server)
+    return serve(socket, jobs);
+  int res;
+  if (client && request(socket, args, res))
+    return res;
+  return compile(args, nullptr, "");
+}
@@ -0,0 +1,264 @@
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "driver.hpp"
+
+extern thread_local LLVMContext *context;
+extern thread_local Module *module;
+extern thread_local IRBuilder<> *builder;
+Value *LogErrorV(const std::string Str);
+
+/*********************** Parallel compilation ************************/
+// With -threads=n a file is compiled by n threads, one top-level item at
+// a time:
+// 1. the text is split into items at the semicolons that are not inside
+//    parentheses, braces or brackets (serially, without scanning tokens);
+// 2. the threads parse the items;
+// 3. a serial pass records the first item declaring each function and
+//    global, and the record types: an item may use the declarations of the previous ones only,
+//    as when the file is compiled serially; with --entry, it also finds
+//    the items that are not reachable from the entry points;
+// 4. the threads generate each item into a module of its own, in the
+//    context of the thread, redeclaring what it uses of the previous items
+//    (see LookupFunction), and save the module as bitcode;
+// 5. the modules are read back into the context of the driver and linked
+//    in the order of the items, then the whole module is optimized (with
+//    -O) and printed.
+// Items, and so modules and diagnostics, do not depend on the number of
+// threads, nor on which thread handled them: neither does the output
+
+// A top-level item, with the diagnostics of its parsing and code generation,
+// printed in the order of the items, and its module
+struct TopLevelItem {
+  size_t Begin, End;     // Text of the item in the file
+  unsigned Line, Column; // Position of Begin
+  RootAST *Root;         // Sequence holding the item (nullptr on syntax errors)
+  bool Dead;             // Not reachable from the entry points (--entry=)
+  std::string Diagnostics;
+  std::string Bitcode;
+};
+
+static std::vector<TopLevelItem> SplitItems(const std::string &Text) {
+  std::vector<TopLevelItem> Items;
+  size_t Begin = 0;
+  unsigned Line = 1, Column = 1, BeginLine = 1, BeginColumn = 1;
+  int Depth = 0;
+  for (size_t i=0, e=Text.size(); i<e; i++) {
+    char c = Text[i];
+    if (c == '(' || c == '{' || c == '[')
+      Depth++;
+    else if ((c == ')' || c == '}' || c == ']') && Depth > 0)
+      Depth--;
+    if (c == '\n') {
+      Line++;
+      Column = 1;
+    } else
+      Column++;
+    if (c == ';' && Depth == 0) {
+      Items.push_back({Begin, i + 1, BeginLine, BeginColumn, nullptr, false, "", ""});
+      Begin = i + 1;
+      BeginLine = Line;
+      BeginColumn = Column;
+    }
+  }
+  // What follows the last semicolon is either blank or an incomplete item,
+  // which the parser will report
+  if (Text.find_first_not_of(" \t\n", Begin) != std::string::npos)
+    Items.push_back({Begin, Text.size(), BeginLine, BeginColumn, nullptr, false, "", ""});
+  return Items;
+}
+
+// Runs Work on Threads threads and waits for all of them
+static void RunThreads(unsigned Threads, const std::function<void()> &Work) {
+  std::vector<std::thread> Pool;
+  for (unsigned i=0; i<Threads; i++)
+    Pool.emplace_back(Work);
+  for (std::thread &T : Pool)
+    T.join();
+}
+
+// The options of drv that matter to parsing and code generation, for the
+// driver of a thread
+static void CopyOptions(driver &W, const driver &drv) {
+  W.file = drv.file;
+  W.trace_parsing = drv.trace_parsing;
+  W.trace_scanning = drv.trace_scanning;
+  W.optlevel = drv.optlevel;
+  W.builtins = drv.builtins;
+  W.single = drv.single;
+  W.cpu = drv.cpu;
+  W.features = drv.features;
+  W.debug = drv.debug;
+  W.rpass = drv.rpass;
+  W.rpassmissed = drv.rpassmissed;
+  W.rpassanalysis = drv.rpassanalysis;
+  W.saveremarks = drv.saveremarks;
+  W.threads = drv.threads;
+  W.constexprsteps = drv.constexprsteps;
+}
+
+int driver::parallel(const std::string &f, const std::string *Text) {
+  file = f;
+  std::unique_ptr<MemoryBuffer> Buffer;
+  if (!Text) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> File = MemoryBuffer::getFileOrSTDIN(f);
+    if (!File) {
+      errStream() << "cannot open " << f << ": " << File.getError().message() << "\n";
+      return 1;
+    }
+    Buffer = std::move(*File);
+  }
+  const std::string Source = Text ? *Text : Buffer->getBuffer().str();
+  std::vector<TopLevelItem> Items = SplitItems(Source);
+
+  // Parsing. As in the serial case, nothing is generated if there are
+  // syntax errors, and only the first one is reported
+  std::atomic<size_t> Next(0);
+  std::mutex ExportsMutex;
+  RunThreads(threads, [&] {
+    driver W;
+    CopyOptions(W, *this);
+    for (size_t i; (i = Next++) < Items.size();) {
+      TopLevelItem &I = Items[i];
+      raw_string_ostream Diagnostics(I.Diagnostics);
+      redirectOutput(&Diagnostics, &Diagnostics);
+      W.root = nullptr;
+      if (!W.parse_string(Source.substr(I.Begin, I.End - I.Begin), file, I.Line, I.Column))
+        I.Root = W.root;
+      redirectOutput(nullptr, nullptr);
+    }
+    std::lock_guard<std::mutex> Lock(ExportsMutex);
+    exports.insert(W.exports.begin(), W.exports.end());
+  });
+  for (TopLevelItem &I : Items) {
+    if (!I.Root) {
+      errStream() << I.Diagnostics;
+      return 1;
+    }
+  }
+
+  // Declarations of functions and globals
+  std::map<std::string, GlobalVarAST*> Globals;
+  std::vector<RootAST*> Tops;
+  std::vector<size_t> ItemOf; // Item of each of the Tops
+  std::map<std::string, size_t> PureBy; // Item defining each pure function
+  for (size_t i=0, e=Items.size(); i<e; i++) {
+    static_cast<SeqAST*>(Items[i].Root)->flatten(Tops);
+    ItemOf.resize(Tops.size(), i);
+  }
+  for (size_t t=0, e=Tops.size(); t<e; t++) {
+    if (RecordAST *Record = dynamic_cast<RecordAST*>(Tops[t])) {
+      Records.emplace(Record->getRecord().Name, Record->getRecord());
+      continue;
+    }
+    PrototypeAST *Proto = dynamic_cast<PrototypeAST*>(Tops[t]);
+    if (FunctionAST *Function = dynamic_cast<FunctionAST*>(Tops[t]))
+      Proto = Function->getProto();
+    std::string Name;
+    if (Proto) {
+      Name = std::get<std::string>(Proto->getLexVal());
+      Prototypes.emplace(Name, Proto);
+      // What the functions use is known to the items that follow them (see
+      // driver::uses), and the pure ones are evaluated at compile time
+      FunctionAST *Function = dynamic_cast<FunctionAST*>(Tops[t]);
+      if (Function && Uses.emplace(Name, Function->uses()).second)
+        DefinedBy.emplace(Name, ItemOf[t]);
+      if (Function && Proto->isPure() && PureFunctions.emplace(Name, Function).second)
+        PureBy.emplace(Name, ItemOf[t]);
+    } else if (GlobalVarAST *Global = dynamic_cast<GlobalVarAST*>(Tops[t])) {
+      Name = Global->getName();
+      Globals.emplace(Name, Global);
+    } else
+      continue;
+    DeclaredBy.emplace(Name, ItemOf[t]);
+  }
+  if (!entries.empty()) {
+    std::set<RootAST*> Live = reachable(Tops);
+    for (TopLevelItem &I : Items)
+      I.Dead = true;
+    for (size_t t=0, e=Tops.size(); t<e; t++) {
+      if (Live.count(Tops[t]))
+        Items[ItemOf[t]].Dead = false;
+    }
+  }
+
+  // Code generation, in the context of each thread
+  Next = 0;
+  RunThreads(threads, [&] {
+    driver W;
+    CopyOptions(W, *this);
+    W.Prototypes = Prototypes;
+    W.DeclaredBy = DeclaredBy;
+    W.Records = Records;
+    W.DefinedBy = DefinedBy;
+    W.Uses = Uses;
+    for (auto &Global : Globals) {
+      // Arrays of undeclared records are reported by their item
+      if (Type *Ty = Global.second->getType(W))
+        W.GlobalTypes[Global.first] = Ty;
+      if (GlobalRecordAST *Array = dynamic_cast<GlobalRecordAST*>(Global.second))
+        W.RecordArrays[Global.first] = Array->getRecordName();
+    }
+    for (size_t i; (i = Next++) < Items.size();) {
+      TopLevelItem &I = Items[i];
+      if (I.Dead)
+        continue;
+      raw_string_ostream Diagnostics(I.Diagnostics);
+      redirectOutput(&Diagnostics, &Diagnostics);
+      delete module;
+      module = new Module("Kaleidoscope", *context);
+      W.Item = i;
+      W.NamedValues.clear();
+      // Calls are evaluated at compile time only against the pure functions
+      // of the previous items (and of this one, once generated), as serially
+      for (auto &Pure : PureFunctions) {
+        if (PureBy[Pure.first] < i)
+          W.PureFunctions.insert(Pure);
+      }
+      W.debugBegin();
+      I.Root->codegen(W);
+      W.debugEnd();
+      raw_string_ostream Bitcode(I.Bitcode);
+      WriteBitcodeToFile(*module, Bitcode);
+      redirectOutput(nullptr, nullptr);
+    }
+    delete builder;
+    delete module;
+    delete context;
+    builder = nullptr;
+    module = nullptr;
+    context = nullptr;
+  });
+
+  // Linking, in the order of the items
+  Linker L(*module);
+  for (TopLevelItem &I : Items) {
+    if (I.Dead)
+      continue;
+    errStream() << I.Diagnostics;
+    Expected<std::unique_ptr<Module>> M =
+        parseBitcodeFile(MemoryBufferRef(I.Bitcode, file), *context);
+    if (!M) {
+      LogErrorV(toString(M.takeError()));
+      return 1;
+    }
+    // The linker brings in declarations only when they are used: the others
+    // (e.g. externs never called) are declared here, as when compiling serially
+    for (Function &F : **M) {
+      if (F.isDeclaration() && !module->getNamedValue(F.getName()))
+        Function::Create(F.getFunctionType(), F.getLinkage(), F.getName(), *module)
+            ->copyAttributesFrom(&F);
+    }
+    if (L.linkInModule(std::move(*M)))
+      return 1;
+    std::string().swap(I.Bitcode);
+  }
+  finish();
+  return 0;
+};
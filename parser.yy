@@ -1,5 +1,5 @@
 %skeleton "lalr1.cc" /* -*- C++ -*- */
-%require "3.2"
+%require "3.6"
 %defines
 
 %define api.token.constructor
@@ -31,10 +31,16 @@
   class ArrayExprAST;
   class ArrayAssignmentAST;
   class GlobalArrayAST;
+  class ParForStmtAST;
+  class BranchHintAST;
+  class BreakStmtAST;
+  class RecordAST;
 }
 
 // The parsing context.
 %param { driver& drv }
+// State of the reentrant scanner (see driver::scan_begin)
+%param { void *yyscanner }
 
 %locations
 
@@ -42,7 +48,23 @@
 %define parse.error verbose
 
 %code {
+#include <sstream>
 #include "driver.hpp"
+
+thread_local yy::position ParsePosition;
+
+// Default computation of the location of a rule, which also records where
+// it starts: the AST nodes created by the action take their position from it
+#define YYLLOC_DEFAULT(Current, Rhs, N)                                 \
+  do {                                                                  \
+    if (N) {                                                            \
+      (Current).begin = YYRHSLOC (Rhs, 1).begin;                        \
+      (Current).end = YYRHSLOC (Rhs, N).end;                            \
+    } else {                                                            \
+      (Current).begin = (Current).end = YYRHSLOC (Rhs, 0).end;          \
+    }                                                                   \
+    ParsePosition = (Current).begin;                                    \
+  } while (false)
 }
 
 %define api.token.prefix {TOK_}
@@ -50,6 +72,7 @@
   END  0  "end of file"
   SEMICOLON  ";"
   COMMA      ","
+  DOT        "."
   MINUS      "-"
   PLUS       "+"
   STAR       "*"
@@ -67,9 +90,16 @@
   DEF        "def"
   VAR        "var"
   GLOBAL     "global"
+  EXPORT     "export"
+  STRUCT     "struct"
+  PURE       "pure"
+  MEMO       "memo"
   IF         "if"
   ELSE       "else"
   FOR        "for"
+  WHILE      "while"
+  BREAK      "break"
+  CONTINUE   "continue"
   INCR       "++"
   DECR       "--"
   AND        "and"
@@ -77,6 +107,10 @@
   NOT        "not"
   LSQBRACKET "["
   RSQBRACKET "]"
+  PARFOR     "parfor"
+  REDUCE     "reduce"
+  LIKELY     "likely"
+  UNLIKELY   "unlikely"
 ;
 
 %token <std::string> IDENTIFIER "id"
@@ -88,23 +122,34 @@
 %type <ExprAST*> initexp
 %type <std::vector<ExprAST*>> optexp
 %type <std::vector<ExprAST*>> explist
+%type <std::vector<ExprAST*>> indices
+%type <std::vector<int>> extents
 %type <RootAST*> program
 %type <RootAST*> top
 %type <FunctionAST*> definition
+%type <std::pair<int,bool>> memo
 %type <PrototypeAST*> external
 %type <PrototypeAST*> proto
-%type <std::vector<std::string>> idseq
+%type <std::vector<std::pair<std::string,bool>>> idseq
 %type <std::vector<VarBindingAST*>> vardefs
 %type <VarBindingAST*> binding
 %type <std::vector<RootAST*>> stmts
 %type <RootAST*> stmt
 %type <BlockAST*> block
 %type <GlobalVarAST*> globalvar
+%type <RecordAST*> record
+%type <std::vector<std::string>> fields
 %type <AssignmentAST*> assignment
 %type <IfStmtAST*> ifstmt
 %type <ForStmtAST*> forstmt
+%type <ForStmtAST*> whilestmt
+%type <ForStmtAST*> loopstmt
 %type <ForInitAST*> init
 %type <BinaryExprAST*> relexp
+%type <ParForStmtAST*> parforstmt
+%type <std::string> parforupdate
+%type <std::pair<std::string,std::string>> reduction
+%type <std::string> redop
 %%
 
 %start startsymb;
@@ -114,33 +159,110 @@ startsymb:
 
 program:
   %empty                                 { $$ = new SeqAST(nullptr,nullptr); }
-|  top ";" program                       { $$ = new SeqAST($1,$3); };
+| program top ";"                        { if (drv.streaming) {
+                                             drv.stream($2);
+                                             $$ = $1;
+                                           } else
+                                             $$ = new SeqAST($1,$2); };
 
 top:
   %empty                                 { $$ = nullptr; }
 | definition                             { $$ = $1; }
+| "export" definition                    { if (drv.streaming) { error(@1, "export cannot be used with -stream"); YYERROR; }
+                                           drv.exports.insert(std::get<std::string>($2->getProto()->getLexVal()));
+                                           $$ = $2; }
 | external                               { $$ = $1; }
-| globalvar                              { $$ = $1; };
+| record                                 { $$ = $1; }
+| globalvar                              { $$ = $1; }
+| "export" globalvar                     { if (drv.streaming) { error(@1, "export cannot be used with -stream"); YYERROR; }
+                                           drv.exports.insert($2->getName());
+                                           $$ = $2; }
+| exp                                    { if (!drv.interactive) {
+                                             error(@1, "top-level expressions can only be used with -run and -repl");
+                                             YYERROR;
+                                           }
+                                           PrototypeAST *anon = new PrototypeAST("__anon_expr",{});
+                                           anon->noemit();
+                                           $$ = new FunctionAST(anon,$1); };
 
 definition:
   "def" proto block                      { $$ = new FunctionAST($2,$3); 
-                                           $2->noemit(); };
+                                           $2->noemit(); }
+| "pure" "def" proto block               { if (drv.streaming) { error(@1, "pure cannot be used with -stream"); YYERROR; }
+                                           drv.pure = true;
+                                           $3->setPure();
+                                           $$ = new FunctionAST($3,$4);
+                                           $3->noemit(); }
+| memo "def" proto block                 { if (drv.streaming) { error(@1, "memo cannot be used with -stream"); YYERROR; }
+                                           drv.pure = true;
+                                           $3->setPure($1.first,$1.second);
+                                           $$ = new FunctionAST($3,$4);
+                                           $3->noemit(); };
+
+memo:
+  "memo"                                 { $$ = std::make_pair(1024,false); }
+| "memo" "(" "number" ")"                { if (!($3 >= 1 && $3 <= 16777216)) {
+                                             error(@3, "memo cache size must be between 1 and 16777216");
+                                             YYERROR;
+                                           }
+                                           $$ = std::make_pair(int($3),false); }
+| "memo" "(" "number" "," "id" ")"       { if (!($3 >= 1 && $3 <= 16777216)) {
+                                             error(@3, "memo cache size must be between 1 and 16777216");
+                                             YYERROR;
+                                           }
+                                           if ($5 != "keep" && $5 != "replace") {
+                                             error(@5, "unknown eviction "+$5+", keep or replace expected");
+                                             YYERROR;
+                                           }
+                                           $$ = std::make_pair(int($3),$5 == "keep"); };
 
 external:
-  "extern" proto                         { $$ = $2; };
+  "extern" proto                         { $$ = $2; }
+| "pure" "extern" proto                  { if (drv.streaming) { error(@1, "pure cannot be used with -stream"); YYERROR; }
+                                           drv.pure = true;
+                                           $3->setPure();
+                                           $$ = $3; };
 
 proto:
-  "id" "(" idseq ")"                     { $$ = new PrototypeAST($1,$3); };
+  "id" "(" idseq ")"                     { std::vector<std::string> args;
+                                           std::vector<bool> arrays;
+                                           for (auto &arg : $3) {
+                                             args.push_back(arg.first);
+                                             arrays.push_back(arg.second);
+                                           }
+                                           $$ = new PrototypeAST($1,args,arrays); };
 
 globalvar:
   "global" "id"                          { $$ = new GlobalVarAST($2); }
-| "global" "id" "[" "number" "]"           { $$ = new GlobalArrayAST($2,$4); };
+| "global" "id" "=" exp                  { $$ = new GlobalVarAST($2,$4); }
+| "global" "id" extents                  { $$ = new GlobalArrayAST($2,$3); }
+| "global" "id" "id" "[" "number" "]"    { $$ = new GlobalRecordAST($3,$2,$5); };
+
+record:
+  "struct" "id" "{" fields "}"           { $$ = new RecordAST($2,$4,false); }
+| "struct" "id" "id" "{" fields "}"      { if ($3 != "aos" && $3 != "soa") {
+                                             error(@3, "unknown layout "+$3+", aos or soa expected");
+                                             YYERROR;
+                                           }
+                                           $$ = new RecordAST($2,$5,$3 == "soa"); };
+
+fields:
+  "id"                                   { $$ = std::vector<std::string>(1,$1); }
+| fields "," "id"                        { $1.push_back($3);
+                                           $$ = $1; };
+
+extents:
+  "[" "number" "]"                       { $$ = std::vector<int>(1,$2); }
+| extents "[" "number" "]"               { $1.push_back($3);
+                                           $$ = $1; };
 
 idseq:
-  %empty                                 { std::vector<std::string> args;
+  %empty                                 { std::vector<std::pair<std::string,bool>> args;
                                            $$ = args; }
-| "id" idseq                             { $2.insert($2.begin(),$1);
-                                           $$ = $2; };
+| "id" idseq                             { $2.insert($2.begin(),std::make_pair($1,false));
+                                           $$ = $2; }
+| "id" "[" "]" idseq                     { $4.insert($4.begin(),std::make_pair($1,true));
+                                           $$ = $4; };
 
 %left ":" "?";
 %left "or";
@@ -161,16 +283,47 @@ stmt:
   assignment                             { $$ = $1; }
 | block                                  { $$ = $1; }
 | ifstmt                                 { $$ = $1; }
-| forstmt                                { $$ = $1; }
+| loopstmt                               { $$ = $1; }
+| "id" ":" loopstmt                      { $3->setLabel($1);
+                                           $$ = $3; }
+| parforstmt                             { $$ = $1; }
+| "break"                                { $$ = new BreakStmtAST(false,""); }
+| "break" "id"                           { $$ = new BreakStmtAST(false,$2); }
+| "continue"                             { $$ = new BreakStmtAST(true,""); }
+| "continue" "id"                        { $$ = new BreakStmtAST(true,$2); }
 | exp                                    { $$ = $1; };
 
 ifstmt:
   "if" "(" condexp ")" stmt              { $$ = new IfStmtAST($3,$5,nullptr); }
 | "if" "(" condexp ")" stmt "else" stmt  { $$ = new IfStmtAST($3,$5,$7); };
 
+loopstmt:
+  forstmt                                { $$ = $1; }
+| whilestmt                              { $$ = $1; };
+
 forstmt:
   "for" "(" init ";" condexp ";" assignment ")" stmt  { $$ = new ForStmtAST($3,$5,$7,$9); };
 
+whilestmt:
+  "while" "(" condexp ")" stmt           { $$ = new ForStmtAST(nullptr,$3,nullptr,$5); };
+
+parforstmt:
+  "parfor" "(" "var" "id" "=" exp ";" "id" "<" exp ";" parforupdate ")" reduction stmt
+                                         { $$ = new ParForStmtAST($4,$6,$8,$10,$12,$14.first,$14.second,$15); };
+
+parforupdate:
+  "++" "id"                              { $$ = $2; }
+| "id" "++"                              { $$ = $1; };
+
+reduction:
+  %empty                                 { $$ = std::make_pair(std::string(),std::string()); }
+| "reduce" "(" redop ":" "id" ")"        { $$ = std::make_pair($3,$5); };
+
+redop:
+  "+"                                    { $$ = "+"; }
+| "*"                                    { $$ = "*"; }
+| "id"                                   { $$ = $1; };
+
 init:
   binding                                { $$ = new ForInitAST($1,true); }
 | assignment                             { $$ = new ForInitAST($1,false); };
@@ -181,7 +334,12 @@ assignment:
 | "--" "id"                              { $$ = new AssignmentAST($2,new BinaryExprAST('-',new VariableExprAST($2),new NumberExprAST(1))); }
 | "id" "++"                              { $$ = new AssignmentAST($1,new BinaryExprAST('+',new VariableExprAST($1),new NumberExprAST(1))); }
 | "id" "--"                              { $$ = new AssignmentAST($1,new BinaryExprAST('-',new VariableExprAST($1),new NumberExprAST(1))); }
-| "id" "[" exp "]" "=" exp               { $$ = new ArrayAssignmentAST($1,$3,$6); };
+| "id" indices "=" exp                   { $$ = new ArrayAssignmentAST($1,$2,$4); }
+| "id" indices "." "id" "=" exp          { if ($2.size() != 1) {
+                                             error(@2, "arrays of records have one dimension");
+                                             YYERROR;
+                                           }
+                                           $$ = new FieldAssignmentAST($1,$2[0],$4,$6); };
 
 block:
   "{" stmts "}"                          { std::vector<VarBindingAST*> empty;
@@ -197,9 +355,9 @@ vardefs:
 
 binding:
   "var" "id" initexp                     { $$ = new VarBindingAST($2,$3); }
-| "var" "id" "[" "number" "]"            { std::vector<ExprAST*> empty;
-                                           $$ = new ArrayBindingAST($2,$4,empty); }
-| "var" "id" "[" "number" "]" "=" "{" explist "}"  { $$ = new ArrayBindingAST($2,$4,$8); };
+| "var" "id" indices                     { std::vector<ExprAST*> empty;
+                                           $$ = new ArrayBindingAST($2,$3,empty); }
+| "var" "id" indices "=" "{" explist "}" { $$ = new ArrayBindingAST($2,$3,$6); };
 
 exp:
   exp "+" exp                            { $$ = new BinaryExprAST('+',$1,$3); }
@@ -224,6 +382,8 @@ condexp:
 | relexp "and" condexp                   { $$ = new BinaryExprAST('&',$1,$3); }
 | relexp "or" condexp                    { $$ = new BinaryExprAST('|',$1,$3); }
 | "not" condexp                          { $$ = new BinaryExprAST('!',$2,nullptr); }
+| "likely" "(" condexp ")"               { $$ = new BranchHintAST($3,true); }
+| "unlikely" "(" condexp ")"             { $$ = new BranchHintAST($3,false); }
 | "(" condexp ")"                        { $$ = $2; };
 
 relexp:
@@ -233,7 +393,17 @@ relexp:
 idexp:
   "id"                                   { $$ = new VariableExprAST($1); }
 | "id" "(" optexp ")"                    { $$ = new CallExprAST($1,$3); }
-| "id" "[" exp "]"                       { $$ = new ArrayExprAST($1,$3); };
+| "id" indices                           { $$ = new ArrayExprAST($1,$2); }
+| "id" indices "." "id"                  { if ($2.size() != 1) {
+                                             error(@2, "arrays of records have one dimension");
+                                             YYERROR;
+                                           }
+                                           $$ = new FieldExprAST($1,$2[0],$4); };
+
+indices:
+  "[" exp "]"                            { $$ = std::vector<ExprAST*>(1,$2); }
+| indices "[" exp "]"                    { $1.push_back($3);
+                                           $$ = $1; };
 
 optexp:
   %empty                                 { std::vector<ExprAST*> args;
@@ -252,5 +422,7 @@ explist:
 void
 yy::parser::error (const location_type& l, const std::string& m)
 {
-  std::cerr << l << ": " << m << '\n';
+  std::ostringstream Where;
+  Where << l;
+  errStream() << Where.str() << ": " << m << '\n';
 }
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "krt.h"
+
+// Per-thread stack of memory chunks. Positions in the arena are measured
+// as the number of bytes preceding them: the chunks are contiguous in this
+// numbering, even though they are not in memory. A position is then a
+// mark, and releasing it only moves the top of the arena back, keeping the
+// chunks for the following allocations
+
+namespace {
+
+const size_t ChunkSize = 1 << 20;
+const size_t Alignment = 64;
+
+struct Chunk {
+  char *mem;
+  size_t size;
+  size_t base;   // Position of the first byte of the chunk
+};
+
+class Arena {
+private:
+  std::vector<Chunk> chunks;
+  size_t current = 0;   // Chunk containing the top of the arena
+  size_t offset = 0;    // Top of the arena inside the current chunk
+
+  // Makes chunk i (the one after the current) at least size bytes large.
+  // The chunks after it are not in use and are discarded
+  void prepare(size_t i, size_t size) {
+    size_t base = i ? chunks[i-1].base + chunks[i-1].size : 0;
+    if (i < chunks.size() && chunks[i].size >= size) {
+      return;
+    }
+    while (chunks.size() > i) {
+      std::free(chunks.back().mem);
+      chunks.pop_back();
+    }
+    size = std::max(ChunkSize, (size + Alignment - 1) / Alignment * Alignment);
+    char *mem = static_cast<char*>(std::aligned_alloc(Alignment, size));
+    if (!mem) {
+      std::abort();
+    }
+    chunks.push_back(Chunk{mem, size, base});
+  }
+
+public:
+  ~Arena() {
+    for (auto &c : chunks) {
+      std::free(c.mem);
+    }
+  }
+
+  int64_t mark() const {
+    return chunks.empty() ? 0 : chunks[current].base + offset;
+  }
+
+  void release(int64_t m) {
+    while (current > 0 && chunks[current].base > size_t(m)) {
+      --current;
+    }
+    offset = chunks.empty() ? 0 : m - chunks[current].base;
+  }
+
+  void *alloc(size_t size) {
+    if (chunks.empty()) {
+      prepare(0, size);
+    }
+    size_t start = (offset + Alignment - 1) / Alignment * Alignment;
+    if (start + size > chunks[current].size) {
+      prepare(current + 1, size);
+      ++current;
+      start = 0;
+    }
+    offset = start + size;
+    return chunks[current].mem + start;
+  }
+};
+
+thread_local Arena arena;
+
+} // namespace
+
+extern "C" int64_t krt_arena_mark() {
+  return arena.mark();
+}
+
+extern "C" void krt_arena_release(int64_t mark) {
+  arena.release(mark);
+}
+
+extern "C" double *krt_arena_alloc(int64_t n) {
+  return static_cast<double*>(arena.alloc(std::max<int64_t>(n, 1) * sizeof(double)));
+}
+
+extern "C" float *krt_arena_allocf(int64_t n) {
+  return static_cast<float*>(arena.alloc(std::max<int64_t>(n, 1) * sizeof(float)));
+}
@@ -0,0 +1,22 @@
+#include "krt.h"
+
+// Level of the x86-64 psABI supported by the CPU, checked feature by
+// feature. Called by the ifunc resolvers of multiversioned functions,
+// which run while the program is being loaded
+int krt_cpu_level() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  bool v2 = __builtin_cpu_supports("sse3") && __builtin_cpu_supports("ssse3") &&
+            __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("sse4.2") &&
+            __builtin_cpu_supports("popcnt");
+  bool v3 = v2 && __builtin_cpu_supports("avx") && __builtin_cpu_supports("avx2") &&
+            __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2") &&
+            __builtin_cpu_supports("fma");
+  bool v4 = v3 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512cd") && __builtin_cpu_supports("avx512dq") &&
+            __builtin_cpu_supports("avx512vl");
+  return v4 ? 4 : v3 ? 3 : v2 ? 2 : 1;
+#else
+  return 1;
+#endif
+}
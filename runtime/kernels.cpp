@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "krt.h"
+
+// Array kernels called by the builtins sort, minval, maxval, fill, copy and
+// rand_fill. The loops are written so that the compiler vectorizes them
+// (independent accumulators for the reductions, no dependences between
+// elements), and they are compiled for several ISA levels: the version for
+// the CPU running the program is chosen when the program is loaded.
+// Each kernel is a template instantiated for double and, with the suffix f,
+// for float (the programs compiled with -fsingle)
+
+#if defined(__x86_64__) && defined(__ELF__)
+#define KRT_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define KRT_CLONES
+#endif
+
+// The templates are inlined in each version of the kernels, so that they
+// are compiled for its ISA level
+#define KRT_INLINE inline __attribute__((always_inline))
+
+namespace {
+
+// Accumulators of the reductions, enough to fill an AVX-512 register
+const int Lanes = 8;
+
+// Unsigned integer as large as an element
+template <typename T> struct Bits;
+template <> struct Bits<double> { typedef uint64_t Type; };
+template <> struct Bits<float> { typedef uint32_t Type; };
+
+// Maps a number to an unsigned integer with the same order: the sign bit
+// of positive numbers is set, all the bits of negative ones are flipped
+template <typename T> inline typename Bits<T>::Type sortKey(T x) {
+  typedef typename Bits<T>::Type U;
+  const int Sign = sizeof(U) * 8 - 1;
+  U u;
+  std::memcpy(&u, &x, sizeof(u));
+  return (u >> Sign) ? ~u : u | (U(1) << Sign);
+}
+
+template <typename T> inline T sortValue(typename Bits<T>::Type k) {
+  typedef typename Bits<T>::Type U;
+  const int Sign = sizeof(U) * 8 - 1;
+  U u = (k >> Sign) ? k & ~(U(1) << Sign) : ~k;
+  T x;
+  std::memcpy(&x, &u, sizeof(x));
+  return x;
+}
+
+// splitmix64: the i-th number of the sequence depends only on seed and i,
+// so the elements can be generated in any order (and in parallel)
+inline uint64_t mix(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+// LSD radix sort on the keys of the elements, 11 bits per pass. Passes on
+// digits that are the same for all the elements are skipped. Short arrays
+// are sorted by comparison
+template <typename T> void sort(T *a, int64_t n) {
+  typedef typename Bits<T>::Type U;
+  const int Bits = 11, Passes = (sizeof(U) * 8 + Bits - 1) / Bits, Buckets = 1 << Bits;
+  if (n < 256) {
+    std::sort(a, a + n, [](T x, T y) { return sortKey(x) < sortKey(y); });
+    return;
+  }
+  std::vector<U> keys(n), tmp(n);
+  std::vector<int64_t> count(Passes * Buckets, 0);
+  for (int64_t i = 0; i < n; i++) {
+    keys[i] = sortKey(a[i]);
+    for (int p = 0; p < Passes; p++)
+      count[p * Buckets + ((keys[i] >> (p * Bits)) & (Buckets - 1))]++;
+  }
+  for (int p = 0; p < Passes; p++) {
+    int64_t *c = &count[p * Buckets];
+    if (*std::max_element(c, c + Buckets) == n)
+      continue;
+    int64_t pos = 0;
+    for (int b = 0; b < Buckets; b++) {
+      int64_t k = c[b];
+      c[b] = pos;
+      pos += k;
+    }
+    for (int64_t i = 0; i < n; i++)
+      tmp[c[(keys[i] >> (p * Bits)) & (Buckets - 1)]++] = keys[i];
+    keys.swap(tmp);
+  }
+  for (int64_t i = 0; i < n; i++)
+    a[i] = sortValue<T>(keys[i]);
+}
+
+// Smallest element, +inf for an empty array. NaNs are ignored
+template <typename T> KRT_INLINE T minval(const T *a, int64_t n) {
+  T acc[Lanes];
+  std::fill(acc, acc + Lanes, std::numeric_limits<T>::infinity());
+  int64_t i = 0;
+  for (; i + Lanes <= n; i += Lanes)
+    for (int j = 0; j < Lanes; j++)
+      acc[j] = a[i+j] < acc[j] ? a[i+j] : acc[j];
+  for (; i < n; i++)
+    acc[0] = a[i] < acc[0] ? a[i] : acc[0];
+  return *std::min_element(acc, acc + Lanes);
+}
+
+// Largest element, -inf for an empty array. NaNs are ignored
+template <typename T> KRT_INLINE T maxval(const T *a, int64_t n) {
+  T acc[Lanes];
+  std::fill(acc, acc + Lanes, -std::numeric_limits<T>::infinity());
+  int64_t i = 0;
+  for (; i + Lanes <= n; i += Lanes)
+    for (int j = 0; j < Lanes; j++)
+      acc[j] = a[i+j] > acc[j] ? a[i+j] : acc[j];
+  for (; i < n; i++)
+    acc[0] = a[i] > acc[0] ? a[i] : acc[0];
+  return *std::max_element(acc, acc + Lanes);
+}
+
+template <typename T> KRT_INLINE void fill(T *a, int64_t n, T v) {
+  for (int64_t i = 0; i < n; i++)
+    a[i] = v;
+}
+
+// Uniform numbers in [0, 1): the high bits of each number of the sequence
+// of seed are the mantissa (53 bits for double, 24 for float)
+template <typename T> KRT_INLINE void rand_fill(T *a, int64_t n, T seed) {
+  const int Digits = std::numeric_limits<T>::digits;
+  const T Scale = T(1) / T(uint64_t(1) << Digits);
+  double wide = seed;
+  uint64_t s;
+  std::memcpy(&s, &wide, sizeof(s));
+  s = mix(s);
+  for (int64_t i = 0; i < n; i++)
+    a[i] = T(mix(s + uint64_t(i + 1) * 0x9e3779b97f4a7c15ULL) >> (64 - Digits)) * Scale;
+}
+
+} // namespace
+
+extern "C" void krt_sort(double *a, int64_t n) {
+  sort(a, n);
+}
+
+extern "C" KRT_CLONES double krt_minval(const double *a, int64_t n) {
+  return minval(a, n);
+}
+
+extern "C" KRT_CLONES double krt_maxval(const double *a, int64_t n) {
+  return maxval(a, n);
+}
+
+extern "C" KRT_CLONES void krt_fill(double *a, int64_t n, double v) {
+  fill(a, n, v);
+}
+
+// The arrays may overlap
+extern "C" void krt_copy(const double *src, double *dst, int64_t n) {
+  std::memmove(dst, src, n * sizeof(double));
+}
+
+extern "C" KRT_CLONES void krt_rand_fill(double *a, int64_t n, double seed) {
+  rand_fill(a, n, seed);
+}
+
+extern "C" void krt_sortf(float *a, int64_t n) {
+  sort(a, n);
+}
+
+extern "C" KRT_CLONES float krt_minvalf(const float *a, int64_t n) {
+  return minval(a, n);
+}
+
+extern "C" KRT_CLONES float krt_maxvalf(const float *a, int64_t n) {
+  return maxval(a, n);
+}
+
+extern "C" KRT_CLONES void krt_fillf(float *a, int64_t n, float v) {
+  fill(a, n, v);
+}
+
+extern "C" void krt_copyf(const float *src, float *dst, int64_t n) {
+  std::memmove(dst, src, n * sizeof(float));
+}
+
+extern "C" KRT_CLONES void krt_rand_fillf(float *a, int64_t n, float seed) {
+  rand_fill(a, n, seed);
+}
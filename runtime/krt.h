@@ -0,0 +1,58 @@
+#ifndef KRT_H
+#define KRT_H
+#include <cstdint>
+
+// Runtime library of the Kaleidoscope compiler (libkrt.a). The functions
+// declared here are called by the code that kcomp generates
+
+// Reduction operators of parfor loops
+enum KrtReduction {
+  KRT_RED_NONE,
+  KRT_RED_ADD,
+  KRT_RED_MUL,
+  KRT_RED_MIN,
+  KRT_RED_MAX
+};
+
+extern "C" {
+  // Outlined body of a parfor loop: runs the iterations lo, lo+1, ... that
+  // are smaller than hi and returns their partial reduction
+  typedef double (*krt_parfor_body)(double lo, double hi, void *env);
+
+  // Runs the iterations start, start+1, ... that are smaller than end on
+  // the thread pool and returns the combination (op) of the partial results
+  double krt_parfor(krt_parfor_body body, void *env, double start, double end, int op);
+
+  // Arena of the calling thread, used for local arrays whose size is known
+  // only at runtime (or too large for the stack). Memory is released in
+  // LIFO order: krt_arena_release(m) frees everything allocated after the
+  // call to krt_arena_mark that returned m
+  int64_t krt_arena_mark();
+  void krt_arena_release(int64_t mark);
+  // Allocates n doubles (n floats for krt_arena_allocf), aligned to 64 bytes
+  double *krt_arena_alloc(int64_t n);
+  float *krt_arena_allocf(int64_t n);
+
+  // Array kernels of the builtins sort, minval, maxval, fill, copy and
+  // rand_fill (see kernels.cpp); n is the number of elements. The kernels
+  // with the suffix f work on floats, for the programs compiled with -fsingle
+  void krt_sort(double *a, int64_t n);
+  double krt_minval(const double *a, int64_t n);
+  double krt_maxval(const double *a, int64_t n);
+  void krt_fill(double *a, int64_t n, double v);
+  void krt_copy(const double *src, double *dst, int64_t n);
+  void krt_rand_fill(double *a, int64_t n, double seed);
+  void krt_sortf(float *a, int64_t n);
+  float krt_minvalf(const float *a, int64_t n);
+  float krt_maxvalf(const float *a, int64_t n);
+  void krt_fillf(float *a, int64_t n, float v);
+  void krt_copyf(const float *src, float *dst, int64_t n);
+  void krt_rand_fillf(float *a, int64_t n, float seed);
+
+  // Level of the x86-64 psABI supported by the CPU (1 for the baseline,
+  // then 2, 3 and 4 for x86-64-v2, -v3 and -v4), used to choose among the
+  // versions of a multiversioned function
+  int krt_cpu_level();
+}
+
+#endif // ! KRT_H
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "krt.h"
+
+// Work-stealing thread pool used by parfor loops. The iteration space of a
+// loop is split into chunks, which are dealt out to the per-thread queues.
+// Each thread runs the chunks of its own queue (from the back) and, once
+// it is empty, steals chunks from the front of the other queues.
+// The thread calling krt_parfor takes part in the loop as worker 0
+
+namespace {
+
+// Iterations [lo,hi) of a loop
+struct Chunk {
+  double lo;
+  double hi;
+};
+
+class ChunkQueue {
+private:
+  std::mutex m;
+  std::deque<Chunk> chunks;
+public:
+  void push(Chunk c) {
+    std::lock_guard<std::mutex> lock(m);
+    chunks.push_back(c);
+  }
+  // Used by the owner of the queue
+  bool pop(Chunk &c) {
+    std::lock_guard<std::mutex> lock(m);
+    if (chunks.empty()) return false;
+    c = chunks.back();
+    chunks.pop_back();
+    return true;
+  }
+  // Used by the other threads
+  bool steal(Chunk &c) {
+    std::lock_guard<std::mutex> lock(m);
+    if (chunks.empty()) return false;
+    c = chunks.front();
+    chunks.pop_front();
+    return true;
+  }
+};
+
+double identity(int op) {
+  switch (op) {
+  case KRT_RED_MUL: return 1.0;
+  case KRT_RED_MIN: return std::numeric_limits<double>::infinity();
+  case KRT_RED_MAX: return -std::numeric_limits<double>::infinity();
+  default: return 0.0;
+  }
+}
+
+double combine(int op, double x, double y) {
+  switch (op) {
+  case KRT_RED_ADD: return x + y;
+  case KRT_RED_MUL: return x * y;
+  case KRT_RED_MIN: return std::fmin(x, y);
+  case KRT_RED_MAX: return std::fmax(x, y);
+  default: return 0.0;
+  }
+}
+
+// Set on the threads that are running a parfor body: nested parfor loops
+// run sequentially on the thread that reaches them
+thread_local bool inparfor = false;
+
+class ThreadPool {
+private:
+  unsigned nthreads;
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<ChunkQueue>> queues;
+  std::vector<double> partials;     // Partial reduction of each thread
+  std::mutex loopm;                 // One loop at a time runs on the pool
+  std::mutex m;
+  std::condition_variable wakeup;
+  std::condition_variable finished;
+  unsigned long generation = 0;     // Incremented for every loop
+  unsigned busy = 0;                // Workers still running the current loop
+  std::atomic<long> remaining{0};   // Chunks not yet completed
+  krt_parfor_body body = nullptr;
+  void *env = nullptr;
+  int op = KRT_RED_NONE;
+
+  void runchunks(unsigned self) {
+    std::minstd_rand rng(self + 1);
+    Chunk c;
+    while (remaining.load(std::memory_order_acquire) > 0) {
+      bool found = queues[self]->pop(c);
+      // Own queue is empty: tries to steal from a random victim
+      for (unsigned tries = 0; !found && tries < 2 * nthreads; tries++) {
+        unsigned victim = rng() % nthreads;
+        if (victim != self)
+          found = queues[victim]->steal(c);
+      }
+      if (!found) {
+        std::this_thread::yield();
+        continue;
+      }
+      partials[self] = combine(op, partials[self], body(c.lo, c.hi, env));
+      remaining.fetch_sub(1, std::memory_order_acq_rel);
+    }
+  }
+
+  void worker(unsigned self) {
+    unsigned long seen = 0;
+    inparfor = true;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(m);
+        wakeup.wait(lock, [&] { return generation != seen; });
+        seen = generation;
+      }
+      runchunks(self);
+      std::lock_guard<std::mutex> lock(m);
+      if (--busy == 0)
+        finished.notify_one();
+    }
+  }
+
+public:
+  ThreadPool() {
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+    if (const char *env = std::getenv("KRT_NUM_THREADS"))
+      nthreads = std::max(1, std::atoi(env));
+    partials.resize(nthreads);
+    for (unsigned i = 0; i < nthreads; i++)
+      queues.emplace_back(new ChunkQueue);
+    for (unsigned i = 1; i < nthreads; i++) {
+      workers.emplace_back(&ThreadPool::worker, this, i);
+      workers.back().detach();
+    }
+  }
+
+  double run(krt_parfor_body b, void *e, double start, double end, int o) {
+    double n = std::ceil(end - start);
+    if (!(n > 0))
+      return identity(o);
+    // Nested loops, or pools with a single thread, run sequentially
+    if (inparfor || nthreads == 1)
+      return combine(o, identity(o), b(start, end, e));
+
+    std::lock_guard<std::mutex> looplock(loopm);
+    body = b; env = e; op = o;
+    // About 8 chunks per thread leave room for load balancing
+    double grain = std::max(1.0, std::ceil(n / (8.0 * nthreads)));
+    long nchunks = (long)std::ceil(n / grain);
+    for (long k = 0; k < nchunks; k++) {
+      double lo = start + k * grain;
+      double hi = k + 1 < nchunks ? start + (k + 1) * grain : end;
+      queues[k * nthreads / nchunks]->push({lo, hi});
+    }
+    std::fill(partials.begin(), partials.end(), identity(o));
+    remaining.store(nchunks, std::memory_order_release);
+    {
+      std::lock_guard<std::mutex> lock(m);
+      busy = nthreads - 1;
+      generation++;
+    }
+    wakeup.notify_all();
+
+    inparfor = true;
+    runchunks(0);
+    inparfor = false;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      finished.wait(lock, [&] { return busy == 0; });
+    }
+
+    double result = identity(o);
+    for (double p : partials)
+      result = combine(o, result, p);
+    return result;
+  }
+};
+
+} // namespace
+
+// The pool is never destroyed: its workers are detached and still wait on
+// it when the program exits
+double krt_parfor(krt_parfor_body body, void *env, double start, double end, int op) {
+  static ThreadPool *pool = new ThreadPool;
+  return pool->run(body, env, start, end, op);
+}
@@ -4,11 +4,12 @@
 # include <cstdlib>
 # include <string>
 # include <cmath>
+# include <sstream>
 # include "driver.hpp"
 # include "parser.hpp"
 %}
 
-%option noyywrap nounput batch debug noinput
+%option noyywrap nounput batch debug noinput reentrant
 
 id      [a-zA-Z][a-zA-Z_0-9]*
 fpnum   [0-9]*\.?[0-9]+([eE][-+]?[0-9]+)?
@@ -41,6 +42,7 @@ blank   [ \t]
 ")"      return yy::parser::make_RPAREN    (loc);
 ";"      return yy::parser::make_SEMICOLON (loc);
 ","      return yy::parser::make_COMMA     (loc);
+"."      return yy::parser::make_DOT       (loc);
 "?"      return yy::parser::make_QMARK     (loc);
 ":"      return yy::parser::make_COLON     (loc);
 "<"      return yy::parser::make_LT        (loc);
@@ -61,31 +63,52 @@ blank   [ \t]
 "extern" { return yy::parser::make_EXTERN(loc); }
 "var"    { return yy::parser::make_VAR(loc); }
 "global" { return yy::parser::make_GLOBAL(loc); }
+"export" { return yy::parser::make_EXPORT(loc); }
+"struct" { return yy::parser::make_STRUCT(loc); }
+"pure"   { return yy::parser::make_PURE(loc); }
+"memo"   { return yy::parser::make_MEMO(loc); }
 "if"     { return yy::parser::make_IF(loc); }
 "else"   { return yy::parser::make_ELSE(loc); }
 "for"    { return yy::parser::make_FOR(loc); }
+"while"  { return yy::parser::make_WHILE(loc); }
+"break"  { return yy::parser::make_BREAK(loc); }
+"continue" { return yy::parser::make_CONTINUE(loc); }
+"parfor" { return yy::parser::make_PARFOR(loc); }
+"reduce" { return yy::parser::make_REDUCE(loc); }
 "++"     { return yy::parser::make_INCR(loc); }
 "--"     { return yy::parser::make_DECR(loc); }
 "and"    { return yy::parser::make_AND(loc); }
 "or"     { return yy::parser::make_OR(loc); }
 "not"    { return yy::parser::make_NOT(loc); }
+"likely" { return yy::parser::make_LIKELY(loc); }
+"unlikely" { return yy::parser::make_UNLIKELY(loc); }
 "["      { return yy::parser::make_LSQBRACKET(loc); }
 "]"      { return yy::parser::make_RSQBRACKET(loc); }
 
 {id}     { return yy::parser::make_IDENTIFIER (yytext, loc); }
 
-.        { throw yy::parser::syntax_error
-               (loc, "invalid character: " + std::string(yytext));
+.        { // Reported here: the parser gives up without other messages
+           std::ostringstream where;
+           where << loc;
+           errStream() << where.str() << ": invalid character: " << yytext << '\n';
+           return yy::parser::make_YYerror (loc);
          }
          
 <<EOF>>  { return yy::parser::make_END (loc); }
 %%
 
+// The scanner is reentrant: its state belongs to the driver, so that
+// several threads can parse at the same time (see parallel.cpp)
 void driver::scan_begin () {
-  yy_flex_debug = trace_scanning;
-  if (file.empty () || file == "-")
-    yyin = stdin;
-  else if (!(yyin = fopen (file.c_str (), "r")))
+  yylex_init (&scanner);
+  yyset_debug (trace_scanning, scanner);
+  if (!input.empty ())
+    yy_scan_string (input.c_str (), scanner);
+  else if (file.empty () || file == "-")
+    yyset_in (stdin, scanner);
+  else if (FILE *in = fopen (file.c_str (), "r"))
+    yyset_in (in, scanner);
+  else
     {
       std::cerr << "cannot open " << file << ": " << strerror(errno) << '\n';
       exit (EXIT_FAILURE);
@@ -95,5 +118,8 @@ void driver::scan_begin () {
 void
 driver::scan_end ()
 {
-  fclose (yyin);
+  if (input.empty ())
+    fclose (yyget_in (scanner));
+  yylex_destroy (scanner);  // Also frees the buffer of parse_string
+  scanner = nullptr;
 }
@@ -0,0 +1,249 @@
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "driver.hpp"
+#include "server.hpp"
+
+extern thread_local LLVMContext *context;
+extern thread_local Module *module;
+extern thread_local IRBuilder<> *builder;
+
+/*************************** Protocol ****************************/
+// A request is made of the working directory of the client, the number
+// of arguments, the arguments and the text of each source file among them.
+// The reply holds the exit status, the standard output and the standard
+// error of the compilation. Every field is a string preceded by its length
+// (4 bytes, in the byte order of the host: both ends run on the same machine)
+
+static bool writeAll(int fd, const char *Data, size_t Size) {
+  while (Size > 0) {
+    ssize_t N = write(fd, Data, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Data += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool readAll(int fd, char *Data, size_t Size) {
+  while (Size > 0) {
+    ssize_t N = read(fd, Data, Size);
+    if (N < 0 && errno == EINTR)
+      continue;
+    if (N <= 0)
+      return false;
+    Data += N;
+    Size -= N;
+  }
+  return true;
+}
+
+static bool sendString(int fd, const std::string &S) {
+  uint32_t Size = S.size();
+  return writeAll(fd, reinterpret_cast<const char*>(&Size), sizeof(Size)) &&
+         writeAll(fd, S.data(), S.size());
+}
+
+static bool receiveString(int fd, std::string &S) {
+  uint32_t Size;
+  if (!readAll(fd, reinterpret_cast<char*>(&Size), sizeof(Size)))
+    return false;
+  S.resize(Size);
+  return readAll(fd, &S[0], Size);
+}
+
+// Source files are the arguments that are not options ("-" is the standard input)
+static bool isSource(const std::string &Arg) {
+  return Arg.empty() || Arg == "-" || Arg[0] != '-';
+}
+
+// Options that only make sense in the process of the user: running
+// programs on the JIT and tracing the parser and the scanner
+static bool isLocal(const std::vector<std::string> &Args) {
+  for (auto &Arg : Args) {
+    if (Arg == "-run" || Arg == "-repl" || Arg == "-p" || Arg == "-s")
+      return true;
+  }
+  return false;
+}
+
+static bool socketAddress(const std::string &Socket, sockaddr_un &Addr) {
+  std::memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if (Socket.size() >= sizeof(Addr.sun_path))
+    return false;
+  std::strcpy(Addr.sun_path, Socket.c_str());
+  return true;
+}
+
+std::string defaultSocket() {
+  if (const char *Socket = std::getenv("KCOMP_SOCKET"))
+    return Socket;
+  return "/tmp/kcomp-" + std::to_string(getuid()) + ".sock";
+}
+
+/**************************** Server *****************************/
+// Each request is compiled in a new context, module and builder of the
+// worker thread, so that nothing is left over from the previous ones
+static void freshContext() {
+  delete builder;
+  delete module;
+  delete context;
+  context = new LLVMContext;
+  module = new Module("Kaleidoscope", *context);
+  builder = new IRBuilder(*context);
+}
+
+static void handle(int fd) {
+  std::string Dir, Count;
+  std::vector<std::string> Args;
+  std::map<std::string, std::string> Sources;
+  bool Ok = receiveString(fd, Dir) && receiveString(fd, Count);
+  for (int i=0, e=Ok ? std::atoi(Count.c_str()) : 0; Ok && i<e; i++) {
+    Args.emplace_back();
+    Ok = receiveString(fd, Args.back());
+  }
+  for (auto &Arg : Args) {
+    if (Ok && isSource(Arg))
+      Ok = receiveString(fd, Sources[Arg]);
+  }
+  if (!Ok) {
+    close(fd);
+    return;
+  }
+
+  std::string Out, Err;
+  raw_string_ostream OutStream(Out), ErrStream(Err);
+  int Result = 1;
+  if (isLocal(Args)) {
+    ErrStream << "-run, -repl, -p and -s are not supported by the compile server\n";
+  } else {
+    freshContext();
+    redirectOutput(&ErrStream, &OutStream);
+    Result = compile(Args, &Sources, Dir);
+    redirectOutput(nullptr, nullptr);
+  }
+  OutStream.flush();
+  ErrStream.flush();
+  sendString(fd, std::to_string(Result)) && sendString(fd, Out) && sendString(fd, Err);
+  close(fd);
+}
+
+// The targets are initialized once, then the main thread accepts the
+// connections and queues them for the pool of workers
+int serve(const std::string &Socket, unsigned Jobs) {
+  if (Jobs == 0)
+    Jobs = std::max(1u, std::thread::hardware_concurrency());
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+  std::signal(SIGPIPE, SIG_IGN);  // Clients may go away before the reply
+
+  sockaddr_un Addr;
+  if (!socketAddress(Socket, Addr)) {
+    errs() << "socket name too long: " << Socket << "\n";
+    return 1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(Socket.c_str());
+  if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&Addr), sizeof(Addr)) < 0 ||
+      chmod(Socket.c_str(), 0600) < 0 || listen(fd, 128) < 0) {
+    errs() << "cannot listen on " << Socket << ": " << std::strerror(errno) << "\n";
+    return 1;
+  }
+
+  static std::mutex QueueMutex;
+  static std::condition_variable QueueReady;
+  static std::deque<int> Queue;
+  for (unsigned i=0; i<Jobs; i++) {
+    std::thread([] {
+      for (;;) {
+        int Client;
+        {
+          std::unique_lock<std::mutex> Lock(QueueMutex);
+          QueueReady.wait(Lock, [] { return !Queue.empty(); });
+          Client = Queue.front();
+          Queue.pop_front();
+        }
+        handle(Client);
+      }
+    }).detach();
+  }
+  for (;;) {
+    int Client = accept(fd, nullptr, nullptr);
+    if (Client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      errs() << "accept failed on " << Socket << ": " << std::strerror(errno) << "\n";
+      return 1;
+    }
+    {
+      std::lock_guard<std::mutex> Lock(QueueMutex);
+      Queue.push_back(Client);
+    }
+    QueueReady.notify_one();
+  }
+}
+
+/**************************** Client *****************************/
+bool request(const std::string &Socket, const std::vector<std::string> &Args, int &Result) {
+  sockaddr_un Addr;
+  if (isLocal(Args) || !socketAddress(Socket, Addr))
+    return false;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  if (connect(fd, reinterpret_cast<sockaddr*>(&Addr), sizeof(Addr)) < 0) {
+    close(fd);
+    return false;
+  }
+
+  // The sources are read here: the server may not see the files of the
+  // client, and relative names refer to the directory of the client
+  SmallString<256> Dir;
+  sys::fs::current_path(Dir);
+  bool Ok = sendString(fd, std::string(Dir)) && sendString(fd, std::to_string(Args.size()));
+  for (auto &Arg : Args)
+    Ok = Ok && sendString(fd, Arg);
+  for (auto &Arg : Args) {
+    if (!isSource(Arg))
+      continue;
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Text = MemoryBuffer::getFileOrSTDIN(Arg);
+    if (!Text) {
+      errs() << "cannot open " << Arg << ": " << Text.getError().message() << "\n";
+      close(fd);
+      Result = 1;
+      return true;
+    }
+    Ok = Ok && sendString(fd, (*Text)->getBuffer().str());
+  }
+
+  std::string Status, Out, Err;
+  Ok = Ok && receiveString(fd, Status) && receiveString(fd, Out) && receiveString(fd, Err);
+  close(fd);
+  if (!Ok) {
+    errs() << "the compile server on " << Socket << " closed the connection\n";
+    Result = 1;
+    return true;
+  }
+  outs() << Out;
+  outs().flush();
+  errs() << Err;
+  Result = std::atoi(Status.c_str());
+  return true;
+}
@@ -0,0 +1,29 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+#include <map>
+#include <string>
+#include <vector>
+
+// Compile server (kcomp --server): a daemon listening on a Unix domain
+// socket, whose worker threads compile the requests sent by kcomp --client
+// without paying again for the start-up of the process and of LLVM
+
+// Socket used when --socket= is not given: $KCOMP_SOCKET, or a file in
+// /tmp private to the user
+std::string defaultSocket();
+
+// Runs the server with the given number of worker threads (one per core
+// if 0). Returns only if the socket cannot be used
+int serve(const std::string &Socket, unsigned Jobs);
+
+// Sends the compilation of the command line Args to the server and prints
+// its output. Returns false, without doing anything, when the compilation
+// must be done by the client itself: the server is not running or Args
+// run programs (-run, -repl) or trace the parser (-p, -s)
+bool request(const std::string &Socket, const std::vector<std::string> &Args, int &Result);
+
+// Compilation of a command line (see kcomp.cpp)
+int compile(const std::vector<std::string> &args, const std::map<std::string, std::string> *Sources,
+            const std::string &workdir);
+
+#endif // ! SERVER_HPP
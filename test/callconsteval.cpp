@@ -0,0 +1,21 @@
+#include <iostream>
+
+extern "C" {
+    double circle(double);
+    double diagonal(double);
+    double binomial(double, double);
+}
+
+int main() {
+    double r, l, n, k;
+    std::cout << "Inserisci il raggio del cerchio: ";
+    std::cin >> r;
+    std::cout << "Inserisci il lato del quadrato: ";
+    std::cin >> l;
+    std::cout << "Inserisci n e k: ";
+    std::cin >> n >> k;
+    std::cout << "area del cerchio = " << circle(r) << std::endl;
+    std::cout << "diagonale del quadrato = " << diagonal(l) << std::endl;
+    std::cout << "binomiale(" << n << ", " << k << ") = " << binomial(n, k) << std::endl;
+    return 0;
+}
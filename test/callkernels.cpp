@@ -0,0 +1,54 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+extern "C" {
+    double hrand(double*, double, double);
+    double krand(double*, double, double);
+    double hmin(double*, double);
+    double kmin(double*, double);
+    double hfill(double*, double, double);
+    double kfill(double*, double, double);
+    double hcopy(double*, double*, double);
+    double kcopy(double*, double*, double);
+    double hsort(double*, double);
+    double ksort(double*, double);
+    double sorted(double*, double);
+}
+
+// Tempo (in millisecondi) di reps esecuzioni di f
+template <typename F>
+double ms(int reps, F f) {
+    auto start = std::chrono::steady_clock::now();
+    for (int r=0; r<reps; r++)
+        f();
+    std::chrono::duration<double, std::milli> t = std::chrono::steady_clock::now() - start;
+    return t.count();
+}
+
+void report(const char *name, double hand, double kernel) {
+    std::cout << name << ": scritto a mano " << hand << " ms, builtin " << kernel
+              << " ms (" << hand/kernel << "x)" << std::endl;
+}
+
+int main() {
+    const int n = 1000000, ns = 20000, reps = 20;
+    std::vector<double> a(n), b(n), s(ns), t(ns);
+    report("rand_fill", ms(reps, [&]{ hrand(a.data(), n, 42); }),
+                        ms(reps, [&]{ krand(a.data(), n, 42); }));
+    double m1 = 0, m2 = 0;
+    report("minval", ms(reps, [&]{ m1 = hmin(a.data(), n); }),
+                     ms(reps, [&]{ m2 = kmin(a.data(), n); }));
+    report("fill", ms(reps, [&]{ hfill(b.data(), n, 1); }),
+                   ms(reps, [&]{ kfill(b.data(), n, 1); }));
+    report("copy", ms(reps, [&]{ hcopy(a.data(), b.data(), n); }),
+                   ms(reps, [&]{ kcopy(a.data(), b.data(), n); }));
+    kcopy(a.data(), s.data(), ns);
+    kcopy(a.data(), t.data(), ns);
+    report("sort", ms(1, [&]{ hsort(s.data(), ns); }),
+                   ms(1, [&]{ ksort(t.data(), ns); }));
+    std::cout << "minimi uguali: " << (m1 == m2) << ", ordinati: "
+              << sorted(s.data(), ns) << " " << sorted(t.data(), ns)
+              << ", uguali: " << (s == t) << std::endl;
+    return 0;
+}
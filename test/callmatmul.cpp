@@ -0,0 +1,19 @@
+#include <iostream>
+
+extern "C" {
+    double init(double);
+    double matmul();
+    double trace();
+    double total();
+}
+
+int main() {
+    double a;
+    std::cout << "Inserisci il valore di a: ";
+    std::cin >> a;
+    init(a);
+    matmul();
+    std::cout << "traccia di (a*I)*B = " << trace() << std::endl;
+    std::cout << "somma degli elementi di (a*I)*B = " << total() << std::endl;
+    return 0;
+}
@@ -0,0 +1,17 @@
+#include <iostream>
+
+extern "C" {
+    double fill(double);
+    double total(double);
+    double maxval(double);
+}
+
+int main() {
+    double n;
+    std::cout << "Inserisci il numero di elementi (al massimo 100000): ";
+    std::cin >> n;
+    fill(n);
+    std::cout << "somma = " << total(n) << std::endl;
+    std::cout << "massimo = " << maxval(n) << std::endl;
+    return 0;
+}
@@ -0,0 +1,21 @@
+#include <iostream>
+
+extern "C" {
+    double init(double);
+    double step(double, double);
+    double center(double);
+    double centersoa(double);
+}
+
+int main() {
+    double n, dt;
+    std::cout << "Inserisci il numero di particelle (al più 100): ";
+    std::cin >> n;
+    std::cout << "Inserisci il passo temporale: ";
+    std::cin >> dt;
+    init(n);
+    step(n, dt);
+    std::cout << "baricentro (array di struct) = " << center(n) << std::endl;
+    std::cout << "baricentro (struct di array) = " << centersoa(n) << std::endl;
+    return 0;
+}
@@ -0,0 +1,15 @@
+#include <iostream>
+
+extern "C" {
+    double primes(double);
+    double trials(double, double);
+}
+
+int main() {
+    double n;
+    std::cout << "Inserisci n: ";
+    std::cin >> n;
+    std::cout << "numeri primi minori di n = " << primes(n) << std::endl;
+    std::cout << "media su 100 prove = " << trials(n, 100) << std::endl;
+    return 0;
+}
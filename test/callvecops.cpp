@@ -0,0 +1,19 @@
+#include <iostream>
+
+extern "C" {
+    double init();
+    double axpy(double);
+    double norm();
+    double mean();
+}
+
+int main() {
+    double a;
+    std::cout << "Inserisci il valore di a: ";
+    std::cin >> a;
+    init();
+    axpy(a);
+    std::cout << "norma di a*X+Y = " << norm() << std::endl;
+    std::cout << "media di a*X+Y = " << mean() << std::endl;
+    return 0;
+}
@@ -0,0 +1,20 @@
+#include <iostream>
+
+// vecops.k compilato con -fsingle: numeri float
+extern "C" {
+    float init();
+    float axpy(float);
+    float norm();
+    float mean();
+}
+
+int main() {
+    float a;
+    std::cout << "Inserisci il valore di a: ";
+    std::cin >> a;
+    init();
+    axpy(a);
+    std::cout << "norma di a*X+Y = " << norm() << std::endl;
+    std::cout << "media di a*X+Y = " << mean() << std::endl;
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+    double vsort(double*, double);
+    double sorted(double*, double);
+    double scale(double*, double*, double, double);
+}
+
+int main() {
+    int n;
+    std::cout << "Inserisci il numero di elementi: ";
+    std::cin >> n;
+    std::vector<double> v(n), w(n);
+    for (int i=0; i<n; i++) {
+       v[i] = std::rand() % 1000;
+    };
+    // Gli array vengono passati senza copiarli
+    scale(v.data(), w.data(), n, -1);
+    vsort(v.data(), n);
+    vsort(w.data(), n);
+    std::cout << "v ordinato: " << sorted(v.data(), n) << std::endl;
+    std::cout << "w ordinato: " << sorted(w.data(), n) << std::endl;
+    std::cout << "minimo = " << v[0] << ", massimo = " << -w[0] << std::endl;
+    return 0;
+}